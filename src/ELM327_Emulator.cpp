@@ -55,6 +55,7 @@ ELM327Emu::ELM327Emu()
     bMonitorMode = false;
     bDLC = false;
     sendingBus = 0;
+    txReader = txBuffer.addReader();
 }
 
 /*
@@ -153,23 +154,25 @@ void ELM327Emu::loop() {
 
 void ELM327Emu::sendTxBuffer()
 {
-    if (mClient)
+    uint8_t *buff;
+    size_t length;
+    while ((length = txBuffer.peekBytes(txReader, &buff)) > 0)
     {
-        size_t wifiLength = txBuffer.numAvailableBytes();
-        uint8_t* buff = txBuffer.getBufferedBytes();
-        if (mClient->connected())
+        if (mClient)
         {
-            mClient->write(buff, wifiLength);
+            if (mClient->connected())
+            {
+                mClient->write(buff, length);
+            }
         }
-    }
-    else //bluetooth then
-    {
+        else //bluetooth then
+        {
 #ifndef CONFIG_IDF_TARGET_ESP32S3
-        serialBT.write(txBuffer.getBufferedBytes(), txBuffer.numAvailableBytes());
-        //Serial.write(txBuffer.getBufferedBytes(), txBuffer.numAvailableBytes());
+            serialBT.write(buff, length);
 #endif
+        }
+        txBuffer.consumeBytes(txReader, length);
     }
-    txBuffer.clearBufferedBytes();
 }
 
 /*
@@ -335,7 +338,8 @@ String ELM327Emu::processELMCmd(char *cmd)
         canManager.displayFrame(outFrame, sendingBus);
         canManager.setSendToConsole(false);
         */
-        canManager.sendFrame(canBuses[sendingBus], outFrame);
+        //the reply is being waited on so the request goes ahead of anything queued at lower priority
+        canManager.sendFrame(sendingBus, outFrame, TX_PRIO_HIGH);
     }
 
     retString.concat(lineEnding);
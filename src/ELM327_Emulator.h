@@ -78,6 +78,7 @@ private:
 #endif
     WiFiClient *mClient;
     CommBuffer txBuffer;
+    int txReader;
     char incomingBuffer[128]; //storage for one incoming line
     char buffer[30]; // a buffer for various string conversions
     bool bLineFeed; //should we use line feeds?
@@ -38,6 +38,15 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "gvret_comm.h"
 #include "can_manager.h"
 #include "lawicel.h"
+#include "frame_router.h"
+#include "frame_filter.h"
+#include "frame_decimator.h"
+#include "tx_scheduler.h"
+#include "cyclic_tx.h"
+#include "frame_generator.h"
+#include "replay_engine.h"
+#include "black_box.h"
+#include "staging_queue.h"
 
 //on the S3 we want the default pins to be different
 #ifdef CONFIG_IDF_TARGET_ESP32S3
@@ -68,6 +77,15 @@ GVRET_Comm_Handler serialGVRET; //gvret protocol over the serial to USB connecti
 GVRET_Comm_Handler wifiGVRET; //GVRET over the wifi telnet port
 CANManager canManager; //keeps track of bus load and abstracts away some details of how things are done
 LAWICELHandler lawicel;
+FrameRouter frameRouter; //decides which outputs get frames from which bus
+FrameFilter frameFilter; //software ID filtering of received frames
+FrameDecimator frameDecimator; //per ID rate limiting of received frames
+TxScheduler txScheduler; //per bus transmit queues
+CyclicTx cyclicTx; //frames sent on a timer without the host
+FrameGenerator frameGenerator; //counters, checksums and signals filled into sent frames
+ReplayEngine replayEngine; //timed playback of uploaded captures
+BlackBox blackBox; //pre/post trigger capture
+StagingQueue stagingQueue; //holds frames while the outputs are stalled
 
 SerialConsole console;
 
@@ -75,6 +93,21 @@ CRGB leds[A5_NUM_LEDS]; //A5 has the largest # of LEDs so use that one even for
 
 CAN_COMMON *canBuses[NUM_BUSES];
 
+static void writeSerial(uint8_t *bytes, size_t length)
+{
+    Serial.write(bytes, length);
+}
+
+static bool serialSinkActive()
+{
+    return canManager.getSendToConsole();
+}
+
+static bool wifiSinkActive()
+{
+    return SysSettings.isWifiActive;
+}
+
 //initializes all the system EEPROM values. Chances are this should be broken out a bit but
 //there is only one checksum check for all of them so it's simple to do it all here.
 void loadSettings()
@@ -93,6 +126,9 @@ void loadSettings()
     settings.enableBT = nvPrefs.getBool("enable-bt", false);
     settings.enableLawicel = nvPrefs.getBool("enableLawicel", true);
     settings.sendingBus = nvPrefs.getInt("sendingBus", 0);
+    settings.useDriverCapture = nvPrefs.getBool("captasks", true); //key kept from when capture had its own tasks
+    settings.stagingKB = nvPrefs.getUShort("stagingkb", 0);
+    settings.idTableSize = nvPrefs.getUShort("idtable", 0);
 
     uint8_t defaultVal = (espChipRevision > 2) ? 0 : 1; //0 = A0, 1 = EVTV ESP32
 #ifdef CONFIG_IDF_TARGET_ESP32S3
@@ -132,6 +168,7 @@ void loadSettings()
         pinMode(21, OUTPUT);
         digitalWrite(21, LOW);
         CAN0.setCANPins(GPIO_NUM_4, GPIO_NUM_5);
+        SysSettings.reservedPins = PIN_BIT(4) | PIN_BIT(5) | PIN_BIT(13) | PIN_BIT(21) | PIN_BIT(A0_LED_PIN);
     }
 
     if (settings.systemType == 1)
@@ -157,6 +194,9 @@ void loadSettings()
         strcpy(deviceName, EVTV_NAME);
         strcpy(otaHost, "media3.evtv.me");
         strcpy(otaFilename, "/esp32ret.bin");
+        //CAN0 and CAN1 on their library default pins, CAN1 on the default SPI bus
+        SysSettings.reservedPins = PIN_BIT(16) | PIN_BIT(17) | PIN_BIT(5) | PIN_BIT(27) |
+                                   PIN_BIT(18) | PIN_BIT(19) | PIN_BIT(23);
     }
 
     if (settings.systemType == 2)
@@ -210,6 +250,9 @@ void loadSettings()
         //HH = Normal Mode
         digitalWrite(SW_MODE0, HIGH);
         digitalWrite(SW_MODE1, HIGH);
+        SysSettings.reservedPins = PIN_BIT(4) | PIN_BIT(5) | PIN_BIT(32) | PIN_BIT(36) | PIN_BIT(33) | PIN_BIT(39) |
+                                   PIN_BIT(25) | PIN_BIT(34) | PIN_BIT(14) | PIN_BIT(13) | PIN_BIT(18) | PIN_BIT(19) |
+                                   PIN_BIT(23) | PIN_BIT(SW_EN) | PIN_BIT(SW_MODE0) | PIN_BIT(SW_MODE1) | PIN_BIT(A5_LED_PIN);
     }
 
     if (settings.systemType == 3)
@@ -237,6 +280,9 @@ void loadSettings()
         strcpy(deviceName, EVTV_NAME);
         strcpy(otaHost, "media3.evtv.me");
         strcpy(otaFilename, "/esp32s3ret.bin");
+        //CAN0 on its library default pins, CAN1 as set up at the top of this file on the S3's default SPI bus
+        SysSettings.reservedPins = PIN_BIT(16) | PIN_BIT(17) | PIN_BIT(10) | PIN_BIT(3) |
+                                   PIN_BIT(11) | PIN_BIT(12) | PIN_BIT(13);
     }
 
     if (nvPrefs.getString("SSID", settings.SSID, 32) == 0)
@@ -268,10 +314,21 @@ void loadSettings()
         settings.canSettings[i].fdSpeed = nvPrefs.getUInt(buff, 5000000);
         sprintf(buff, "can%i-fdmode", i);
         settings.canSettings[i].fdMode = nvPrefs.getBool(buff, false);
+        sprintf(buff, "can%i-route", i);
+        settings.busRoutes[i] = nvPrefs.getUChar(buff, ROUTE_AUTO);
+        sprintf(buff, "can%i-delta", i);
+        settings.deltaMode[i] = nvPrefs.getBool(buff, false);
+        sprintf(buff, "can%i-hbeat", i);
+        settings.deltaHeartbeat[i] = nvPrefs.getUShort(buff, 1000);
+        sprintf(buff, "can%i-txgap", i);
+        settings.txGap[i] = nvPrefs.getUShort(buff, 0);
     }
 
     nvPrefs.end();
 
+    frameFilter.loadSettings();
+    frameDecimator.loadSettings();
+
     Logger::setLoglevel((Logger::LogLevel)settings.logLevel);
 
     for (int rx = 0; rx < NUM_BUSES; rx++) SysSettings.lawicelBusReception[rx] = true; //default to showing messages on RX 
@@ -304,6 +361,14 @@ void setup()
 
     canManager.setup();
 
+    if (!serialGVRET.startSender("SerialTX", writeSerial)) Serial.println("Could not start serial sender task");
+
+    serialGVRET.setWireFormat(settings.useBinarySerialComm ? FORMAT_GVRET_BINARY : FORMAT_GVRET_TEXT);
+    wifiGVRET.setWireFormat(settings.useBinarySerialComm ? FORMAT_GVRET_BINARY : FORMAT_GVRET_TEXT);
+    frameRouter.registerSink(SINK_SERIAL, &serialGVRET, serialSinkActive);
+    frameRouter.registerSink(SINK_WIFI, &wifiGVRET, wifiSinkActive);
+    for (int i = 0; i < NUM_BUSES; i++) frameRouter.setRoute(i, settings.busRoutes[i]);
+
     if (settings.enableBT) 
     {
         Serial.println("Starting bluetooth");
@@ -320,7 +385,6 @@ void setup()
     SysSettings.lawicelMode = false;
     SysSettings.lawicelAutoPoll = false;
     SysSettings.lawicelTimestamping = false;
-    SysSettings.lawicelPollCounter = 0;
     
     //elmEmulator.setup();
 
@@ -342,6 +406,7 @@ void sendMarkTriggered(int which)
     frame.extended = true;
     frame.length = 0;
     frame.rtr = 0;
+    frame.timestamp = micros();
     canManager.displayFrame(frame, 0);
 }
 
@@ -362,41 +427,36 @@ void loop()
     //uint32_t temp32;    
     bool isConnected = false;
     int serialCnt;
-    uint8_t in_byte;
+    uint8_t inBytes[GVRET_READ_CHUNK];
 
     /*if (Serial)*/ isConnected = true;
 
-    if (SysSettings.lawicelPollCounter > 0) SysSettings.lawicelPollCounter--;
-    //}
-
     canManager.loop();
     /*if (!settings.enableBT)*/ wifiManager.loop();
+    serialGVRET.loop();
+    wifiGVRET.loop();
 
-    size_t wifiLength = wifiGVRET.numAvailableBytes();
-    size_t serialLength = serialGVRET.numAvailableBytes();
+    size_t wifiLength = wifiGVRET.pendingBytes();
+    size_t serialLength = serialGVRET.pendingBytes();
     size_t maxLength = (wifiLength>serialLength) ? wifiLength : serialLength;
 
     //If the max time has passed or the buffer is almost filled then send buffered data out
     if ((micros() - lastFlushMicros > SER_BUFF_FLUSH_INTERVAL) || (maxLength > (WIFI_BUFF_SIZE - 40)) ) 
     {
         lastFlushMicros = micros();
-        if (serialLength > 0) 
-        {
-            Serial.write(serialGVRET.getBufferedBytes(), serialLength);
-            serialGVRET.clearBufferedBytes();
-        }
+        if (serialLength > 0) serialGVRET.flushBuffer();
         if (wifiLength > 0)
         {
             wifiManager.sendBufferedData();
         }
     }
 
-    serialCnt = 0;
-    while ( (Serial.available() > 0) && serialCnt < 128 ) 
+    serialCnt = Serial.available();
+    if (serialCnt > 0)
     {
-        serialCnt++;
-        in_byte = Serial.read();
-        serialGVRET.processIncomingByte(in_byte);
+        if (serialCnt > GVRET_READ_CHUNK) serialCnt = GVRET_READ_CHUNK;
+        serialCnt = Serial.read(inBytes, serialCnt);
+        serialGVRET.processIncomingBytes(inBytes, serialCnt);
     }
 
     elmEmulator.loop();
@@ -37,6 +37,16 @@
 #include "lawicel.h"
 #include "ELM327_Emulator.h"
 #include "can_manager.h"
+#include "gvret_comm.h"
+#include "frame_router.h"
+#include "frame_filter.h"
+#include "frame_decimator.h"
+#include "tx_scheduler.h"
+#include "cyclic_tx.h"
+#include "frame_generator.h"
+#include "replay_engine.h"
+#include "black_box.h"
+#include "staging_queue.h"
 
 extern void CANHandler();
 
@@ -67,6 +77,7 @@ void SerialConsole::printMenu()
     Serial.println("R = reset to factory defaults");
     Serial.println("s = Start logging to file");
     Serial.println("S = Stop logging to file");
+    Serial.println("i = show output buffer, capture and bus load statistics");
     Serial.println();
     Serial.println("Config Commands (enter command=newvalue). Current values shown in parenthesis:");
     Serial.println();
@@ -86,7 +97,18 @@ void SerialConsole::printMenu()
         }
         Logger::console("CANLISTENONLY%i=%i - Enable/Disable Listen Only Mode (0 = Dis, 1 = En)", i, settings.canSettings[i].listenOnly);
         Serial.println();
+        Logger::console("ROUTE%i=%i - Where CAN%i frames go (0 = Auto, 1 = USB, 2 = WiFi, 3 = USB and WiFi)", i, settings.busRoutes[i], i);
         Logger::console("CANSEND%i=ID,LEN,<BYTES SEPARATED BY COMMAS> - Ex: CAN0SEND=0x200,4,1,2,3,4", i);
+        Logger::console("CYCLIC%i=ID,PERIOD,LEN,<BYTES SEPARATED BY COMMAS> - Send a frame on CAN%i every PERIOD ms. Ex: CYCLIC0=0x200,10,2,1,2", i, i);
+        Logger::console("GEN%i=ID,TYPE,STARTBIT,WIDTH,A,B,PERIOD - Fill a field of frames sent on CAN%i. GENHELP=1 explains", i, i);
+        Logger::console("TXGAP%i=%i - Least time between frames sent on CAN%i in microseconds (0 = no limit)", i, settings.txGap[i], i);
+        Logger::console("FILTERMODE%i=%i - Software ID filter on CAN%i (0 = Off, 1 = Only listed IDs, 2 = All but listed IDs)", i, frameFilter.getMode(i), i);
+        Logger::console("FILTERADD%i=ID or LOW-HIGH - Add an ID or range to the list. IDs over 0x7FF or ending in X are extended", i);
+        Logger::console("FILTERDEL%i=ID - Remove an ID from the list. FILTERCLEAR%i=1 empties it", i, i);
+        Logger::console("DELTA%i=%i - Only send CAN%i frames whose data changed (0 = Off, 1 = On)", i, settings.deltaMode[i], i);
+        Logger::console("HEARTBEAT%i=%i - In delta mode resend unchanged IDs this often in ms (0 = never)", i, settings.deltaHeartbeat[i]);
+        Logger::console("DECIMATE%i=RULE - Default decimation for CAN%i IDs (0 = Off, R<n> = n frames/s, N<k> = every kth frame)", i, i);
+        Logger::console("DECIMATEID%i=ID,RULE - Decimation for one ID, RULE as above. 0 goes back to the default", i);
         Serial.println();
     }
 
@@ -104,6 +126,35 @@ void SerialConsole::printMenu()
     Logger::console("LAWICEL=%i - Set whether to accept LAWICEL commands (0 = Off, 1 = On)", settings.enableLawicel);
     Serial.println();
 
+    Logger::console("THINNED=BUS - List the IDs decimation has held frames back from on that bus");
+    Logger::console("IDSTATS=BUS - List every ID seen on that bus with its count, period, jitter and last data");
+    Logger::console("IDRESET=BUS - Forget every ID seen on that bus and start its statistics over");
+    Logger::console("IDTABLE=%i - Slots in each bus' ID table, a power of two, 3/4 of it usable (0 = %i with PSRAM, %i without) - takes effect on reboot",
+                    settings.idTableSize, ID_TABLE_SIZE, ID_TABLE_SIZE_INTERNAL);
+    Serial.println();
+
+    Logger::console("CYCLICLIST=1 - List the cyclic transmit table with how late and how evenly each entry went out");
+    Logger::console("CYCLICON=N or CYCLICOFF=N - Resume or pause cyclic entry N");
+    Logger::console("CYCLICDEL=N - Remove cyclic entry N. CYCLICCLEAR=1 removes them all");
+    Logger::console("GENLIST=1 - List the payload generator rules. GENDEL=N removes rule N, GENCLEAR=1 removes them all");
+    Serial.println();
+
+    Logger::console("REPLAY=LOOPS,SPEED - Play the capture uploaded over GVRET LOOPS times (0 = until stopped) at SPEED percent");
+    Logger::console("REPLAYSTOP=1 - Stop playing it");
+    Serial.println();
+
+    Logger::console("BBDEPTH=PRE,POST - Size the black box for PRE frames before its trigger and POST after. Download is over GVRET");
+    Logger::console("BBTRIGID=BUS,ID,MASK - Trigger on a frame whose ID matches under MASK (BUS 255 = any bus, ID 0 = off)");
+    Logger::console("BBTRIGDATA=<BYTES SEPARATED BY COMMAS> - and whose data starts with these bytes, XX matches any byte");
+    Logger::console("BBTRIGBUSOFF=1 - Trigger on CAN0 going bus off. BBTRIGINPUT=PIN,LEVEL triggers on a GPIO going to LEVEL (PIN -1 = off)");
+    Logger::console("BBARM=1 - Start recording and watching for the trigger (0 = stop). BBTRIGGER=1 triggers it now");
+    Serial.println();
+
+    Logger::console("CAPTURE=%i - Take frames from each CAN driver's receive callback (0 = Poll from main loop, 1 = Driver callback) - takes effect on reboot", settings.useDriverCapture);
+    Logger::console("STAGING=%i - KB of queue to hold frames in while the outputs are stalled (0 = Off). PSRAM if there is some", settings.stagingKB);
+    Logger::console("STAGINGRESET=1 - Start the staging queue high water marks over");
+    Serial.println();
+
     Logger::console("WIFIMODE=%i - Set mode for WiFi (0 = Wifi Off, 1 = Connect to AP, 2 = Create AP", settings.wifiMode);
     Logger::console("SSID=%s - Set SSID to either connect to or create", (char *)settings.SSID);
     Logger::console("WPA2KEY=%s - Either passphrase or actual key", (char *)settings.WPA2Key);
@@ -170,6 +221,9 @@ void SerialConsole::handleShortCmd()
         CAN0.setDebuggingMode(false);
         CAN1.setDebuggingMode(false);
         break;    
+    case 'i':
+        printStatistics();
+        break;
     default:
         if (settings.enableLawicel) lawicel.handleShortCmd(cmdBuffer[0]);
         break;
@@ -291,43 +345,208 @@ void SerialConsole::handleConfigCmd()
             }
             writeEEPROM = true;
         } else Logger::console("Invalid setting! Enter a value 0 - 1");
-    } else if (cmdString == String("CAN0FILTER0")) { //someone should kick me in the face for this laziness... FIX THIS!
-        handleFilterSet(0, 0, newString);
-    } else if (cmdString == String("CAN0FILTER1")) {
-        if (handleFilterSet(0, 1, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER2")) {
-        if (handleFilterSet(0, 2, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER3")) {
-        if (handleFilterSet(0, 3, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER4")) {
-        if (handleFilterSet(0, 4, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER5")) {
-        if (handleFilterSet(0, 5, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER6")) {
-        if (handleFilterSet(0, 6, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER7")) {
-        if (handleFilterSet(0, 7, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER0")) {
-        if (handleFilterSet(1, 0, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER1")) {
-        if (handleFilterSet(1, 1, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER2")) {
-        if (handleFilterSet(1, 2, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER3")) {
-        if (handleFilterSet(1, 3, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER4")) {
-        if (handleFilterSet(1, 4, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER5")) {
-        if (handleFilterSet(1, 5, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER6")) {
-        if (handleFilterSet(1, 6, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER7")) {
-        if (handleFilterSet(1, 7, newString)) writeEEPROM = true;
+    } else if (cmdString.length() == 11 && cmdString.startsWith("CAN") && cmdString.substring(4, 10) == String("FILTER")) {
+        int bus = cmdString[3] - '0';
+        int filter = cmdString[10] - '0';
+        if (bus < 0 || bus >= SysSettings.numBuses || filter < 0 || filter >= FILTER_MASK_SLOTS) {
+            Logger::console("No such filter slot");
+        } else if (handleFilterSet(bus, filter, newString)) writeEEPROM = true;
+    } else if (cmdString.startsWith("ROUTE")) {
+        int idx = cmdString[cmdString.length() - 1] - '0';
+        if (idx < 0) idx = 0;
+        if (idx > (SysSettings.numBuses - 1)) idx = SysSettings.numBuses - 1;
+        if (newValue >= 0 && newValue < (1 << NUM_SINKS)) {
+            Logger::console("Setting CAN%i output route to %i", idx, newValue);
+            settings.busRoutes[idx] = newValue;
+            frameRouter.setRoute(idx, newValue);
+            writeEEPROM = true;
+        } else Logger::console("Invalid route! Enter a value 0 - %i", (1 << NUM_SINKS) - 1);
+    } else if (cmdString.startsWith("FILTERMODE")) {
+        int idx = cmdString[cmdString.length() - 1] - '0';
+        if (idx < 0) idx = 0;
+        if (idx > (SysSettings.numBuses - 1)) idx = SysSettings.numBuses - 1;
+        if (newValue < 0) newValue = 0;
+        if (newValue > 2) newValue = 2;
+        Logger::console("Setting CAN%i filter mode to %i", idx, newValue);
+        frameFilter.setMode(idx, (FILTER_MODE)newValue);
+        frameFilter.saveSettings(idx);
+    } else if (cmdString.startsWith("FILTERADD")) {
+        int idx = cmdString[cmdString.length() - 1] - '0';
+        if (idx < 0) idx = 0;
+        if (idx > (SysSettings.numBuses - 1)) idx = SysSettings.numBuses - 1;
+        if (handleFilterAdd(idx, newString)) frameFilter.saveSettings(idx);
+        else Logger::console("Could not add to the CAN%i filter list", idx);
+    } else if (cmdString.startsWith("FILTERDEL")) {
+        int idx = cmdString[cmdString.length() - 1] - '0';
+        uint32_t id;
+        bool extended;
+        if (idx < 0) idx = 0;
+        if (idx > (SysSettings.numBuses - 1)) idx = SysSettings.numBuses - 1;
+        parseFilterID(newString, id, extended);
+        if (frameFilter.removeID(idx, id, extended)) frameFilter.saveSettings(idx);
+        else Logger::console("ID 0x%x is not in the CAN%i filter list", id, idx);
+    } else if (cmdString.startsWith("FILTERCLEAR")) {
+        int idx = cmdString[cmdString.length() - 1] - '0';
+        if (idx < 0) idx = 0;
+        if (idx > (SysSettings.numBuses - 1)) idx = SysSettings.numBuses - 1;
+        Logger::console("Clearing CAN%i filter list", idx);
+        frameFilter.clear(idx);
+        frameFilter.saveSettings(idx);
+    } else if (cmdString.startsWith("DELTA")) {
+        int idx = cmdString[cmdString.length() - 1] - '0';
+        if (idx < 0) idx = 0;
+        if (idx > (SysSettings.numBuses - 1)) idx = SysSettings.numBuses - 1;
+        if (newValue < 0) newValue = 0;
+        if (newValue > 1) newValue = 1;
+        Logger::console("Setting CAN%i delta mode to %i", idx, newValue);
+        canManager.setDeltaMode(idx, newValue, settings.deltaHeartbeat[idx]);
+        writeEEPROM = true;
+    } else if (cmdString.startsWith("HEARTBEAT")) {
+        int idx = cmdString[cmdString.length() - 1] - '0';
+        if (idx < 0) idx = 0;
+        if (idx > (SysSettings.numBuses - 1)) idx = SysSettings.numBuses - 1;
+        if (newValue < 0) newValue = 0;
+        if (newValue > 60000) newValue = 60000;
+        Logger::console("Setting CAN%i delta heartbeat to %i ms", idx, newValue);
+        canManager.setDeltaMode(idx, settings.deltaMode[idx], newValue);
+        writeEEPROM = true;
+    } else if (cmdString.startsWith("TXGAP")) {
+        int idx = cmdString[cmdString.length() - 1] - '0';
+        if (idx < 0) idx = 0;
+        if (idx > (SysSettings.numBuses - 1)) idx = SysSettings.numBuses - 1;
+        if (newValue < 0) newValue = 0;
+        if (newValue > 65535) newValue = 65535;
+        Logger::console("Setting CAN%i transmit gap to %i us", idx, newValue);
+        settings.txGap[idx] = newValue;
+        writeEEPROM = true;
+    } else if (cmdString.startsWith("DECIMATEID")) {
+        int idx = cmdString[cmdString.length() - 1] - '0';
+        uint32_t id;
+        bool extended;
+        DECIMATE_TYPE type;
+        uint16_t value;
+        if (idx < 0) idx = 0;
+        if (idx > (SysSettings.numBuses - 1)) idx = SysSettings.numBuses - 1;
+        char *end = parseFilterID(newString, id, extended);
+        if (*end != ',' || !parseDecimateRule(end + 1, type, value)) {
+            Logger::console("Expected ID,RULE. Ex: DECIMATEID0=0x123,R10");
+        } else if (frameDecimator.setRule(idx, IDTable::makeKey(id, extended), type, value)) {
+            Logger::console("Setting decimation of ID 0x%x on CAN%i to type %i value %i", id, idx, type, value);
+            frameDecimator.saveSettings(idx);
+        } else Logger::console("Could not set decimation rule. There is room for %i per bus", DECIMATE_MAX_RULES);
+    } else if (cmdString.startsWith("DECIMATE")) {
+        int idx = cmdString[cmdString.length() - 1] - '0';
+        DECIMATE_TYPE type;
+        uint16_t value;
+        if (idx < 0) idx = 0;
+        if (idx > (SysSettings.numBuses - 1)) idx = SysSettings.numBuses - 1;
+        if (parseDecimateRule(newString, type, value)) {
+            Logger::console("Setting default decimation of CAN%i to type %i value %i", idx, type, value);
+            frameDecimator.setDefault(idx, type, value);
+            frameDecimator.saveSettings(idx);
+        } else Logger::console("Invalid rule! Use 0, R<frames per second> or N<every kth frame>");
+    } else if (cmdString == String("THINNED")) {
+        if (newValue >= 0 && newValue < SysSettings.numBuses) printThinned(newValue);
+    } else if (cmdString == String("IDSTATS")) {
+        if (newValue >= 0 && newValue < SysSettings.numBuses) printIDStats(newValue);
+    } else if (cmdString == String("IDRESET")) {
+        if (newValue >= 0 && newValue < SysSettings.numBuses) {
+            Logger::console("Clearing ID statistics for CAN%i", newValue);
+            canManager.getIDTable(newValue)->clear();
+        }
+    } else if (cmdString == String("GENHELP")) {
+        printGeneratorHelp();
+    } else if (cmdString == String("GENLIST")) {
+        printGenerators();
+    } else if (cmdString == String("GENDEL")) {
+        if (frameGenerator.removeRule(newValue)) Logger::console("Removed generator rule %i", newValue);
+        else Logger::console("There is no generator rule %i", newValue);
+    } else if (cmdString == String("GENCLEAR")) {
+        Logger::console("Clearing the payload generator rules");
+        frameGenerator.clear();
+    } else if (cmdString.startsWith("GEN")) {
+        int idx = cmdString[cmdString.length() - 1] - '0';
+        if (idx < 0) idx = 0;
+        if (idx > (SysSettings.numBuses - 1)) idx = SysSettings.numBuses - 1;
+        handleGeneratorAdd(idx, newString);
+    } else if (cmdString == String("REPLAY")) {
+        char *speedTok = strchr(newString, ',');
+        int speed = speedTok ? strtol(speedTok + 1, NULL, 0) : 100;
+        if (newValue < 0 || newValue > 65535 || speed < 1 || speed > 65535) {
+            Logger::console("Expected LOOPS,SPEED. Ex: REPLAY=1,100");
+        } else if (replayEngine.start(newValue, speed, nullptr)) {
+            Logger::console("Playing %i bytes of capture %i times at %i%%", replayEngine.getUploaded(), newValue, speed);
+        } else Logger::console("Nothing has been uploaded to replay");
+    } else if (cmdString == String("REPLAYSTOP")) {
+        Logger::console("Stopping replay");
+        replayEngine.stop();
+    } else if (cmdString == String("BBDEPTH")) {
+        char *postTok = strchr(newString, ',');
+        int post = postTok ? strtol(postTok + 1, NULL, 0) : 0;
+        if (!postTok || newValue < 0 || post < 0) {
+            Logger::console("Expected PRE,POST. Ex: BBDEPTH=1000,200");
+        } else if (blackBox.setDepth(newValue, post)) {
+            Logger::console("Black box holds %i frames before the trigger and %i after, in %s", newValue, post,
+                            blackBox.isInPSRAM() ? "PSRAM" : "internal RAM");
+        } else Logger::console("Not enough memory for that many frames");
+    } else if (cmdString == String("BBTRIGID")) {
+        handleBlackBoxID(newString);
+    } else if (cmdString == String("BBTRIGDATA")) {
+        handleBlackBoxData(newString);
+    } else if (cmdString == String("BBTRIGBUSOFF")) {
+        BB_TRIGGER *trigger = blackBox.getTrigger();
+        if (newValue) trigger->sources |= BB_TRIG_BUSOFF;
+        else trigger->sources &= ~BB_TRIG_BUSOFF;
+        Logger::console("Black box %s trigger on CAN0 going bus off", newValue ? "will" : "won't");
+    } else if (cmdString == String("BBTRIGINPUT")) {
+        BB_TRIGGER trigger = *blackBox.getTrigger();
+        char *levelTok = strchr(newString, ',');
+        if (newValue < 0) {
+            trigger.sources &= ~BB_TRIG_INPUT;
+            blackBox.setTrigger(trigger);
+            Logger::console("Black box won't trigger on an input");
+        } else if (!BlackBox::isUsableInput(newValue)) {
+            Logger::console("GPIO %i can't be used as a trigger input, it is a flash pin, in use by the board or not a GPIO", newValue);
+        } else {
+            trigger.sources |= BB_TRIG_INPUT;
+            trigger.input = newValue;
+            trigger.inputLevel = levelTok ? (strtol(levelTok + 1, NULL, 0) != 0) : 1;
+            blackBox.setTrigger(trigger);
+            Logger::console("Black box will trigger on GPIO %i going %s", newValue, trigger.inputLevel ? "high" : "low");
+        }
+    } else if (cmdString == String("BBARM")) {
+        if (!newValue) {
+            Logger::console("Black box stopped");
+            blackBox.disarm();
+        } else if (blackBox.arm()) Logger::console("Black box armed");
+        else Logger::console("Set the black box size with BBDEPTH first");
+    } else if (cmdString == String("BBTRIGGER")) {
+        if (blackBox.getState() == BB_ARMED) {
+            Logger::console("Triggering the black box");
+            blackBox.fire(BB_EVENT_MANUAL);
+        } else Logger::console("Black box isn't armed");
+    } else if (cmdString == String("CYCLICLIST")) {
+        printCyclic();
+    } else if (cmdString == String("CYCLICON") || cmdString == String("CYCLICOFF")) {
+        bool enable = (cmdString == String("CYCLICON"));
+        if (cyclicTx.setEnabled(newValue, enable)) Logger::console("Cyclic entry %i %s", newValue, enable ? "resumed" : "paused");
+        else Logger::console("There is no cyclic entry %i", newValue);
+    } else if (cmdString == String("CYCLICDEL")) {
+        if (cyclicTx.removeEntry(newValue)) Logger::console("Removed cyclic entry %i", newValue);
+        else Logger::console("There is no cyclic entry %i", newValue);
+    } else if (cmdString == String("CYCLICCLEAR")) {
+        Logger::console("Clearing the cyclic transmit table");
+        cyclicTx.clear();
+    } else if (cmdString.startsWith("CYCLIC")) {
+        int idx = cmdString[cmdString.length() - 1] - '0';
+        if (idx < 0) idx = 0;
+        if (idx > (SysSettings.numBuses - 1)) idx = SysSettings.numBuses - 1;
+        handleCyclicAdd(idx, newString);
     } else if (cmdString.startsWith("CANSEND")) {
         int idx = cmdString[cmdString.length() - 1] - '0';
         if (idx < 0) idx = 0;
         if (idx > (SysSettings.numBuses - 1)) idx = SysSettings.numBuses - 1;
-        handleCANSend(*canBuses[idx], newString);
+        handleCANSend(idx, newString);
     } else if (cmdString == String("MARK")) { //just ascii based for now
         if (!settings.useBinarySerialComm) Logger::console("Mark: %s", newString);
     } else if (cmdString == String("BINSERIAL")) {
@@ -335,6 +554,7 @@ void SerialConsole::handleConfigCmd()
         if (newValue > 1) newValue = 1;
         Logger::console("Setting Serial Binary Comm to %i", newValue);
         settings.useBinarySerialComm = newValue;
+        serialGVRET.setWireFormat(newValue ? FORMAT_GVRET_BINARY : FORMAT_GVRET_TEXT);
         writeEEPROM = true;
     } else if (cmdString == String("BTMODE")) {
         if (newValue < 0) newValue = 0;
@@ -361,6 +581,30 @@ void SerialConsole::handleConfigCmd()
         Logger::console("Setting LAWICEL Mode to %i", newValue);
         settings.enableLawicel = newValue;
         writeEEPROM = true;        
+    } else if (cmdString == String("CAPTURE") || cmdString == String("CAPTASKS")) { //CAPTASKS is the old name
+        if (newValue < 0) newValue = 0;
+        if (newValue > 1) newValue = 1;
+        Logger::console("%s driver callback capture. Reboot for this to take effect.", newValue ? "Enabling" : "Disabling");
+        settings.useDriverCapture = newValue;
+        writeEEPROM = true;
+    } else if (cmdString == String("STAGING")) {
+        if (newValue < 0) newValue = 0;
+        if (newValue > (STAGING_MAX_SIZE / 1024)) newValue = STAGING_MAX_SIZE / 1024;
+        settings.stagingKB = newValue;
+        writeEEPROM = true;
+        if (!stagingQueue.setSize(newValue * 1024ul)) Logger::console("Not enough memory for a staging queue");
+        else if (newValue == 0) Logger::console("Staging queue off");
+        else Logger::console("Staging queue of %i bytes in %s", stagingQueue.getSize(), stagingQueue.isInPSRAM() ? "PSRAM" : "internal RAM");
+    } else if (cmdString == String("IDTABLE")) {
+        if (newValue != 0 && (newValue < ID_TABLE_MIN || newValue > ID_TABLE_MAX || (newValue & (newValue - 1)))) {
+            Logger::console("ID table size has to be a power of two from %i to %i, or 0", ID_TABLE_MIN, ID_TABLE_MAX);
+        } else {
+            Logger::console("Setting ID table size to %i. Reboot for this to take effect.", newValue);
+            settings.idTableSize = newValue;
+            writeEEPROM = true;
+        }
+    } else if (cmdString == String("STAGINGRESET")) {
+        stagingQueue.resetHighWater();
     } else if (cmdString == String("WIFIMODE")) {
         if (newValue < 0) newValue = 0;
         if (newValue > 2) newValue = 2;
@@ -443,12 +687,23 @@ void SerialConsole::handleConfigCmd()
             nvPrefs.putUInt(buff, settings.canSettings[i].fdSpeed);
             sprintf(buff, "can%i-fdmode", i);
             nvPrefs.putBool(buff, settings.canSettings[i].fdMode);
+            sprintf(buff, "can%i-route", i);
+            nvPrefs.putUChar(buff, settings.busRoutes[i]);
+            sprintf(buff, "can%i-delta", i);
+            nvPrefs.putBool(buff, settings.deltaMode[i]);
+            sprintf(buff, "can%i-hbeat", i);
+            nvPrefs.putUShort(buff, settings.deltaHeartbeat[i]);
+            sprintf(buff, "can%i-txgap", i);
+            nvPrefs.putUShort(buff, settings.txGap[i]);
         }
         
         nvPrefs.putBool("binarycomm", settings.useBinarySerialComm);
         nvPrefs.putBool("enable-bt", settings.enableBT);
         nvPrefs.putInt("sendingBus", settings.sendingBus);
         nvPrefs.putBool("enableLawicel", settings.enableLawicel);
+        nvPrefs.putBool("captasks", settings.useDriverCapture);
+        nvPrefs.putUShort("stagingkb", settings.stagingKB);
+        nvPrefs.putUShort("idtable", settings.idTableSize);
         nvPrefs.putUChar("loglevel", settings.logLevel);
         nvPrefs.putUChar("systype", settings.systemType);
         nvPrefs.putUChar("wifiMode", settings.wifiMode);
@@ -459,11 +714,11 @@ void SerialConsole::handleConfigCmd()
     }
 } 
 
-//CAN0FILTER%i=%%i,%%i,%%i,%%i (ID, Mask, Extended, Enabled)", i);
+//CANxFILTERy=ID,Mask,Extended,Enabled
 bool SerialConsole::handleFilterSet(uint8_t bus, uint8_t filter, char *values)
 {
-    if (filter < 0 || filter > 7) return false;
-    if (bus < 0 || bus > 1) return false;
+    if (filter >= FILTER_MASK_SLOTS) return false;
+    if (bus >= NUM_BUSES) return false;
 
     //there should be four tokens
     char *idTok = strtok(values, ",");
@@ -483,49 +738,160 @@ bool SerialConsole::handleFilterSet(uint8_t bus, uint8_t filter, char *values)
 
     Logger::console("Setting CAN%iFILTER%i to ID 0x%x Mask 0x%x Extended %i Enabled %i", bus, filter, idVal, maskVal, extVal, enVal);
 
-    if (bus == 0) {
-        //settings.CAN0Filters[filter].id = idVal;
-        //settings.CAN0Filters[filter].mask = maskVal;
-        //settings.CAN0Filters[filter].extended = extVal;
-        //settings.CAN0Filters[filter].enabled = enVal;
-        //CAN0.setRXFilter(filter, idVal, maskVal, extVal);
-    } else if (bus == 1) {
-        //settings.CAN1Filters[filter].id = idVal;
-        //settings.CAN1Filters[filter].mask = maskVal;
-        //settings.CAN1Filters[filter].extended = extVal;
-        //settings.CAN1Filters[filter].enabled = enVal;
-        //CAN1.setRXFilter(filter, idVal, maskVal, extVal);
+    //These go into the software filter list now, replacing whatever this slot put there before
+    if (!frameFilter.setMaskSlot(bus, filter, idVal, maskVal, extVal, enVal))
+    {
+        Logger::console("Mask leaves too many extended IDs open to list");
+        frameFilter.saveSettings(bus);
+        return false;
     }
+    frameFilter.saveSettings(bus);
 
     return true;
 }
 
-bool SerialConsole::handleCANSend(CAN_COMMON &port, char *inputString)
+//Parse an ID for the filter commands. Anything over 0x7FF is extended, a trailing X forces it.
+char *SerialConsole::parseFilterID(char *str, uint32_t &id, bool &extended)
+{
+    char *end;
+    id = strtoul(str, &end, 0);
+    extended = (id > 0x7FF);
+    if (*end == 'X' || *end == 'x')
+    {
+        extended = true;
+        end++;
+    }
+    return end;
+}
+
+//Decimation rule: 0 for none, R<n> for at most n frames per second, N<k> for every kth frame
+bool SerialConsole::parseDecimateRule(char *str, DECIMATE_TYPE &type, uint16_t &value)
+{
+    long val = strtol(str + 1, NULL, 0);
+    value = 0;
+    switch (toupper(str[0]))
+    {
+    case '0':
+        type = DECIMATE_NONE;
+        return true;
+    case 'R':
+        type = DECIMATE_RATE;
+        break;
+    case 'N':
+        type = DECIMATE_NTH;
+        break;
+    default:
+        return false;
+    }
+    if (val < 1 || val > 65535) return false;
+    value = val;
+    return true;
+}
+
+void SerialConsole::printThinned(int bus)
+{
+    IDTable *table = canManager.getIDTable(bus);
+    int shown = 0;
+    for (uint32_t i = 0; i < table->capacity(); i++)
+    {
+        ID_ENTRY *entry = table->entryAt(i);
+        if (!entry || entry->thinned == 0) continue;
+        Logger::console("CAN%i ID 0x%x%s: rule %i/%i, %i frames held back", bus, entry->key & 0x1FFFFFFF,
+                        (entry->key & ID_KEY_EXTENDED) ? " X" : "", entry->decimateType, entry->decimateValue, entry->thinned);
+        shown++;
+    }
+    Logger::console("%i IDs thinned, %i frames held back on CAN%i", shown, frameDecimator.getThinned(bus), bus);
+}
+
+static int compareEntryKeys(const void *a, const void *b)
+{
+    uint32_t keyA = (*(ID_ENTRY **)a)->key;
+    uint32_t keyB = (*(ID_ENTRY **)b)->key;
+    return (keyA > keyB) - (keyA < keyB);
+}
+
+//cantop style listing, sorted by ID with standard IDs first
+void SerialConsole::printIDStats(int bus)
+{
+    IDTable *table = canManager.getIDTable(bus);
+    ID_ENTRY **sorted = (ID_ENTRY **)malloc(table->capacity() * sizeof(ID_ENTRY *));
+    char dataStr[8 * 3 + 1];
+    int count = 0;
+
+    if (!sorted) return;
+
+    for (uint32_t i = 0; i < table->capacity(); i++)
+    {
+        ID_ENTRY *entry = table->entryAt(i);
+        if (entry) sorted[count++] = entry;
+    }
+    qsort(sorted, count, sizeof(ID_ENTRY *), compareEntryKeys);
+
+    Logger::console("CAN%i: %i IDs", bus, count);
+    for (int i = 0; i < count; i++)
+    {
+        ID_ENTRY *entry = sorted[i];
+        int len = (entry->length > 8) ? 8 : entry->length;
+        for (int b = 0; b < len; b++) sprintf(&dataStr[b * 3], "%02X ", entry->data[b]);
+        dataStr[len * 3] = 0;
+        Logger::console("%8x%s %8i frames  period min/avg/max %i/%i/%i us  jitter %i us  [%i] %s", entry->key & 0x1FFFFFFF,
+                        (entry->key & ID_KEY_EXTENDED) ? "X" : " ", entry->count, entry->periodMin, entry->periodAvg,
+                        entry->periodMax, entry->jitter, entry->length, dataStr);
+    }
+    if (table->getUntracked()) Logger::console("%i frames were from IDs the table had no room for", table->getUntracked());
+    free(sorted);
+}
+
+//FILTERADD value is either a single ID or LOW-HIGH
+bool SerialConsole::handleFilterAdd(int bus, char *values)
+{
+    uint32_t low, high;
+    bool lowExt, highExt;
+    char *end = parseFilterID(values, low, lowExt);
+    if (*end != '-')
+    {
+        Logger::console("Adding %s ID 0x%x to CAN%i filter list", lowExt ? "extended" : "standard", low, bus);
+        return frameFilter.addID(bus, low, lowExt);
+    }
+    parseFilterID(end + 1, high, highExt);
+    Logger::console("Adding %s IDs 0x%x to 0x%x to CAN%i filter list", (lowExt || highExt) ? "extended" : "standard", low, high, bus);
+    return frameFilter.addRange(bus, low, high, lowExt || highExt);
+}
+
+//LEN,<BYTES SEPARATED BY COMMAS> following an ID already taken off with strtok
+bool SerialConsole::parseFrameData(CAN_FRAME &frame)
 {
-    char *idTok = strtok(inputString, ",");
     char *lenTok = strtok(NULL, ",");
     char *dataTok;
-    CAN_FRAME frame;
 
-    if (!idTok) return false;
     if (!lenTok) return false;
-
-    int idVal = strtol(idTok, NULL, 0);
     int lenVal = strtol(lenTok, NULL, 0);
+    if (lenVal < 0 || lenVal > 8) return false;
 
     for (int i = 0; i < lenVal; i++) {
         dataTok = strtok(NULL, ",");
         if (!dataTok) return false;
         frame.data.byte[i] = strtol(dataTok, NULL, 0);
     }
+    frame.rtr = 0;
+    frame.length = lenVal;
+    return true;
+}
+
+bool SerialConsole::handleCANSend(int bus, char *inputString)
+{
+    char *idTok = strtok(inputString, ",");
+    CAN_FRAME frame;
+
+    if (!idTok) return false;
+    int idVal = strtol(idTok, NULL, 0);
+    if (!parseFrameData(frame)) return false;
 
     //things seem good so try to send the frame.
     frame.id = idVal;
     if (idVal >= 0x7FF) frame.extended = true;
     else frame.extended = false;
-    frame.rtr = 0;
-    frame.length = lenVal;
-    port.sendFrame(frame);
+    canManager.sendFrame(bus, frame);
     
     Logger::console("Sending frame with id: 0x%x len: %i", frame.id, frame.length);
     SysSettings.txToggle = !SysSettings.txToggle;
@@ -533,6 +899,242 @@ bool SerialConsole::handleCANSend(CAN_COMMON &port, char *inputString)
     return true;
 }
 
+//CYCLIC0=ID,PERIOD,LEN,<BYTES SEPARATED BY COMMAS>
+bool SerialConsole::handleCyclicAdd(int bus, char *inputString)
+{
+    char *idTok = strtok(inputString, ",");
+    char *periodTok = strtok(NULL, ",");
+    CAN_FRAME frame;
+
+    if (!idTok || !periodTok || !parseFrameData(frame)) {
+        Logger::console("Expected ID,PERIOD,LEN,<BYTES>. Ex: CYCLIC0=0x200,10,2,1,2");
+        return false;
+    }
+    int idVal = strtol(idTok, NULL, 0);
+    int period = strtol(periodTok, NULL, 0);
+    if (period < 1 || period > 65535) {
+        Logger::console("Period has to be 1 - 65535 ms");
+        return false;
+    }
+    frame.id = idVal;
+    frame.extended = (idVal >= 0x7FF);
+
+    int entry = cyclicTx.addEntry(bus, frame, period);
+    if (entry < 0) {
+        Logger::console("Could not add to the cyclic table. There is room for %i entries", CYCLIC_MAX_ENTRIES);
+        return false;
+    }
+    Logger::console("Cyclic entry %i sends 0x%x on CAN%i every %i ms", entry, frame.id, bus, period);
+    return true;
+}
+
+//BUS,ID,MASK with the ID as for filters, X on the end for extended. Standard IDs have to match standard frames
+bool SerialConsole::handleBlackBoxID(char *inputString)
+{
+    BB_TRIGGER *trigger = blackBox.getTrigger();
+    char *busTok = strtok(inputString, ",");
+    char *idTok = strtok(NULL, ",");
+    char *maskTok = strtok(NULL, ",");
+    uint32_t id;
+    bool extended;
+
+    if (!busTok || !idTok) {
+        Logger::console("Expected BUS,ID,MASK. Ex: BBTRIGID=0,0x7E8,0x7FF");
+        return false;
+    }
+    parseFilterID(idTok, id, extended);
+    if (id == 0 && !extended) {
+        trigger->sources &= ~BB_TRIG_FRAME;
+        Logger::console("Black box won't trigger on frames");
+        return true;
+    }
+    uint32_t mask = maskTok ? strtoul(maskTok, NULL, 0) : 0x1FFFFFFF;
+    trigger->bus = strtol(busTok, NULL, 0);
+    trigger->id = id | (extended ? 0x80000000ul : 0);
+    trigger->idMask = (mask & 0x1FFFFFFF) | 0x80000000ul;
+    trigger->sources |= BB_TRIG_FRAME;
+    Logger::console("Black box will trigger on ID 0x%x mask 0x%x", id, mask & 0x1FFFFFFF);
+    return true;
+}
+
+//Up to 8 bytes to compare the start of the frame with, XX for a byte that can be anything. Nothing after the = clears it
+bool SerialConsole::handleBlackBoxData(char *inputString)
+{
+    BB_TRIGGER *trigger = blackBox.getTrigger();
+    memset(trigger->dataMask, 0, 8);
+    int count = 0;
+    for (char *tok = strtok(inputString, ","); tok && count < 8; tok = strtok(NULL, ","), count++)
+    {
+        if (!strcasecmp(tok, "XX")) continue;
+        trigger->data[count] = strtol(tok, NULL, 0);
+        trigger->dataMask[count] = 0xFF;
+    }
+    Logger::console("Black box trigger frames have to match %i data bytes", count);
+    return true;
+}
+
+static const char *generatorNames[] = {"", "COUNT", "RAMP", "SINE", "XOR", "SUM", "J1850", "CRC8"};
+
+void SerialConsole::printGeneratorHelp()
+{
+    Logger::console("GENn=ID,TYPE,STARTBIT,WIDTH,A,B,PERIOD fills WIDTH bits from STARTBIT (bit 0 = low bit of byte 0, counting up)");
+    Logger::console("in every frame with that ID sent on CANn, including cyclic ones. A, B and PERIOD depend on TYPE:");
+    Logger::console("COUNT - add A (0 = 1) each frame, back to 0 after B (0 = field full). Ex: GEN0=0x200,COUNT,48,4,1,14");
+    Logger::console("RAMP - A to B over PERIOD ms then start over. SINE - between A and B once every PERIOD ms");
+    Logger::console("XOR, SUM, J1850, CRC8 - checksum of bytes A to B starting from PERIOD. Its own byte is left out");
+    Logger::console("and it runs after the other rules. Ex: GEN0=0x200,J1850,56,8,0,6,0xFF");
+}
+
+//ID,TYPE,STARTBIT,WIDTH then A,B,PERIOD which can be left off from the end. Checksums put their start value last
+//on the console since the byte range is what people set most
+bool SerialConsole::handleGeneratorAdd(int bus, char *inputString)
+{
+    char *tok[7];
+    int count = 0;
+    for (char *t = strtok(inputString, ","); t && count < 7; t = strtok(NULL, ",")) tok[count++] = t;
+    if (count < 4) {
+        Logger::console("Expected ID,TYPE,STARTBIT,WIDTH,A,B,PERIOD. GENHELP=1 has examples");
+        return false;
+    }
+
+    uint32_t id;
+    bool extended;
+    parseFilterID(tok[0], id, extended);
+    int type = 0;
+    for (int i = GEN_COUNTER; i <= GEN_CRC8; i++) {
+        if (!strcasecmp(tok[1], generatorNames[i])) type = i;
+    }
+    int startBit = strtol(tok[2], NULL, 0);
+    int width = strtol(tok[3], NULL, 0);
+    int32_t a = (count > 4) ? strtol(tok[4], NULL, 0) : 0;
+    int32_t b = (count > 5) ? strtol(tok[5], NULL, 0) : 0;
+    long period = (count > 6) ? strtol(tok[6], NULL, 0) : 0;
+    if (type >= GEN_XOR) {
+        //A,B is the byte range here and the start value goes where the period would
+        a = (a & 0xFF) | ((b & 0xFF) << 8);
+        b = period;
+        period = 0;
+    }
+    if (type == 0 || startBit < 0 || period < 0 || period > 65535) {
+        Logger::console("Invalid rule. GENHELP=1 lists the types");
+        return false;
+    }
+
+    int rule = frameGenerator.addRule(bus, id, extended, (GEN_TYPE)type, startBit, width, a, b, period);
+    if (rule < 0) {
+        Logger::console("Could not add the rule. Check the field and period, there is room for %i rules", GEN_MAX_RULES);
+        return false;
+    }
+    Logger::console("Generator rule %i writes %s into bits %i-%i of 0x%x on CAN%i", rule, generatorNames[type],
+                    startBit, startBit + width - 1, id, bus);
+    return true;
+}
+
+void SerialConsole::printGenerators()
+{
+    GEN_RULE rule;
+    Logger::console("%i generator rules", frameGenerator.getRuleCount());
+    for (int i = 0; i < GEN_MAX_RULES; i++)
+    {
+        if (!frameGenerator.getRule(i, rule)) continue;
+        if (rule.type >= GEN_XOR) {
+            Logger::console("%i: CAN%i 0x%x%s %s in bits %i-%i over bytes %i-%i from 0x%x", i, rule.bus,
+                            rule.key & 0x1FFFFFFF, (rule.key & ID_KEY_EXTENDED) ? " X" : "", generatorNames[rule.type],
+                            rule.startBit, rule.startBit + rule.width - 1, rule.a & 0xFF, (rule.a >> 8) & 0xFF, rule.b);
+        } else {
+            Logger::console("%i: CAN%i 0x%x%s %s in bits %i-%i, a %i b %i period %i ms", i, rule.bus,
+                            rule.key & 0x1FFFFFFF, (rule.key & ID_KEY_EXTENDED) ? " X" : "", generatorNames[rule.type],
+                            rule.startBit, rule.startBit + rule.width - 1, rule.a, rule.b, rule.period);
+        }
+    }
+}
+
+//Late is from the scheduled time to the controller taking the frame. The interval spread is the jitter on the bus side
+void SerialConsole::printCyclic()
+{
+    CYCLIC_ENTRY entry;
+    Logger::console("%i cyclic entries", cyclicTx.getEntryCount());
+    for (int i = 0; i < CYCLIC_MAX_ENTRIES; i++)
+    {
+        if (!cyclicTx.getEntry(i, entry)) continue;
+        uint32_t lateAvg = entry.sent ? (uint32_t)(entry.lateTotal / entry.sent) : 0;
+        uint32_t intervalMin = (entry.sent > 1) ? entry.intervalMin : 0;
+        Logger::console("%i: CAN%i 0x%x%s every %i ms%s, %i sent, %i missed, late avg %i max %i us, interval %i - %i us",
+                        i, entry.bus, entry.frame.id, entry.frame.extended ? " X" : "", entry.period,
+                        entry.enabled ? "" : " (paused)", entry.sent, entry.missed, lateAvg, entry.lateMax,
+                        intervalMin, entry.intervalMax);
+    }
+}
+
+void SerialConsole::printStatistics()
+{
+    Logger::console("Serial buffer: %i queued, high water %i of %i, dropped %i frames / %i bytes",
+                    serialGVRET.numAvailableBytes(), serialGVRET.getHighWater(), COMM_RING_SIZE,
+                    serialGVRET.getFramesDropped(), serialGVRET.getBytesDropped());
+    Logger::console("WiFi buffer:   %i queued, high water %i of %i, dropped %i frames / %i bytes",
+                    wifiGVRET.numAvailableBytes(), wifiGVRET.getHighWater(), COMM_RING_SIZE,
+                    wifiGVRET.getFramesDropped(), wifiGVRET.getBytesDropped());
+    for (int i = 0; i < SysSettings.numBuses; i++)
+    {
+        Logger::console("CAN%i capture ring overflows: %i", i, canManager.getCaptureOverflows(i));
+    }
+    for (int i = 0; i < SysSettings.numBuses; i++)
+    {
+        TX_STATS *tx = txScheduler.getStats(i);
+        if (tx->queued == 0) continue;
+        Logger::console("CAN%i transmit: %i waiting, %i queued, %i sent, %i dropped, %i failed, %i arbitration lost, %i controller busy",
+                        i, txScheduler.getWaiting(i), tx->queued, tx->sent, tx->dropped, tx->failed, tx->arbLost, tx->busy);
+    }
+    if (replayEngine.getUploaded())
+    {
+        REPLAY_STATS *replay = replayEngine.getStats();
+        Logger::console("Replay: state %i, %i of %i bytes uploaded, at %i, %i loops done, %i sent, %i skipped, %i underruns, late avg %i max %i us",
+                        replayEngine.getState(), replayEngine.getUploaded(), replayEngine.getSize(), replayEngine.getPosition(),
+                        replay->loopsDone, replay->framesSent, replay->framesSkipped, replay->underruns,
+                        replay->framesSent ? (uint32_t)(replay->lateTotal / replay->framesSent) : 0, replay->lateMax);
+    }
+    if (stagingQueue.isActive())
+    {
+        Logger::console("Staging queue: %i of %i bytes used by %i frames, high water %i bytes %i frames, %i staged, %i dropped, longest backlog %i ms",
+                        stagingQueue.getUsed(), stagingQueue.getSize(), stagingQueue.getWaiting(), stagingQueue.getHighWater(),
+                        stagingQueue.getHighWaterFrames(), stagingQueue.getStaged(), stagingQueue.getDropped(), stagingQueue.getLongestBacklog());
+    }
+    if (blackBox.getState() != BB_OFF || blackBox.getKept())
+    {
+        static const char *bbStates[] = {"off", "armed", "triggered", "frozen"};
+        Logger::console("Black box: %s, %i of %i frames held, trigger at %i", bbStates[blackBox.getState()], blackBox.getKept(),
+                        blackBox.getPre() + blackBox.getPost() + 1, (int32_t)blackBox.getTriggerIndex());
+    }
+    if (cyclicTx.getEntryCount())
+    {
+        Logger::console("Cyclic transmit: %i entries. CYCLICLIST=1 shows their timing", cyclicTx.getEntryCount());
+    }
+    for (int i = 0; i < SysSettings.numBuses; i++)
+    {
+        BUSLOAD *load = canManager.getBusLoad(i);
+        if (frameFilter.getMode(i) != FILTER_OFF)
+        {
+            Logger::console("CAN%i filter: mode %i, %i standard IDs, %i extended IDs, %i ranges, %i frames filtered out", i,
+                            frameFilter.getMode(i), frameFilter.getStdCount(i), frameFilter.getExtCount(i),
+                            frameFilter.getRangeCount(i), frameFilter.getRejected(i));
+        }
+        if (frameDecimator.isActive(i))
+        {
+            Logger::console("CAN%i decimation: %i frames held back. THINNED=%i lists them by ID", i, frameDecimator.getThinned(i), i);
+        }
+        if (settings.deltaMode[i])
+        {
+            IDTable *table = canManager.getIDTable(i);
+            Logger::console("CAN%i delta: %i IDs tracked, %i frames unchanged and not sent, %i lookups for untracked IDs", i,
+                            table->count(), canManager.getDeltaSuppressed(i), table->getUntracked());
+        }
+        Logger::console("CAN%i load: now %i.%i%%, 1s %i.%i%%, 10s %i.%i%%, peak %i.%i%%, %i frames/s", i,
+                        load->loadInstant / 10, load->loadInstant % 10, load->load1s / 10, load->load1s % 10,
+                        load->load10s / 10, load->load10s % 10, load->loadPeak / 10, load->loadPeak % 10,
+                        load->framesPerSecond);
+    }
+}
+
 void SerialConsole::printBusName(int bus) {
     switch (bus) {
     case 0:
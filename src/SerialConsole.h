@@ -31,6 +31,7 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "sys_io.h"
 #include "ESP32RET.h"
 #include "esp32_can.h"
+#include "frame_decimator.h"
 
 class SerialConsole {
 public:
@@ -38,6 +39,7 @@ public:
     void printMenu();
     void rcvCharacter(uint8_t chr);
     void printBusName(int bus);
+    void printStatistics();
 
 protected:
     enum CONSOLE_STATE {
@@ -54,7 +56,20 @@ private:
     void handleShortCmd();
     void handleConfigCmd();
     bool handleFilterSet(uint8_t bus, uint8_t filter, char *values);
-    bool handleCANSend(CAN_COMMON &port, char *inputString);
+    bool handleFilterAdd(int bus, char *values);
+    char *parseFilterID(char *str, uint32_t &id, bool &extended);
+    bool parseDecimateRule(char *str, DECIMATE_TYPE &type, uint16_t &value);
+    void printThinned(int bus);
+    void printIDStats(int bus);
+    bool parseFrameData(CAN_FRAME &frame);
+    bool handleCANSend(int bus, char *inputString);
+    bool handleCyclicAdd(int bus, char *inputString);
+    void printCyclic();
+    bool handleGeneratorAdd(int bus, char *inputString);
+    void printGeneratorHelp();
+    void printGenerators();
+    bool handleBlackBoxID(char *inputString);
+    bool handleBlackBoxData(char *inputString);
     bool handleSWCANSend(char *inputString);
 };
 
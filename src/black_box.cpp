@@ -0,0 +1,235 @@
+#include "black_box.h"
+#include "utility.h"
+#include "driver/twai.h"
+#include "driver/gpio.h"
+
+BlackBox::BlackBox()
+{
+    ring = nullptr;
+    capacity = 0;
+    preCount = 0;
+    postCount = 0;
+    inPSRAM = false;
+    state = BB_OFF;
+    memset(&trigger, 0, sizeof(trigger));
+    trigger.bus = 0xFF;
+    written = 0;
+    triggerAt = 0;
+    postLeft = 0;
+    triggerTime = 0;
+    pollTimer = 0;
+    lastBusOff = false;
+    lastInput = false;
+}
+
+//Throws away anything captured and leaves the box off. False if there isn't the memory, then there's no buffer at all
+bool BlackBox::setDepth(uint32_t pre, uint32_t post)
+{
+    state = BB_OFF;
+    written = 0;
+    if (ring) heap_caps_free(ring);
+    ring = nullptr;
+    capacity = 0;
+    preCount = 0;
+    postCount = 0;
+    inPSRAM = false;
+
+    uint64_t slots = (uint64_t)pre + post + 1;
+    if (slots * sizeof(BB_RECORD) > BLACKBOX_MAX_SIZE) return false;
+    ring = (BB_RECORD *)Utility::allocLarge(slots * sizeof(BB_RECORD), BLACKBOX_MAX_INTERNAL, &inPSRAM);
+    if (!ring) return false;
+    capacity = slots;
+    preCount = pre;
+    postCount = post;
+    return true;
+}
+
+//False, and the old trigger stays, if it would watch a pin that can't be used as an input
+bool BlackBox::setTrigger(BB_TRIGGER &newTrigger)
+{
+    if ((newTrigger.sources & BB_TRIG_INPUT) && !isUsableInput(newTrigger.input)) return false;
+    trigger = newTrigger;
+    if (trigger.sources & BB_TRIG_INPUT)
+    {
+        pinMode(trigger.input, INPUT);
+        lastInput = digitalRead(trigger.input);
+    }
+    return true;
+}
+
+//Not a GPIO at all, one the SPI flash and PSRAM hang off or one the board already uses for CAN or its LEDs.
+//On a WROVER module PSRAM takes GPIO16 and 17 as well, the black box ring itself may be in it
+bool BlackBox::isUsableInput(int pin)
+{
+    if (pin < 0 || pin >= 64 || !GPIO_IS_VALID_GPIO(pin)) return false;
+#ifdef CONFIG_IDF_TARGET_ESP32S3
+    if (pin >= 26 && pin <= 32) return false;
+#else
+    if (pin >= 6 && pin <= 11) return false;
+    if ((pin == 16 || pin == 17) && psramFound()) return false;
+#endif
+    if (SysSettings.reservedPins & PIN_BIT(pin)) return false;
+    return true;
+}
+
+//Starts over from an empty ring. Conditions already true when arming (bus off, input at its level) don't trigger
+bool BlackBox::arm()
+{
+    if (!ring) return false;
+    written = 0;
+    postLeft = 0;
+    triggerTime = 0;
+    twai_status_info_t status;
+    lastBusOff = (twai_get_status_info(&status) == ESP_OK) && (status.state == TWAI_STATE_BUS_OFF);
+    if (trigger.sources & BB_TRIG_INPUT)
+    {
+        pinMode(trigger.input, INPUT);
+        lastInput = digitalRead(trigger.input);
+    }
+    pollTimer = millis();
+    state = BB_ARMED;
+    return true;
+}
+
+//Stops recording but keeps whatever is in the ring
+void BlackBox::disarm()
+{
+    if (state == BB_ARMED || state == BB_TRIGGERED) state = BB_OFF;
+}
+
+//Trigger by hand, the trigger record is a manual event
+void BlackBox::fire(BB_EVENT cause)
+{
+    if (state != BB_ARMED) return;
+    addEvent(cause);
+}
+
+void BlackBox::record(CAN_FRAME &frame, int whichBus)
+{
+    if (state != BB_ARMED && state != BB_TRIGGERED) return;
+    uint8_t length = frame.rtr ? 0 : frame.length;
+    recordFrame(frame.timestamp, frame.id, frame.extended, false, whichBus, length, frame.data.uint8);
+}
+
+void BlackBox::record(CAN_FRAME_FD &frame, int whichBus)
+{
+    if (state != BB_ARMED && state != BB_TRIGGERED) return;
+    recordFrame(frame.timestamp, frame.id, frame.extended, true, whichBus, frame.length, frame.data.uint8);
+}
+
+/*
+Bus off and the digital input are polled, every BLACKBOX_POLL_INTERVAL. Both trigger on the change only so a
+bus that stays off or an input held at its level fires once. Bus off is recorded as an event whether or not
+it is a trigger, it is worth seeing in the capture either way.
+*/
+void BlackBox::loop()
+{
+    if (state != BB_ARMED && state != BB_TRIGGERED) return;
+    if ((millis() - pollTimer) < BLACKBOX_POLL_INTERVAL) return;
+    pollTimer = millis();
+
+    twai_status_info_t status;
+    bool busOff = (twai_get_status_info(&status) == ESP_OK) && (status.state == TWAI_STATE_BUS_OFF);
+    if (busOff && !lastBusOff) addEvent(BB_EVENT_BUSOFF);
+    lastBusOff = busOff;
+
+    if (trigger.sources & BB_TRIG_INPUT)
+    {
+        bool level = digitalRead(trigger.input);
+        if (level != lastInput && level == (trigger.inputLevel != 0)) addEvent(BB_EVENT_INPUT);
+        lastInput = level;
+    }
+}
+
+//Records kept, oldest first. While frozen that is from pre trigger frames before the trigger to the end
+uint32_t BlackBox::getKept()
+{
+    if (!ring) return 0;
+    uint64_t oldest = (written > capacity) ? (written - capacity) : 0;
+    if (state == BB_FROZEN && triggerAt > preCount && (triggerAt - preCount) > oldest) oldest = triggerAt - preCount;
+    return (uint32_t)(written - oldest);
+}
+
+//Index into the kept records, 0 is the oldest
+bool BlackBox::getRecord(uint32_t index, BB_RECORD &out)
+{
+    uint32_t kept = getKept();
+    if (index >= kept) return false;
+    out = ring[(written - kept + index) % capacity];
+    return true;
+}
+
+//Where the trigger record is in the kept records, 0xFFFFFFFF if it hasn't triggered
+uint32_t BlackBox::getTriggerIndex()
+{
+    if (state != BB_TRIGGERED && state != BB_FROZEN) return 0xFFFFFFFF;
+    return (uint32_t)(triggerAt - (written - getKept()));
+}
+
+BB_RECORD *BlackBox::nextSlot()
+{
+    return &ring[written++ % capacity];
+}
+
+void BlackBox::recordFrame(uint32_t timestamp, uint32_t id, bool extended, bool fd, int whichBus, uint8_t length,
+                           uint8_t *data)
+{
+    BB_RECORD *rec = nextSlot();
+    rec->timestamp = timestamp;
+    rec->id = id | (extended ? 0x80000000ul : 0);
+    rec->flags = (whichBus & BB_FLAG_BUS) | (fd ? BB_FLAG_FD : 0);
+    rec->length = length;
+    memcpy(rec->data, data, (length < 8) ? length : 8);
+
+    if (state == BB_TRIGGERED)
+    {
+        if (--postLeft == 0) state = BB_FROZEN;
+    }
+    else if (matches(id, extended, whichBus, length, data)) triggered();
+}
+
+bool BlackBox::matches(uint32_t id, bool extended, int whichBus, uint8_t length, uint8_t *data)
+{
+    if (!(trigger.sources & BB_TRIG_FRAME)) return false;
+    if (trigger.bus != 0xFF && trigger.bus != whichBus) return false;
+    uint32_t fullID = id | (extended ? 0x80000000ul : 0);
+    if ((fullID ^ trigger.id) & trigger.idMask) return false;
+    for (int i = 0; i < 8; i++)
+    {
+        if (!trigger.dataMask[i]) continue;
+        if (i >= length || ((data[i] ^ trigger.data[i]) & trigger.dataMask[i])) return false;
+    }
+    return true;
+}
+
+void BlackBox::addEvent(BB_EVENT event)
+{
+    BB_RECORD *rec = nextSlot();
+    rec->timestamp = micros();
+    rec->id = event;
+    rec->flags = BB_FLAG_EVENT;
+    rec->length = 0;
+    memset(rec->data, 0, 8);
+
+    if (state == BB_TRIGGERED)
+    {
+        if (--postLeft == 0) state = BB_FROZEN;
+        return;
+    }
+    if (event == BB_EVENT_MANUAL || (event == BB_EVENT_BUSOFF && (trigger.sources & BB_TRIG_BUSOFF)) ||
+        (event == BB_EVENT_INPUT && (trigger.sources & BB_TRIG_INPUT)))
+    {
+        triggered();
+    }
+}
+
+//The record just written is the trigger
+void BlackBox::triggered()
+{
+    triggerAt = written - 1;
+    BB_RECORD *rec = &ring[triggerAt % capacity];
+    rec->flags |= BB_FLAG_TRIGGER;
+    triggerTime = rec->timestamp;
+    postLeft = postCount;
+    state = postCount ? BB_TRIGGERED : BB_FROZEN;
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <Arduino.h>
+#include "config.h"
+#include "esp32_can.h"
+
+enum BB_STATE
+{
+    BB_OFF = 0,         //not recording
+    BB_ARMED = 1,       //recording and watching for the trigger
+    BB_TRIGGERED = 2,   //recording the frames after the trigger
+    BB_FROZEN = 3       //holding the frames around the trigger for download
+};
+
+//What can set off the trigger, any number of them at once
+#define BB_TRIG_FRAME   1   //a frame matching the ID/mask and data pattern
+#define BB_TRIG_BUSOFF  2   //the built in controller (CAN0) going bus off
+#define BB_TRIG_INPUT   4   //a digital input changing to the given level
+
+//Record flags. Event records carry the event number in the ID and no data
+#define BB_FLAG_BUS     0x07
+#define BB_FLAG_FD      0x08
+#define BB_FLAG_EVENT   0x10
+#define BB_FLAG_TRIGGER 0x20    //the record that set off the trigger
+
+enum BB_EVENT
+{
+    BB_EVENT_BUSOFF = 1,
+    BB_EVENT_INPUT = 2,
+    BB_EVENT_MANUAL = 3
+};
+
+typedef struct {
+    uint32_t timestamp;
+    uint32_t id;        //bit 31 set for extended
+    uint8_t flags;
+    uint8_t length;     //FD frames keep their real length but only the first 8 bytes of data
+    uint8_t data[8];
+} __attribute__((__packed__)) BB_RECORD;
+
+typedef struct {
+    uint8_t sources;
+    uint8_t bus;        //frame trigger only. 0xFF = any bus
+    uint32_t id;        //bit 31 set for extended. Compared under idMask, which should include bit 31
+    uint32_t idMask;
+    uint8_t data[8];    //compared under dataMask. Bytes past the end of a frame don't match a mask that isn't 0
+    uint8_t dataMask[8];
+    uint8_t input;
+    uint8_t inputLevel;
+} BB_TRIGGER;
+
+/*
+Flight recorder style capture. While armed every received frame goes into a ring of fixed size records,
+before any filtering, so the ring always holds the latest traffic. When the trigger goes off the ring keeps
+going for the post trigger count and then freezes with the pre trigger frames, the trigger and the post
+trigger frames in it, ready to download. The ring is sized pre + 1 + post so nothing in that window is ever
+overwritten. It goes in PSRAM when the board has it, which is room for a few hundred thousand frames.
+Everything here runs from the main loop.
+*/
+class BlackBox
+{
+public:
+    BlackBox();
+    bool setDepth(uint32_t pre, uint32_t post);
+    bool setTrigger(BB_TRIGGER &newTrigger);
+    static bool isUsableInput(int pin);
+    BB_TRIGGER *getTrigger() { return &trigger; }
+    bool arm();
+    void disarm();
+    void fire(BB_EVENT cause);
+    void record(CAN_FRAME &frame, int whichBus);
+    void record(CAN_FRAME_FD &frame, int whichBus);
+    void loop();
+    BB_STATE getState() { return state; }
+    uint32_t getPre() { return preCount; }
+    uint32_t getPost() { return postCount; }
+    bool isInPSRAM() { return inPSRAM; }
+    uint32_t getKept();
+    bool getRecord(uint32_t index, BB_RECORD &out);
+    uint32_t getTriggerIndex();
+    uint32_t getTriggerTime() { return triggerTime; }
+
+private:
+    BB_RECORD *ring;
+    uint32_t capacity;
+    uint32_t preCount;
+    uint32_t postCount;
+    bool inPSRAM;
+    BB_STATE state;
+    BB_TRIGGER trigger;
+    uint64_t written;       //records written since arming. The newest is at written - 1
+    uint64_t triggerAt;     //written count of the trigger record
+    uint32_t postLeft;
+    uint32_t triggerTime;
+    uint32_t pollTimer;
+    bool lastBusOff;
+    bool lastInput;
+
+    BB_RECORD *nextSlot();
+    void recordFrame(uint32_t timestamp, uint32_t id, bool extended, bool fd, int whichBus, uint8_t length, uint8_t *data);
+    bool matches(uint32_t id, bool extended, int whichBus, uint8_t length, uint8_t *data);
+    void addEvent(BB_EVENT event);
+    void triggered();
+};
@@ -6,6 +6,13 @@
 #include "gvret_comm.h"
 #include "lawicel.h"
 #include "ELM327_Emulator.h"
+#include "frame_router.h"
+#include "frame_bits.h"
+#include "frame_filter.h"
+#include "frame_decimator.h"
+#include "frame_generator.h"
+#include "black_box.h"
+#include "staging_queue.h"
 
 
 //twai alerts copied here for ease of access. Look up alerts right here:
@@ -34,6 +41,12 @@
 CANManager::CANManager()
 {
     sendToConsole = true;
+    for (int i = 0; i < NUM_BUSES; i++)
+    {
+        captureBuses[i].attached = false;
+        captureBuses[i].bus = i;
+        deltaSuppressed[i] = 0;
+    }
 }
 
 void CANManager::setup()
@@ -101,45 +114,109 @@ void CANManager::setup()
 
     for (int j = 0; j < NUM_BUSES; j++)
     {
+        memset(&busLoad[j], 0, sizeof(BUSLOAD));
         busLoad[j].bitsPerQuarter = settings.canSettings[j].nomSpeed / 4;
-        busLoad[j].bitsSoFar = 0;
-        busLoad[j].busloadPercentage = 0;
         if (busLoad[j].bitsPerQuarter == 0) busLoad[j].bitsPerQuarter = 125000;
     }
 
+    FrameBits::init();
+    uint32_t tableSize = settings.idTableSize;
+    if (!tableSize) tableSize = heap_caps_get_free_size(MALLOC_CAP_SPIRAM) ? ID_TABLE_SIZE : ID_TABLE_SIZE_INTERNAL;
+    for (int i = 0; i < SysSettings.numBuses; i++)
+    {
+        uint8_t payloadBytes = (canBuses[i] && canBuses[i]->supportsFDMode()) ? 64 : 8;
+        if (!idTables[i].begin(tableSize, payloadBytes)) Serial.printf("Could not allocate ID table for CAN%u\n", i);
+    }
     busLoadTimer = millis();
+    txScheduler.setup();
+    if (settings.stagingKB && !stagingQueue.setSize(settings.stagingKB * 1024ul)) Serial.printf("Could not allocate staging queue\n");
+
+    if (settings.useDriverCapture) startCapture();
+}
+
+//Attach a listener and rings to every bus this board has. Buses that are currently disabled still get them
+//so that enabling them later from the console works without a reboot. A bus that can do FD has to get its
+//FD ring too, without it FD frames would have nowhere to go, so it is polled from loop instead.
+void CANManager::startCapture()
+{
+    for (int i = 0; i < SysSettings.numBuses; i++)
+    {
+        if (!canBuses[i]) continue;
+        if (captureBuses[i].attached) continue;
+        if (!captureBuses[i].frames.begin(CAPTURE_RING_SIZE) ||
+            (canBuses[i]->supportsFDMode() && !captureBuses[i].fdFrames.begin(CAPTURE_FD_RING_SIZE)))
+        {
+            Serial.printf("Could not allocate capture ring for CAN%u. Polling it from loop instead.\n", i);
+            continue;
+        }
+        captureBuses[i].attachGeneralHandler();
+        if (!canBuses[i]->attachObj(&captureBuses[i]))
+        {
+            captureBuses[i].detachGeneralHandler();
+            Serial.printf("Could not attach capture to CAN%u. Polling it from loop instead.\n", i);
+            continue;
+        }
+        captureBuses[i].attached = true;
+    }
+}
+
+//Called from the driver's receive task, the only producer for this bus' rings. Frames that don't fit are
+//dropped and counted as overflows, the controller keeps receiving either way. The timestamp is the one the
+//driver put on the frame when it came off the controller so queueing here and in the main loop doesn't skew it.
+void CaptureBus::gotFrame(CAN_FRAME *frame, int)
+{
+    if (!settings.canSettings[bus].enabled) return;
+    frames.push(*frame);
+}
+
+void CaptureBus::gotFrameFD(CAN_FRAME_FD *frame, int)
+{
+    if (!settings.canSettings[bus].enabled) return;
+    if (fdFrames.isAllocated()) fdFrames.push(*frame);
+}
+
+uint32_t CANManager::getCaptureOverflows(int whichBus)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return 0;
+    return captureBuses[whichBus].frames.getOverflows() + captureBuses[whichBus].fdFrames.getOverflows();
 }
 
 void CANManager::addBits(int offset, CAN_FRAME &frame)
 {
     if (offset < 0) return;
     if (offset >= NUM_BUSES) return;
-    busLoad[offset].bitsSoFar += 41 + (frame.length * 9);
-    if (frame.extended) busLoad[offset].bitsSoFar += 18;
+    busLoad[offset].bitsSoFar += FrameBits::classicBits(frame);
+    busLoad[offset].framesSoFar++;
 }
 
 void CANManager::addBits(int offset, CAN_FRAME_FD &frame)
 {
     if (offset < 0) return;
     if (offset >= NUM_BUSES) return;
-    busLoad[offset].bitsSoFar += 41 + (frame.length * 9);
-    if (frame.extended) busLoad[offset].bitsSoFar += 18;
+    busLoad[offset].bitsSoFar += FrameBits::fdLoadBits(frame, settings.canSettings[offset].nomSpeed,
+                                                       settings.canSettings[offset].fdSpeed);
+    busLoad[offset].framesSoFar++;
 }
 
-void CANManager::sendFrame(CAN_COMMON *bus, CAN_FRAME &frame)
+//Bits already counted elsewhere, frames sent from another task for instance
+void CANManager::addBitCount(int offset, uint32_t bits, uint32_t frames)
 {
-    int whichBus = 0;
-    for (int i = 0; i < NUM_BUSES; i++) if (canBuses[i] == bus) whichBus = i;
-    bus->sendFrame(frame);
-    addBits(whichBus, frame);
+    if (offset < 0) return;
+    if (offset >= NUM_BUSES) return;
+    busLoad[offset].bitsSoFar += bits;
+    busLoad[offset].framesSoFar += frames;
 }
 
-void CANManager::sendFrame(CAN_COMMON *bus, CAN_FRAME_FD &frame)
+//Frames go through the transmit scheduler. Bus load counts them once they actually reach the controller
+//and generator rules fill in their fields as they go to it.
+void CANManager::sendFrame(int whichBus, CAN_FRAME &frame, TX_PRIORITY priority)
 {
-    int whichBus = 0;
-    for (int i = 0; i < NUM_BUSES; i++) if (canBuses[i] == bus) whichBus = i;
-    bus->sendFrameFD(frame);
-    addBits(whichBus, frame);
+    txScheduler.queueFrame(whichBus, frame, priority);
+}
+
+void CANManager::sendFrame(int whichBus, CAN_FRAME_FD &frame)
+{
+    txScheduler.queueFrame(whichBus, frame);
 }
 
 
@@ -149,10 +226,14 @@ void CANManager::displayFrame(CAN_FRAME &frame, int whichBus)
     {
         lawicel.sendFrameToBuffer(frame, whichBus);
     } 
+    else if (stagingQueue.isActive() && (!stagingQueue.isEmpty() || !frameRouter.hasRoomForFrame(whichBus)))
+    {
+        //once anything is staged everything after it is too so frames still go out in order
+        stagingQueue.push(frame, whichBus);
+    }
     else 
     {
-        if (SysSettings.isWifiActive) wifiGVRET.sendFrameToBuffer(frame, whichBus);
-        else if (sendToConsole) serialGVRET.sendFrameToBuffer(frame, whichBus);
+        frameRouter.routeFrame(frame, whichBus);
     }
 }
 
@@ -160,12 +241,15 @@ void CANManager::displayFrame(CAN_FRAME_FD &frame, int whichBus)
 {
     if (settings.enableLawicel && SysSettings.lawicelMode) 
     {
-        //lawicel.sendFrameToBuffer(frame, whichBus);
+        lawicel.sendFrameToBuffer(frame, whichBus);
     } 
+    else if (stagingQueue.isActive() && (!stagingQueue.isEmpty() || !frameRouter.hasRoomForFrame(whichBus)))
+    {
+        stagingQueue.push(frame, whichBus);
+    }
     else 
     {
-        if (SysSettings.isWifiActive) wifiGVRET.sendFrameToBuffer(frame, whichBus);
-        else serialGVRET.sendFrameToBuffer(frame, whichBus);
+        frameRouter.routeFrame(frame, whichBus);
     }
 }
 
@@ -173,54 +257,243 @@ void CANManager::loop()
 {
     CAN_FRAME incoming;
     CAN_FRAME_FD inFD;
-    
-    size_t wifiLength = wifiGVRET.numAvailableBytes();
-    size_t serialLength = serialGVRET.numAvailableBytes();
-    size_t maxLength = (wifiLength > serialLength) ? wifiLength : serialLength;
-
-    if (millis() > (busLoadTimer + 250)) {
-        busLoadTimer = millis();
-        busLoad[0].busloadPercentage = ((busLoad[0].busloadPercentage * 3) + (((busLoad[0].bitsSoFar * 1000) / busLoad[0].bitsPerQuarter) / 10)) / 4;
-        //Force busload percentage to be at least 1% if any traffic exists at all. This forces the LED to light up for any traffic.
-        if (busLoad[0].busloadPercentage == 0 && busLoad[0].bitsSoFar > 0) busLoad[0].busloadPercentage = 1;
-        busLoad[0].bitsPerQuarter = settings.canSettings[0].nomSpeed / 4;
-        busLoad[0].bitsSoFar = 0;
-        if(busLoad[0].busloadPercentage > busLoad[1].busloadPercentage){
-            //updateBusloadLED(busLoad[0].busloadPercentage);
-        } else{
-            //updateBusloadLED(busLoad[1].busloadPercentage);
-        }
+
+    if ((millis() - busLoadTimer) >= BUSLOAD_WINDOW) {
+        busLoadTimer += BUSLOAD_WINDOW;
+        //if the loop stalled for a long time don't try to catch up window by window
+        if ((millis() - busLoadTimer) >= BUSLOAD_WINDOW) busLoadTimer = millis();
+        for (int i = 0; i < NUM_BUSES; i++) updateBusLoad(i);
     }
 
+    txScheduler.loop();
+    blackBox.loop();
+    stagingQueue.drain();
+    lawicel.loop();
+
     for (int i = 0; i < SysSettings.numBuses; i++)
     {
         if (!canBuses[i]) continue;
+        if (captureBuses[i].attached)
+        {
+            //the driver delivers to the capture listener, just empty what it has collected so far
+            while (hasOutputRoom(i))
+            {
+                if (captureBuses[i].frames.pop(incoming)) processIncomingFrame(incoming, i);
+                else if (captureBuses[i].fdFrames.pop(inFD)) processIncomingFrame(inFD, i);
+                else break;
+            }
+            continue;
+        }
         if (!settings.canSettings[i].enabled) continue;
-        while ( (canBuses[i]->available() > 0) && (maxLength < (WIFI_BUFF_SIZE - 80)))
+        while ( (canBuses[i]->available() > 0) && hasOutputRoom(i))
         {
             if (settings.canSettings[i].fdMode == 0)
             {
                 canBuses[i]->read(incoming);
-                addBits(i, incoming);
-                displayFrame(incoming, i);
+                incoming.timestamp = micros();
+                processIncomingFrame(incoming, i);
             }
             else
             {
                 canBuses[i]->readFD(inFD);
-                addBits(i, inFD);
-                displayFrame(inFD, i);
-            }
-            
-            toggleRXLED();
-            if ( ((incoming.id > 0x7DF) && (incoming.id < 0x7F0)) || elmEmulator.getMonitorMode())
-            {
-                //canManager.displayFrame(incoming, i);
-                if (i == settings.sendingBus)  elmEmulator.processCANReply(incoming);
+                inFD.timestamp = micros();
+                processIncomingFrame(inFD, i);
             }
-            
-            wifiLength = wifiGVRET.numAvailableBytes();
-            serialLength = serialGVRET.numAvailableBytes();
-            maxLength = (wifiLength > serialLength) ? wifiLength:serialLength;
         }
     }
 }
+
+//Close out the current window for this bus and recompute every figure from the window history
+void CANManager::updateBusLoad(int whichBus)
+{
+    BUSLOAD *load = &busLoad[whichBus];
+    uint64_t bits1s = 0, bits10s = 0;
+    uint32_t frames1s = 0;
+    uint32_t bits = load->bitsSoFar;
+    uint32_t frames = load->framesSoFar;
+    load->bitsSoFar = 0;
+    load->framesSoFar = 0;
+
+    load->bitHistory[load->historyPos] = bits;
+    load->frameHistory[load->historyPos] = frames;
+    load->historyPos = (load->historyPos + 1) % BUSLOAD_HISTORY;
+    if (load->historyFilled < BUSLOAD_HISTORY) load->historyFilled++;
+
+    for (int i = 1; i <= load->historyFilled; i++)
+    {
+        int idx = (load->historyPos + BUSLOAD_HISTORY - i) % BUSLOAD_HISTORY;
+        if (i <= BUSLOAD_SHORT)
+        {
+            bits1s += load->bitHistory[idx];
+            frames1s += load->frameHistory[idx];
+        }
+        bits10s += load->bitHistory[idx];
+    }
+
+    uint32_t shortWindows = (load->historyFilled < BUSLOAD_SHORT) ? load->historyFilled : BUSLOAD_SHORT;
+    load->loadInstant = ((uint64_t)bits * 1000) / load->bitsPerQuarter;
+    load->load1s = (bits1s * 1000) / ((uint64_t)load->bitsPerQuarter * shortWindows);
+    load->load10s = (bits10s * 1000) / ((uint64_t)load->bitsPerQuarter * load->historyFilled);
+    load->framesPerSecond = (frames1s * (1000 / BUSLOAD_WINDOW)) / shortWindows;
+    if (load->loadInstant > load->loadPeak) load->loadPeak = load->loadInstant;
+
+    load->busloadPercentage = ((load->busloadPercentage * 3) + (load->loadInstant / 10)) / 4;
+    //Force busload percentage to be at least 1% if any traffic exists at all. This forces the LED to light up for any traffic.
+    if (load->busloadPercentage == 0 && bits > 0) load->busloadPercentage = 1;
+    load->bitsPerQuarter = settings.canSettings[whichBus].nomSpeed / 4;
+    if (load->bitsPerQuarter == 0) load->bitsPerQuarter = 125000;
+}
+
+BUSLOAD *CANManager::getBusLoad(int whichBus)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return nullptr;
+    return &busLoad[whichBus];
+}
+
+void CANManager::resetBusLoadPeak(int whichBus)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return;
+    busLoad[whichBus].loadPeak = busLoad[whichBus].loadInstant;
+}
+
+//Only take frames in from a bus while every output it goes to can hold another one. Otherwise they wait in
+//the capture ring or the controller instead of being dropped by a full output buffer. With staging on, room in
+//the staging queue is what counts, the outputs can be as far behind as it holds. LAWICEL only writes to serial.
+bool CANManager::hasOutputRoom(int whichBus)
+{
+    if (settings.enableLawicel && SysSettings.lawicelMode) return serialGVRET.hasRoomForFrame();
+    if (stagingQueue.isActive()) return stagingQueue.hasRoom();
+    return frameRouter.hasRoomForFrame(whichBus);
+}
+
+//Filtered frames still count toward bus load, ID statistics, the black box and still reach the ELM327 emulator, they just aren't sent out
+void CANManager::processIncomingFrame(CAN_FRAME &frame, int whichBus)
+{
+    addBits(whichBus, frame);
+    blackBox.record(frame, whichBus);
+    ID_ENTRY *entry = updateIDStats(whichBus, IDTable::makeKey(frame.id, frame.extended), frame.data.uint8, frame.length, frame.timestamp);
+    if (frameFilter.accepts(whichBus, frame.id, frame.extended) &&
+        shouldOutput(whichBus, entry, frame.data.uint8, frame.length, frame.timestamp))
+    {
+        displayFrame(frame, whichBus);
+    }
+    toggleRXLED();
+    if ( ((frame.id > 0x7DF) && (frame.id < 0x7F0)) || elmEmulator.getMonitorMode())
+    {
+        if (whichBus == settings.sendingBus) elmEmulator.processCANReply(frame);
+    }
+}
+
+void CANManager::processIncomingFrame(CAN_FRAME_FD &frame, int whichBus)
+{
+    addBits(whichBus, frame);
+    blackBox.record(frame, whichBus);
+    ID_ENTRY *entry = updateIDStats(whichBus, IDTable::makeKey(frame.id, frame.extended), frame.data.uint8, frame.length, frame.timestamp);
+    if (frameFilter.accepts(whichBus, frame.id, frame.extended) &&
+        shouldOutput(whichBus, entry, frame.data.uint8, frame.length, frame.timestamp))
+    {
+        displayFrame(frame, whichBus);
+    }
+    toggleRXLED();
+}
+
+/*
+Per ID statistics, updated for every frame received. Everything is a running value so nothing is allocated
+and no history is kept. The average period moves 1/8 of the way toward each new period and the jitter
+1/16 of the way toward how far that period was from the average (the same smoothing RTP uses for jitter).
+Returns nullptr for IDs the table has no room for.
+*/
+ID_ENTRY *CANManager::updateIDStats(int whichBus, uint32_t key, uint8_t *data, uint8_t length, uint32_t timestamp)
+{
+    bool added;
+    ID_ENTRY *entry = idTables[whichBus].findOrAdd(key, added);
+    if (!entry) return nullptr;
+
+    if (entry->count > 0)
+    {
+        uint32_t period = timestamp - entry->lastSeen;
+        if (entry->count == 1)
+        {
+            entry->periodMin = entry->periodMax = entry->periodAvg = period;
+        }
+        else
+        {
+            if (period < entry->periodMin) entry->periodMin = period;
+            if (period > entry->periodMax) entry->periodMax = period;
+            int32_t diff = (int32_t)(period - entry->periodAvg);
+            entry->periodAvg += diff / 8;
+            uint32_t deviation = (diff < 0) ? -diff : diff;
+            entry->jitter += ((int32_t)(deviation - entry->jitter)) / 16;
+        }
+    }
+    entry->count++;
+    entry->lastSeen = timestamp;
+    entry->length = length;
+    memcpy(entry->data, data, (length > 8) ? 8 : length);
+    return entry;
+}
+
+//Decimation and delta mode both work off the entry the statistics just updated
+bool CANManager::shouldOutput(int whichBus, ID_ENTRY *entry, uint8_t *data, uint8_t length, uint32_t timestamp)
+{
+    //IDs the table has no room for always go out since there is nothing to go on for them
+    if (!entry) return true;
+    if (frameDecimator.isActive(whichBus) && !frameDecimator.passes(whichBus, entry, timestamp)) return false;
+    if (settings.deltaMode[whichBus]) return passesDelta(whichBus, entry, data, length, timestamp);
+    return true;
+}
+
+/*
+Delta mode. A frame only goes out if its payload differs from the last one sent for that ID, or if the ID
+has been quiet for the heartbeat time so the host can tell it is still alive. The last payload sent is kept
+byte for byte in the ID table. A payload longer than the table keeps (FD on a bus the table was sized for
+classic frames) always counts as changed.
+*/
+bool CANManager::passesDelta(int whichBus, ID_ENTRY *entry, uint8_t *data, uint8_t length, uint32_t timestamp)
+{
+    IDTable *table = &idTables[whichBus];
+    uint8_t *sent = table->sentPayload(entry);
+    bool changed = !(entry->flags & ID_FLAG_SENT) || (entry->sentLength != length) ||
+                   (length > table->payloadBytes()) || memcmp(sent, data, length);
+    uint32_t heartbeat = settings.deltaHeartbeat[whichBus] * 1000ul;
+    if (!changed && (heartbeat == 0 || (timestamp - entry->lastEmitted) < heartbeat))
+    {
+        deltaSuppressed[whichBus]++;
+        return false;
+    }
+
+    entry->flags |= ID_FLAG_SENT;
+    entry->sentLength = length;
+    memcpy(sent, data, (length > table->payloadBytes()) ? table->payloadBytes() : length);
+    entry->lastEmitted = timestamp;
+    return true;
+}
+
+//Turning delta mode on forgets what was sent before so the host gets the current value of every ID first
+void CANManager::setDeltaMode(int whichBus, bool enabled, uint16_t heartbeat)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return;
+    if (enabled && !settings.deltaMode[whichBus])
+    {
+        IDTable *table = &idTables[whichBus];
+        for (uint32_t i = 0; i < table->capacity(); i++)
+        {
+            ID_ENTRY *entry = table->entryAt(i);
+            if (entry) entry->flags &= ~ID_FLAG_SENT;
+        }
+    }
+    settings.deltaMode[whichBus] = enabled;
+    settings.deltaHeartbeat[whichBus] = heartbeat;
+}
+
+uint32_t CANManager::getDeltaSuppressed(int whichBus)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return 0;
+    return deltaSuppressed[whichBus];
+}
+
+IDTable *CANManager::getIDTable(int whichBus)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return nullptr;
+    return &idTables[whichBus];
+}
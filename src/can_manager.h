@@ -1,15 +1,44 @@
 #pragma once
 #include "config.h"
+#include <esp32_can.h>
+#include "frame_ring.h"
+#include "id_table.h"
+#include "tx_scheduler.h"
+
+//Load is measured over BUSLOAD_WINDOW ms windows. The last BUSLOAD_HISTORY windows are kept for the long average.
+#define BUSLOAD_WINDOW      250
+#define BUSLOAD_HISTORY     40
+#define BUSLOAD_SHORT       4
 
 typedef struct {
     uint32_t bitsPerQuarter;
     uint32_t bitsSoFar;
-    uint8_t busloadPercentage;
+    uint32_t framesSoFar;
+    uint8_t busloadPercentage;  //smoothed, drives the LED
+    uint32_t bitHistory[BUSLOAD_HISTORY];
+    uint32_t frameHistory[BUSLOAD_HISTORY];
+    uint8_t historyPos;
+    uint8_t historyFilled;
+    uint16_t loadInstant;       //all loads are in tenths of a percent
+    uint16_t load1s;
+    uint16_t load10s;
+    uint16_t loadPeak;
+    uint32_t framesPerSecond;
 } BUSLOAD;
 
-class CAN_COMMON;
-class CAN_FRAME;
-class CAN_FRAME_FD;
+//Capture for one bus. The driver hands every frame it receives to this listener from its own receive task,
+//which only wakes up when the controller has something, and the frames wait here for the main loop.
+class CaptureBus : public CANListener
+{
+public:
+    void gotFrame(CAN_FRAME *frame, int mailbox);
+    void gotFrameFD(CAN_FRAME_FD *frame, int mailbox);
+
+    FrameRing<CAN_FRAME> frames;
+    FrameRing<CAN_FRAME_FD> fdFrames;
+    bool attached;
+    int bus;
+};
 
 class CANManager
 {
@@ -17,16 +46,36 @@ public:
     CANManager();
     void addBits(int offset, CAN_FRAME &frame);
     void addBits(int offset, CAN_FRAME_FD &frame);    
-    void sendFrame(CAN_COMMON *bus, CAN_FRAME &frame);
-    void sendFrame(CAN_COMMON *bus, CAN_FRAME_FD &frame);
+    void addBitCount(int offset, uint32_t bits, uint32_t frames);
+    void sendFrame(int whichBus, CAN_FRAME &frame, TX_PRIORITY priority = TX_PRIO_NORMAL);
+    void sendFrame(int whichBus, CAN_FRAME_FD &frame);
     void displayFrame(CAN_FRAME &frame, int whichBus);
     void displayFrame(CAN_FRAME_FD &frame, int whichBus);
     void loop();
     void setup();
     void setSendToConsole(bool state) { sendToConsole = state; }
+    bool getSendToConsole() { return sendToConsole; }
+    uint32_t getCaptureOverflows(int whichBus);
+    BUSLOAD *getBusLoad(int whichBus);
+    void resetBusLoadPeak(int whichBus);
+    void setDeltaMode(int whichBus, bool enabled, uint16_t heartbeat);
+    uint32_t getDeltaSuppressed(int whichBus);
+    IDTable *getIDTable(int whichBus);
 
 private:
     BUSLOAD busLoad[NUM_BUSES];
+    CaptureBus captureBuses[NUM_BUSES];
+    IDTable idTables[NUM_BUSES];
+    uint32_t deltaSuppressed[NUM_BUSES];
     uint32_t busLoadTimer;
     bool sendToConsole;
+
+    void startCapture();
+    void updateBusLoad(int whichBus);
+    bool hasOutputRoom(int whichBus);
+    void processIncomingFrame(CAN_FRAME &frame, int whichBus);
+    void processIncomingFrame(CAN_FRAME_FD &frame, int whichBus);
+    ID_ENTRY *updateIDStats(int whichBus, uint32_t key, uint8_t *data, uint8_t length, uint32_t timestamp);
+    bool shouldOutput(int whichBus, ID_ENTRY *entry, uint8_t *data, uint8_t length, uint32_t timestamp);
+    bool passesDelta(int whichBus, ID_ENTRY *entry, uint8_t *data, uint8_t length, uint32_t timestamp);
 };
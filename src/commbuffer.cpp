@@ -1,37 +1,309 @@
 #include "commbuffer.h"
+#include <new>
 #include "Logger.h"
 #include "gvret_comm.h"
+#include "frame_bits.h"
+#include "utility.h"
 
 CommBuffer::CommBuffer()
 {
-    transmitBufferLength = 0;
+    head = 0;
+    for (int i = 0; i < COMM_MAX_READERS; i++)
+    {
+        readers[i].cursor = 0;
+        readers[i].active = false;
+        readers[i].writer = nullptr;
+        readers[i].task = nullptr;
+        readers[i].owner = this;
+        readers[i].index = i;
+        readers[i].compressor = nullptr;
+        readers[i].switchHead = 0;
+        readers[i].switchTail = 0;
+        readers[i].sendCompressed = false;
+    }
+    bytesDropped = 0;
+    framesDropped = 0;
+    highWater = 0;
+    wireFormat = FORMAT_GVRET_TEXT;
+    compressing = false;
+    integrity = false;
+    flushSequence = 0;
+    framesSinceMark = 0;
+    lastMarkHead = 0;
+    batchLength = 0;
+    batchFrames = 0;
+    for (int i = 0; i < NUM_BUSES; i++)
+    {
+        busFramesDropped[i] = 0;
+        batchBusFrames[i] = 0;
+    }
+}
+
+//Leaving batch mode sends whatever batch is open so it isn't mixed in with records of the new format
+void CommBuffer::setWireFormat(WIRE_FORMAT format)
+{
+    if (wireFormat == FORMAT_GVRET_BATCH && format != FORMAT_GVRET_BATCH) closeBatch();
+    wireFormat = format;
+}
+
+//Get a compressor for every sender so setCompression(true) can't fail part way. Returns false if there
+//isn't the RAM for them.
+bool CommBuffer::prepareCompression()
+{
+    bool ok = true;
+    for (int i = 0; i < COMM_MAX_READERS; i++)
+    {
+        if (!readers[i].active.load(std::memory_order_acquire) || !readers[i].writer) continue;
+        if (!readers[i].compressor) readers[i].compressor = new (std::nothrow) LZCompressor;
+        if (!readers[i].compressor) ok = false;
+    }
+    return ok;
+}
+
+//Everything already in the ring goes out the way it would have, everything after this point is sent
+//compressed (or not). Every sender queues the switch behind any it hasn't reached yet. If one of them already
+//has COMM_MODE_SWITCHES waiting the switch is refused and getCompression() still says how things stand.
+void CommBuffer::setCompression(bool enable)
+{
+    if (enable == compressing) return;
+    if (enable && !prepareCompression()) return;
+    for (int i = 0; i < COMM_MAX_READERS; i++)
+    {
+        if (!readers[i].active.load(std::memory_order_acquire) || !readers[i].writer) continue;
+        uint8_t waiting = readers[i].switchHead.load(std::memory_order_relaxed) - readers[i].switchTail.load(std::memory_order_acquire);
+        if (waiting >= COMM_MODE_SWITCHES) return;
+    }
+    closeBatch();
+    uint64_t point = ((uint64_t)head.load(std::memory_order_acquire) << 1) | (enable ? 1 : 0);
+    for (int i = 0; i < COMM_MAX_READERS; i++)
+    {
+        if (!readers[i].active.load(std::memory_order_acquire) || !readers[i].writer) continue;
+        uint8_t h = readers[i].switchHead.load(std::memory_order_relaxed);
+        readers[i].switches[h % COMM_MODE_SWITCHES].store(point, std::memory_order_relaxed);
+        readers[i].switchHead.store(h + 1, std::memory_order_release);
+    }
+    compressing = enable;
 }
 
+//Integrity mode puts a CRC-8 on the end of every extended record (not counted in its length byte) and ends each
+//flush with a sequence mark. Frame records always carry a CRC-8 in their checksum byte.
+void CommBuffer::setIntegrity(bool enable)
+{
+    closeBatch();
+    integrity = enable;
+    flushSequence = 0;
+    framesSinceMark = 0;
+    lastMarkHead = head.load(std::memory_order_relaxed);
+}
+
+//Bytes the slowest reader still has to send. With no readers there is nobody to wait for.
 size_t CommBuffer::numAvailableBytes()
 {
-    return transmitBufferLength;
+    uint32_t h = head.load(std::memory_order_acquire);
+    uint32_t pending = 0;
+    for (int i = 0; i < COMM_MAX_READERS; i++)
+    {
+        if (!readers[i].active.load(std::memory_order_acquire)) continue;
+        uint32_t p = h - readers[i].cursor.load(std::memory_order_acquire);
+        if (p > pending) pending = p;
+    }
+    return pending;
+}
+
+//Everything waiting to go out including an open batch that isn't in the ring yet
+size_t CommBuffer::pendingBytes()
+{
+    return numAvailableBytes() + batchLength;
+}
+
+size_t CommBuffer::freeBytes()
+{
+    return COMM_RING_SIZE - numAvailableBytes();
+}
+
+//Callers that pull frames in should stop once this goes false so frames wait upstream instead of being dropped here
+bool CommBuffer::hasRoomForFrame()
+{
+    return freeBytes() >= COMM_MAX_RECORD;
+}
+
+//Register a new reader. It only sees data written after this point. Returns -1 if all reader slots are taken.
+int CommBuffer::addReader()
+{
+    for (int i = 0; i < COMM_MAX_READERS; i++)
+    {
+        if (readers[i].active.load(std::memory_order_acquire)) continue;
+        readers[i].cursor.store(head.load(std::memory_order_acquire), std::memory_order_release);
+        readers[i].switchTail.store(readers[i].switchHead.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        readers[i].sendCompressed = compressing;
+        readers[i].active.store(true, std::memory_order_release);
+        return i;
+    }
+    return -1;
+}
+
+//Add a reader that gets written out with the given writer by its own task each time the buffer is flushed.
+//If the task can't be started the writer is called directly from flushBuffer() instead.
+bool CommBuffer::startSender(const char *name, CommWriter writer)
+{
+    int idx = addReader();
+    if (idx < 0) return false;
+    readers[idx].writer = writer;
+    if (xTaskCreatePinnedToCore(CommBuffer::senderLoop, name, COMM_SENDER_STACK, &readers[idx],
+                                COMM_SENDER_PRIORITY, &readers[idx].task, COMM_SENDER_CORE) != pdPASS)
+    {
+        readers[idx].task = nullptr;
+        return false;
+    }
+    return true;
+}
+
+//Wake up every sender so it writes out whatever it has not sent yet. Encoding can carry on into the
+//free part of the ring while they do.
+void CommBuffer::flushBuffer()
+{
+    closeBatch();
+    if (integrity) sendSequenceMark();
+    for (int i = 0; i < COMM_MAX_READERS; i++)
+    {
+        if (!readers[i].active.load(std::memory_order_acquire) || !readers[i].writer) continue;
+        if (readers[i].task) xTaskNotifyGive(readers[i].task);
+        else drainReader(&readers[i]);
+    }
+}
+
+//Contiguous run of bytes this reader has not sent yet. Data that wraps around the end of the ring
+//comes back on the next call.
+size_t CommBuffer::peekBytes(int reader, uint8_t **bytes)
+{
+    uint32_t cursor = readers[reader].cursor.load(std::memory_order_relaxed);
+    uint32_t pending = head.load(std::memory_order_acquire) - cursor;
+    uint32_t offset = cursor & (COMM_RING_SIZE - 1);
+    if (pending > (COMM_RING_SIZE - offset)) pending = COMM_RING_SIZE - offset;
+    *bytes = &ringBuffer[offset];
+    return pending;
+}
+
+void CommBuffer::consumeBytes(int reader, size_t length)
+{
+    readers[reader].cursor.fetch_add(length, std::memory_order_release);
+}
+
+void CommBuffer::senderLoop(void *param)
+{
+    COMM_READER *reader = (COMM_READER *)param;
+
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        reader->owner->drainReader(reader);
+    }
+}
+
+//Write out everything this reader has not sent yet. A span never crosses a point compression was switched
+//on or off at so the bytes before it go out the old way. Each compressed span is sent as one block.
+void CommBuffer::drainReader(COMM_READER *reader)
+{
+    uint8_t *bytes;
+    size_t length;
+    while ((length = peekBytes(reader->index, &bytes)) > 0)
+    {
+        uint32_t cursor = reader->cursor.load(std::memory_order_relaxed);
+        uint8_t tail = reader->switchTail.load(std::memory_order_relaxed);
+        if (tail != reader->switchHead.load(std::memory_order_acquire))
+        {
+            //switch points are never further from the cursor than the ring is long
+            uint64_t point = reader->switches[tail % COMM_MODE_SWITCHES].load(std::memory_order_relaxed);
+            int32_t untilSwitch = (int32_t)((uint32_t)(point >> 1) - cursor);
+            if (untilSwitch <= 0)
+            {
+                reader->sendCompressed = point & 1;
+                reader->switchTail.store(tail + 1, std::memory_order_release);
+                continue;
+            }
+            if (length > (size_t)untilSwitch) length = untilSwitch;
+        }
+        bool compress = reader->sendCompressed;
+
+        if (compress && reader->compressor)
+        {
+            size_t blockLength = reader->compressor->compressBlock(bytes, length);
+            reader->writer(reader->compressor->getBlock(), blockLength);
+        }
+        else reader->writer(bytes, length);
+        consumeBytes(reader->index, length);
+    }
 }
 
-void CommBuffer::clearBufferedBytes()
+void CommBuffer::writeToRing(uint8_t *bytes, size_t length)
 {
-    transmitBufferLength = 0;
+    uint32_t h = head.load(std::memory_order_relaxed);
+    uint32_t offset = h & (COMM_RING_SIZE - 1);
+    size_t first = COMM_RING_SIZE - offset;
+    if (first > length) first = length;
+    memcpy(&ringBuffer[offset], bytes, first);
+    if (length > first) memcpy(ringBuffer, bytes + first, length - first);
+    head.store(h + length, std::memory_order_release);
+
+    uint32_t used = numAvailableBytes();
+    if (used > highWater) highWater = used;
+}
+
+//Either the whole record goes into the ring or none of it does. A half written record would
+//desync whatever is parsing the stream on the other end. An open batch goes ahead of it, it holds older frames.
+bool CommBuffer::sendRecordToBuffer(uint8_t *record, size_t length, uint32_t frames, int whichBus)
+{
+    closeBatch();
+    if (length > freeBytes())
+    {
+        bytesDropped += length;
+        framesDropped += frames;
+        if (whichBus >= 0 && whichBus < NUM_BUSES) busFramesDropped[whichBus] += frames;
+        return false;
+    }
+    writeToRing(record, length);
+    framesSinceMark += frames;
+    return true;
 }
 
-uint8_t* CommBuffer::getBufferedBytes()
+/*
+Integrity mode. Each flush ends with 0xF1 PROTO_SEQUENCE 6 <sequence u16> <frames u32> <CRC-8>, frames being how
+many frames went into this buffer since the previous mark. A gap in the sequence or a frame count that doesn't
+match what arrived means bytes were lost on the way to the host. Frames the device itself dropped are reported
+separately. A mark that doesn't fit is skipped and the next one counts its frames too.
+*/
+void CommBuffer::sendSequenceMark()
 {
-    return transmitBuffer;
+    uint8_t record[10];
+    if (head.load(std::memory_order_relaxed) == lastMarkHead) return;
+    record[0] = 0xF1;
+    record[1] = PROTO_SEQUENCE;
+    record[2] = 6;
+    Utility::writeLE16(&record[3], flushSequence);
+    Utility::writeLE32(&record[5], framesSinceMark);
+    record[9] = Utility::crc8(record, 9);
+    if (!sendBytesToBuffer(record, sizeof(record))) return;
+    flushSequence++;
+    framesSinceMark = 0;
+    lastMarkHead = head.load(std::memory_order_relaxed);
 }
 
-//a bit faster version that blasts through the copy more efficiently.
-void CommBuffer::sendBytesToBuffer(uint8_t *bytes, size_t length)
+//Replies, time syncs and text. An open batch goes out first so none of these overtake older frames
+bool CommBuffer::sendBytesToBuffer(uint8_t *bytes, size_t length)
 {
-    memcpy(&transmitBuffer[transmitBufferLength], bytes, length);
-    transmitBufferLength += length;
+    closeBatch();
+    if (length > freeBytes())
+    {
+        bytesDropped += length;
+        return false;
+    }
+    writeToRing(bytes, length);
+    return true;
 }
 
-void CommBuffer::sendByteToBuffer(uint8_t byt)
+bool CommBuffer::sendByteToBuffer(uint8_t byt)
 {
-    transmitBuffer[transmitBufferLength++] = byt;
+    return sendBytesToBuffer(&byt, 1);
 }
 
 void CommBuffer::sendString(String str)
@@ -43,98 +315,204 @@ void CommBuffer::sendString(String str)
 
 void CommBuffer::sendCharString(char *str)
 {
-    char *p = str;
-    int i = 0;
-    while (*p)
+    size_t len = strlen(str);
+    sendBytesToBuffer((uint8_t *)str, len);
+    Logger::debug("Queued %i bytes", len);
+}
+
+void CommBuffer::sendFrameToBuffer(CAN_FRAME &frame, int whichBus)
+{
+    uint8_t record[COMM_MAX_RECORD];
+    size_t recordLength;
+    if (wireFormat == FORMAT_GVRET_BATCH)
     {
-        sendByteToBuffer(*p++);
-        i++;
+        //zigzag delta time, ID, flags then the data. The time is filled in by addToBatch
+        recordLength = 0;
+        uint32_t id = (frame.id << 1) | (frame.extended ? 1 : 0);
+        recordLength += putVarint(&record[recordLength], id);
+        record[recordLength++] = ((whichBus & 7) << 4) | (frame.length & 0x0F);
+        for (int c = 0; c < frame.length && c < 8; c++) record[recordLength++] = frame.data.uint8[c];
+        addToBatch(record, recordLength, frame.timestamp, whichBus);
+        return;
     }
-    Logger::debug("Queued %i bytes", i);
+    recordLength = encodeFrame(frame, whichBus, wireFormat, record);
+    sendRecordToBuffer(record, recordLength, 1, whichBus);
 }
 
-void CommBuffer::sendFrameToBuffer(CAN_FRAME &frame, int whichBus)
+void CommBuffer::sendFrameToBuffer(CAN_FRAME_FD &frame, int whichBus)
 {
-    uint8_t temp;
-    size_t writtenBytes;
-    if (settings.useBinarySerialComm) {
-        if (frame.extended) frame.id |= 1 << 31;
-        transmitBuffer[transmitBufferLength++] = 0xF1;
-        transmitBuffer[transmitBufferLength++] = 0; //0 = canbus frame sending
-        uint32_t now = micros();
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(now & 0xFF);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(now >> 8);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(now >> 16);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(now >> 24);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(frame.id & 0xFF);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(frame.id >> 8);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(frame.id >> 16);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(frame.id >> 24);
-        transmitBuffer[transmitBufferLength++] = frame.length + (uint8_t)(whichBus << 4);
+    uint8_t record[COMM_MAX_RECORD];
+    size_t recordLength;
+    if (wireFormat == FORMAT_GVRET_BATCH)
+    {
+        recordLength = 0;
+        uint32_t id = (frame.id << 1) | (frame.extended ? 1 : 0);
+        uint8_t dlc = FrameBits::fdLengthToDLC(frame.length);
+        int dataLength = FrameBits::fdDLCToLength(dlc);
+        recordLength += putVarint(&record[recordLength], id);
+        record[recordLength++] = 0x80 | ((whichBus & 7) << 4) | dlc;
+        for (int c = 0; c < dataLength; c++) record[recordLength++] = (c < frame.length) ? frame.data.uint8[c] : 0;
+        addToBatch(record, recordLength, frame.timestamp, whichBus);
+        return;
+    }
+    recordLength = encodeFrame(frame, whichBus, wireFormat, record);
+    sendRecordToBuffer(record, recordLength, 1, whichBus);
+}
+
+//LEB128 style, 7 bits per byte with the high bit set on every byte but the last. Returns the bytes written
+size_t CommBuffer::putVarint(uint8_t *out, uint32_t value)
+{
+    size_t len = 0;
+    while (value >= 0x80)
+    {
+        out[len++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    out[len++] = value;
+    return len;
+}
+
+/*
+Batch record: 0xF1 PROTO_BATCH_FRAMES <length> <first timestamp u32> then one entry per frame of
+<time delta varint> <ID varint> <flags> <data>. The time delta is from the previous frame in the batch, zigzag
+encoded since frames from different buses can come through slightly out of order. The ID is shifted up one
+with bit 0 set for extended IDs. Flags are FD in bit 7, the bus in bits 4-6 and the length (FD: DLC) in bits 0-3.
+A classic 8 byte frame with a standard ID comes to about 12 bytes instead of 20.
+*/
+void CommBuffer::addToBatch(uint8_t *entry, size_t length, uint32_t timestamp, int whichBus)
+{
+    uint8_t delta[5];
+    if (batchLength == 0) batchLastTime = timestamp;
+    int32_t diff = (int32_t)(timestamp - batchLastTime);
+    size_t deltaLength = putVarint(delta, ((uint32_t)diff << 1) ^ (uint32_t)(diff >> 31));
+
+    //one byte is kept back for the CRC in integrity mode
+    if (batchLength && (batchLength + deltaLength + length) > (COMM_MAX_RECORD - 1))
+    {
+        closeBatch();
+        batchLastTime = timestamp;
+        deltaLength = putVarint(delta, 0);
+    }
+    if (batchLength == 0)
+    {
+        batch[0] = 0xF1;
+        batch[1] = PROTO_BATCH_FRAMES;
+        Utility::writeLE32(&batch[3], timestamp);
+        batchLength = 7;
+    }
+    memcpy(&batch[batchLength], delta, deltaLength);
+    batchLength += deltaLength;
+    memcpy(&batch[batchLength], entry, length);
+    batchLength += length;
+    batchFrames++;
+    if (whichBus >= 0 && whichBus < NUM_BUSES) batchBusFrames[whichBus]++;
+    batchLastTime = timestamp;
+}
+
+//batchLength is cleared before the record goes out since sendRecordToBuffer closes any open batch first
+void CommBuffer::closeBatch()
+{
+    if (batchLength == 0) return;
+    size_t length = batchLength;
+    batchLength = 0;
+    batch[2] = length - 3;
+    if (integrity)
+    {
+        batch[length] = Utility::crc8(batch, length);
+        length++;
+    }
+    if (!sendRecordToBuffer(batch, length, batchFrames))
+    {
+        for (int i = 0; i < NUM_BUSES; i++) busFramesDropped[i] += batchBusFrames[i];
+    }
+    batchFrames = 0;
+    for (int i = 0; i < NUM_BUSES; i++) batchBusFrames[i] = 0;
+}
+
+//Text mode line: <timestamp> - <id> <X|S> <bus> <length> then the data bytes, all hex but the timestamp, bus
+//and length. Formatted by hand since this runs for every frame and sprintf per byte was the bottleneck.
+static size_t encodeText(uint32_t timestamp, uint32_t id, bool extended, int whichBus, int length, uint8_t *data, uint8_t *record)
+{
+    char *out = (char *)record;
+    size_t pos = Utility::putDecimal(out, timestamp);
+    out[pos++] = ' ';
+    out[pos++] = '-';
+    out[pos++] = ' ';
+    pos += Utility::putHexTrimmed(&out[pos], id);
+    out[pos++] = ' ';
+    out[pos++] = extended ? 'X' : 'S';
+    out[pos++] = ' ';
+    pos += Utility::putDecimal(&out[pos], whichBus);
+    out[pos++] = ' ';
+    pos += Utility::putDecimal(&out[pos], length);
+    for (int c = 0; c < length; c++)
+    {
+        out[pos++] = ' ';
+        pos += Utility::putHexTrimmed(&out[pos], data[c]);
+    }
+    out[pos++] = '\r';
+    out[pos++] = '\n';
+    return pos;
+}
+
+//Encode one frame into record (at least COMM_MAX_RECORD bytes) and return the length. Kept separate
+//from the buffer so a frame going to several outputs is only encoded once per format.
+//The timestamp sent is frame.timestamp, the micros() value taken when the frame was received.
+size_t CommBuffer::encodeFrame(CAN_FRAME &frame, int whichBus, WIRE_FORMAT format, uint8_t *record)
+{
+    size_t recordLength = 0;
+    uint32_t id = frame.id;
+    if (format == FORMAT_GVRET_BINARY) {
+        if (frame.extended) id |= 1ul << 31;
+        record[recordLength++] = 0xF1;
+        record[recordLength++] = 0; //0 = canbus frame sending
+        record[recordLength++] = (uint8_t)(frame.timestamp & 0xFF);
+        record[recordLength++] = (uint8_t)(frame.timestamp >> 8);
+        record[recordLength++] = (uint8_t)(frame.timestamp >> 16);
+        record[recordLength++] = (uint8_t)(frame.timestamp >> 24);
+        record[recordLength++] = (uint8_t)(id & 0xFF);
+        record[recordLength++] = (uint8_t)(id >> 8);
+        record[recordLength++] = (uint8_t)(id >> 16);
+        record[recordLength++] = (uint8_t)(id >> 24);
+        record[recordLength++] = frame.length + (uint8_t)(whichBus << 4);
         for (int c = 0; c < frame.length; c++) {
-            transmitBuffer[transmitBufferLength++] = frame.data.uint8[c];
+            record[recordLength++] = frame.data.uint8[c];
         }
-        //temp = checksumCalc(buff, 11 + frame.length);
-        temp = 0;
-        transmitBuffer[transmitBufferLength++] = temp;
-        //Serial.write(buff, 12 + frame.length);
+        //CRC-8 of the record up to here. Hosts that ignore the checksum byte are no worse off than with the old 0
+        record[recordLength] = Utility::crc8(record, recordLength);
+        recordLength++;
     } else {
-        writtenBytes = sprintf((char *)&transmitBuffer[transmitBufferLength], "%d - %x", micros(), frame.id);
-        transmitBufferLength += writtenBytes;
-        if (frame.extended) sprintf((char *)&transmitBuffer[transmitBufferLength], " X ");
-        else sprintf((char *)&transmitBuffer[transmitBufferLength], " S ");
-        transmitBufferLength += 3;
-        writtenBytes = sprintf((char *)&transmitBuffer[transmitBufferLength], "%i %i", whichBus, frame.length);
-        transmitBufferLength += writtenBytes;
-        for (int c = 0; c < frame.length; c++) {
-            writtenBytes = sprintf((char *)&transmitBuffer[transmitBufferLength], " %x", frame.data.uint8[c]);
-            transmitBufferLength += writtenBytes;
-        }
-        sprintf((char *)&transmitBuffer[transmitBufferLength], "\r\n");
-        transmitBufferLength += 2;
+        recordLength = encodeText(frame.timestamp, frame.id, frame.extended, whichBus, frame.length, frame.data.uint8, record);
     }
+    return recordLength;
 }
 
-void CommBuffer::sendFrameToBuffer(CAN_FRAME_FD &frame, int whichBus)
+size_t CommBuffer::encodeFrame(CAN_FRAME_FD &frame, int whichBus, WIRE_FORMAT format, uint8_t *record)
 {
-    uint8_t temp;
-    size_t writtenBytes;
-    if (settings.useBinarySerialComm) {
-        if (frame.extended) frame.id |= 1 << 31;
-        transmitBuffer[transmitBufferLength++] = 0xF1;
-        transmitBuffer[transmitBufferLength++] = PROTO_BUILD_FD_FRAME;
-        uint32_t now = micros();
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(now & 0xFF);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(now >> 8);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(now >> 16);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(now >> 24);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(frame.id & 0xFF);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(frame.id >> 8);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(frame.id >> 16);
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(frame.id >> 24);
-        transmitBuffer[transmitBufferLength++] = frame.length;
-        transmitBuffer[transmitBufferLength++] = (uint8_t)(whichBus);
+    size_t recordLength = 0;
+    uint32_t id = frame.id;
+    if (format == FORMAT_GVRET_BINARY) {
+        if (frame.extended) id |= 1ul << 31;
+        record[recordLength++] = 0xF1;
+        record[recordLength++] = PROTO_BUILD_FD_FRAME;
+        record[recordLength++] = (uint8_t)(frame.timestamp & 0xFF);
+        record[recordLength++] = (uint8_t)(frame.timestamp >> 8);
+        record[recordLength++] = (uint8_t)(frame.timestamp >> 16);
+        record[recordLength++] = (uint8_t)(frame.timestamp >> 24);
+        record[recordLength++] = (uint8_t)(id & 0xFF);
+        record[recordLength++] = (uint8_t)(id >> 8);
+        record[recordLength++] = (uint8_t)(id >> 16);
+        record[recordLength++] = (uint8_t)(id >> 24);
+        record[recordLength++] = frame.length;
+        record[recordLength++] = (uint8_t)(whichBus);
         for (int c = 0; c < frame.length; c++) {
-            transmitBuffer[transmitBufferLength++] = frame.data.uint8[c];
+            record[recordLength++] = frame.data.uint8[c];
         }
-        //temp = checksumCalc(buff, 11 + frame.length);
-        temp = 0;
-        transmitBuffer[transmitBufferLength++] = temp;
-        //Serial.write(buff, 12 + frame.length);
+        //CRC-8 as for classic frames
+        record[recordLength] = Utility::crc8(record, recordLength);
+        recordLength++;
     } else {
-        writtenBytes = sprintf((char *)&transmitBuffer[transmitBufferLength], "%d - %x", micros(), frame.id);
-        transmitBufferLength += writtenBytes;
-        if (frame.extended) sprintf((char *)&transmitBuffer[transmitBufferLength], " X ");
-        else sprintf((char *)&transmitBuffer[transmitBufferLength], " S ");
-        transmitBufferLength += 3;
-        writtenBytes = sprintf((char *)&transmitBuffer[transmitBufferLength], "%i %i", whichBus, frame.length);
-        transmitBufferLength += writtenBytes;
-        for (int c = 0; c < frame.length; c++) {
-            writtenBytes = sprintf((char *)&transmitBuffer[transmitBufferLength], " %x", frame.data.uint8[c]);
-            transmitBufferLength += writtenBytes;
-        }
-        sprintf((char *)&transmitBuffer[transmitBufferLength], "\r\n");
-        transmitBufferLength += 2;
+        recordLength = encodeText(frame.timestamp, frame.id, frame.extended, whichBus, frame.length, frame.data.uint8, record);
     }
+    return recordLength;
 }
-
@@ -1,23 +1,104 @@
 #pragma once
 #include <Arduino.h>
+#include <atomic>
 #include "config.h"
 #include "esp32_can.h"
+#include "lz_compressor.h"
+
+typedef void (*CommWriter)(uint8_t *bytes, size_t length);
+
+//How frames are encoded for a given output
+enum WIRE_FORMAT
+{
+    FORMAT_GVRET_TEXT = 0,
+    FORMAT_GVRET_BINARY = 1,
+    FORMAT_GVRET_BATCH = 2,     //binary, several frames packed per record. Encoded per buffer, not shared
+    NUM_WIRE_FORMATS
+};
+
+class CommBuffer;
+
+//One consumer of a CommBuffer. Each reader has its own cursor so a slow reader never loses data
+//another reader has already sent, it only holds back space in the ring.
+typedef struct {
+    std::atomic<uint32_t> cursor;
+    std::atomic<bool> active;
+    CommWriter writer;
+    TaskHandle_t task;
+    CommBuffer *owner;
+    int index;
+    LZCompressor *compressor;           //only allocated once compression is first turned on
+    //compression switches this reader hasn't reached yet, each (head at the switch << 1) | compress from there on.
+    //Only setCompression() moves switchHead and only the reader moves switchTail and sendCompressed
+    std::atomic<uint64_t> switches[COMM_MODE_SWITCHES];
+    std::atomic<uint8_t> switchHead;
+    std::atomic<uint8_t> switchTail;
+    bool sendCompressed;                //how the bytes before the oldest pending switch go out
+} COMM_READER;
 
 class CommBuffer
 {
 public:
     CommBuffer();
     size_t numAvailableBytes();
-    uint8_t* getBufferedBytes();
-    void clearBufferedBytes();
+    size_t pendingBytes();
+    size_t freeBytes();
+    bool hasRoomForFrame();
+    int addReader();
+    bool startSender(const char *name, CommWriter writer);
+    void flushBuffer();
+    size_t peekBytes(int reader, uint8_t **bytes);
+    void consumeBytes(int reader, size_t length);
+    void setWireFormat(WIRE_FORMAT format);
+    WIRE_FORMAT getWireFormat() { return wireFormat; }
+    bool prepareCompression();
+    void setCompression(bool enable);
+    bool getCompression() { return compressing; }
+    void setIntegrity(bool enable);
+    bool getIntegrity() { return integrity; }
+    static size_t putVarint(uint8_t *out, uint32_t value);
+    static size_t encodeFrame(CAN_FRAME &frame, int whichBus, WIRE_FORMAT format, uint8_t *record);
+    static size_t encodeFrame(CAN_FRAME_FD &frame, int whichBus, WIRE_FORMAT format, uint8_t *record);
     void sendFrameToBuffer(CAN_FRAME &frame, int whichBus);
     void sendFrameToBuffer(CAN_FRAME_FD &frame, int whichBus);
-    void sendBytesToBuffer(uint8_t *bytes, size_t length);
-    void sendByteToBuffer(uint8_t byt);
+    bool sendRecordToBuffer(uint8_t *record, size_t length, uint32_t frames = 1, int whichBus = -1);
+    bool sendBytesToBuffer(uint8_t *bytes, size_t length);
+    bool sendByteToBuffer(uint8_t byt);
     void sendString(String str);
     void sendCharString(char *str);
+    uint32_t getBytesDropped() { return bytesDropped; }
+    uint32_t getFramesDropped() { return framesDropped; }
+    uint32_t getHighWater() { return highWater; }
+    uint32_t getBusFramesDropped(int whichBus) { return (whichBus >= 0 && whichBus < NUM_BUSES) ? busFramesDropped[whichBus] : 0; }
+
+private:
+    byte ringBuffer[COMM_RING_SIZE];
+    std::atomic<uint32_t> head; //free running, only the producer moves it
+    COMM_READER readers[COMM_MAX_READERS];
+    uint32_t bytesDropped;
+    uint32_t framesDropped;
+    uint32_t busFramesDropped[NUM_BUSES];
+    uint32_t highWater;
+    WIRE_FORMAT wireFormat;
+    bool compressing;
+
+    //integrity mode, sequence mark state
+    bool integrity;
+    uint16_t flushSequence;
+    uint32_t framesSinceMark;
+    uint32_t lastMarkHead;
+
+    //batch record being built up. It goes into the ring when full or when the buffer is flushed
+    uint8_t batch[COMM_MAX_RECORD];
+    size_t batchLength;
+    uint32_t batchFrames;
+    uint32_t batchLastTime;
+    uint32_t batchBusFrames[NUM_BUSES];
 
-protected:
-    byte transmitBuffer[WIFI_BUFF_SIZE];
-    int transmitBufferLength; //not creating a ring buffer. The buffer should be large enough to never overflow
-};
\ No newline at end of file
+    void writeToRing(uint8_t *bytes, size_t length);
+    void addToBatch(uint8_t *entry, size_t length, uint32_t timestamp, int whichBus);
+    void closeBatch();
+    void sendSequenceMark();
+    void drainReader(COMM_READER *reader);
+    static void senderLoop(void *param);
+};
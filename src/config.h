@@ -49,6 +49,93 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 //This keeps the latency more consistent. Otherwise the buffer could partially fill and never send.
 #define SER_BUFF_FLUSH_INTERVAL 20000
 
+//Most bytes taken from the serial port or a WiFi client in one read. Whole GVRET commands are decoded straight
+//out of this span, only a command cut off at the end of it goes through the byte at a time parser.
+#define GVRET_READ_CHUNK        256
+
+//Each output buffer is a ring of this many bytes (power of two). Frames are encoded at the head while every
+//reader (sender task) writes out from its own cursor, so encoding and sending overlap. Records that do not
+//fit are dropped whole and counted instead of overwriting data a reader has not sent yet.
+#define COMM_RING_SIZE          4096
+#define COMM_MAX_READERS        4
+#define COMM_MAX_RECORD         256 //largest single record (a text mode FD frame) that gets encoded in one go
+#define COMM_MODE_SWITCHES      4   //compression on/off switches a sender can have queued before it reaches them
+#define COMM_SENDER_STACK       4096
+#define COMM_SENDER_PRIORITY    3
+#define COMM_SENDER_CORE        0
+
+//When capture is enabled each CAN bus gets a listener on its driver. The driver's receive task hands it every
+//frame as it comes in and the listener puts it in a ring of frames. The main loop then only has to format and
+//send what is in the rings so a stall in WiFi or USB output no longer leaves frames sitting in the hardware
+//queues until they overflow. Ring sizes must be powers of two.
+#define CAPTURE_RING_SIZE       128
+#define CAPTURE_FD_RING_SIZE    32
+
+//Per bus table of the IDs seen, used for ID statistics, delta mode and decimation. Power of two.
+//A quarter of it is kept free so at most 3/4 of this many IDs are tracked on each bus. Boards with PSRAM
+//get ID_TABLE_SIZE, the rest ID_TABLE_SIZE_INTERNAL, unless IDTABLE on the console says otherwise.
+//IDs past that still go out but without delta or decimation. A GVRET connection in integrity mode is told.
+#define ID_TABLE_SIZE           1024
+#define ID_TABLE_SIZE_INTERNAL  512
+#define ID_TABLE_MIN            64
+#define ID_TABLE_MAX            4096
+#define ID_TABLE_MAX_INTERNAL   65536   //largest single allocation for a table allowed in internal RAM
+
+//LAWICEL polled mode queues received frames per bus until the host asks for them with P or A. The FD queue
+//is only allocated for buses in FD mode. Powers of two.
+#define LAWICEL_QUEUE_SIZE      64
+#define LAWICEL_FD_QUEUE_SIZE   16
+
+//Transmit queues, per bus and per priority. Powers of two. The FD queue is shared by all priorities.
+#define TX_QUEUE_SIZE           32
+#define TX_FD_QUEUE_SIZE        8
+//How often the built in controller's transmit error counts are read (ms)
+#define TX_STATUS_INTERVAL      100
+
+//Cyclic transmit table shared by all buses. Entry numbers go over GVRET in a byte with 0xFF meaning none.
+//The wheel has one slot per tick and must be a power of two, the tick has to divide evenly into a millisecond.
+//The task runs at a high priority so frames coming in don't hold it up.
+#define CYCLIC_MAX_ENTRIES      255
+#define CYCLIC_WHEEL_SLOTS      256
+#define CYCLIC_TICK_US          1000
+#define CYCLIC_TASK_STACK       4096
+#define CYCLIC_TASK_PRIORITY    6
+#define CYCLIC_TASK_CORE        1
+
+//Replay of an uploaded capture. The task sleeps until REPLAY_SPIN_US before a frame is due and spins from there.
+//A frame the controller still hasn't taken REPLAY_MAX_LATE after it was due is skipped. Times in us.
+//It runs on core 0 at a low priority. When it has gone a tick without blocking it sits one out, but only if the
+//next frame is more than a tick plus REPLAY_YIELD_MARGIN away. A capture too dense to ever leave such a gap still
+//yields once REPLAY_MAX_BUSY has passed so the idle task gets to feed the watchdog
+#define REPLAY_MAX_SIZE         65536
+#define REPLAY_SPIN_US          200
+#define REPLAY_MAX_LATE         10000
+#define REPLAY_YIELD_MARGIN     500
+#define REPLAY_MAX_BUSY         1000000
+#define REPLAY_TASK_STACK       4096
+#define REPLAY_TASK_PRIORITY    4
+#define REPLAY_TASK_CORE        0
+
+//Black box capture. The ring goes in PSRAM when there is some, otherwise internal RAM but no more than
+//BLACKBOX_MAX_INTERNAL bytes of it. Records are 18 bytes. Bus off and the trigger input are polled every
+//BLACKBOX_POLL_INTERVAL ms
+#define BLACKBOX_MAX_SIZE       3145728
+#define BLACKBOX_MAX_INTERNAL   32768
+#define BLACKBOX_POLL_INTERVAL  10
+
+//Staging queue between capture and the outputs, see StagingQueue. Sized in KB from the console, at most
+//STAGING_MAX_SIZE. Boards without PSRAM get no more than STAGING_MAX_INTERNAL bytes of internal RAM
+#define STAGING_MAX_SIZE        2097152
+#define STAGING_MAX_INTERNAL    32768
+
+//How often a GVRET connection in extended time mode gets a 64 bit time sync record (microseconds)
+#define EXT_TIME_SYNC_INTERVAL  1000000
+//The host clock fit only uses this many of the latest host time samples so it follows a drift that changes
+#define HOST_TIME_WINDOW        32
+
+//Shortest time between dropped frame reports on a GVRET connection in integrity mode (microseconds)
+#define DROP_REPORT_INTERVAL    100000
+
 #define CFG_BUILD_NUM   618
 #define CFG_VERSION "Alpha Nov 29 2020"
 #define PREF_NAME   "ESP32RET"
@@ -78,6 +165,9 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define SW_MODE0  26
 #define SW_MODE1  27
 
+//bit for a GPIO in SystemSettings::reservedPins
+#define PIN_BIT(pin) (1ull << (pin))
+
 //How many devices to allow to connect to our WiFi telnet port?
 #define MAX_CLIENTS 1
 
@@ -110,6 +200,14 @@ struct EEPROMSettings {
 
     boolean enableLawicel;
 
+    boolean useDriverCapture; //capture each CAN bus from its driver's receive task instead of polling from loop()
+    uint8_t busRoutes[NUM_BUSES]; //bitmask of outputs that get frames from each bus. 0 = automatic
+    boolean deltaMode[NUM_BUSES]; //only send a frame when its payload differs from the last one with that ID
+    uint16_t deltaHeartbeat[NUM_BUSES]; //in delta mode still send an unchanged ID this often (ms). 0 = never
+    uint16_t txGap[NUM_BUSES]; //least time between frames handed to the controller (us). 0 = as fast as it takes them
+    uint16_t stagingKB; //size of the staging queue that holds frames while the outputs are stalled. 0 = off
+    uint16_t idTableSize; //slots in each bus' ID table. 0 = pick by whether there is PSRAM
+
     //if we're using WiFi then output to serial is disabled (it's far too slow to keep up)  
     uint8_t wifiMode; //0 = don't use wifi, 1 = connect to an AP, 2 = Create an AP
     char SSID[32];     //null terminated string for the SSID
@@ -129,13 +227,13 @@ struct SystemSettings {
     boolean lawicellExtendedMode;
     boolean lawicelAutoPoll;
     boolean lawicelTimestamping;
-    int lawicelPollCounter;
     boolean lawicelBusReception[NUM_BUSES]; //does user want to see messages from this bus?
     int8_t numBuses; //number of buses this hardware currently supports.
     WiFiClient clientNodes[MAX_CLIENTS];
     WiFiClient wifiOBDClients[MAX_CLIENTS];
     boolean isWifiConnected;
     boolean isWifiActive;
+    uint64_t reservedPins; //GPIOs the CAN controllers, SPI, transceiver controls and LEDs use. PIN_BIT per pin
 };
 
 class GVRET_Comm_Handler;
@@ -143,6 +241,15 @@ class SerialConsole;
 class CANManager;
 class LAWICELHandler;
 class ELM327Emu;
+class FrameRouter;
+class FrameFilter;
+class FrameDecimator;
+class TxScheduler;
+class CyclicTx;
+class FrameGenerator;
+class ReplayEngine;
+class BlackBox;
+class StagingQueue;
 
 extern EEPROMSettings settings;
 extern SystemSettings SysSettings;
@@ -153,6 +260,15 @@ extern SerialConsole console;
 extern CANManager canManager;
 extern LAWICELHandler lawicel;
 extern ELM327Emu elmEmulator;
+extern FrameRouter frameRouter;
+extern FrameFilter frameFilter;
+extern FrameDecimator frameDecimator;
+extern TxScheduler txScheduler;
+extern CyclicTx cyclicTx;
+extern FrameGenerator frameGenerator;
+extern ReplayEngine replayEngine;
+extern BlackBox blackBox;
+extern StagingQueue stagingQueue;
 extern char deviceName[20];
 extern char otaHost[40];
 extern char otaFilename[100];
@@ -0,0 +1,285 @@
+#include "cyclic_tx.h"
+#include "tx_scheduler.h"
+#include "frame_generator.h"
+#include "timebase.h"
+#include <new>
+
+CyclicTx::CyclicTx()
+{
+    entries = nullptr;
+    for (int i = 0; i < CYCLIC_WHEEL_SLOTS; i++) wheel[i] = -1;
+    entryCount = 0;
+    currentTick = 0;
+    startTime = 0;
+    lock = nullptr;
+    task = nullptr;
+    timer = nullptr;
+    timerRunning = false;
+}
+
+//Nothing is allocated until the first entry is added
+bool CyclicTx::begin()
+{
+    if (task) return true;
+    if (!entries)
+    {
+        entries = new (std::nothrow) CYCLIC_ENTRY[CYCLIC_MAX_ENTRIES]();
+        if (!entries) return false;
+    }
+    if (!lock) lock = xSemaphoreCreateMutex();
+    if (!lock) return false;
+
+    if (!timer)
+    {
+        esp_timer_create_args_t args;
+        memset(&args, 0, sizeof(args));
+        args.callback = CyclicTx::timerCallback;
+        args.arg = this;
+        args.dispatch_method = ESP_TIMER_TASK;
+        args.name = "cyclic_tx";
+        if (esp_timer_create(&args, &timer) != ESP_OK)
+        {
+            timer = nullptr;
+            return false;
+        }
+    }
+
+    if (xTaskCreatePinnedToCore(CyclicTx::taskLoop, "CYCLIC_TX", CYCLIC_TASK_STACK, this,
+                                CYCLIC_TASK_PRIORITY, &task, CYCLIC_TASK_CORE) != pdPASS)
+    {
+        task = nullptr;
+        return false;
+    }
+    return true;
+}
+
+//Both with the lock held. Ticks carry on from where they stopped so the task doesn't try to catch up on
+//every tick the timer was off for
+void CyclicTx::startTimer()
+{
+    if (timerRunning) return;
+    startTime = TimeBase::now() - (uint64_t)currentTick * CYCLIC_TICK_US;
+    if (esp_timer_start_periodic(timer, CYCLIC_TICK_US) == ESP_OK) timerRunning = true;
+}
+
+void CyclicTx::stopTimer()
+{
+    if (!timerRunning) return;
+    esp_timer_stop(timer);
+    timerRunning = false;
+}
+
+//Returns the entry number or -1 if the table is full or could not be set up. The first frame goes out on the next tick.
+int CyclicTx::addEntry(int whichBus, CAN_FRAME &frame, uint16_t period)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES || !canBuses[whichBus]) return -1;
+    if (period == 0) return -1;
+    if (!begin()) return -1;
+
+    int found = -1;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int i = 0; i < CYCLIC_MAX_ENTRIES; i++)
+    {
+        if (entries[i].inUse) continue;
+        CYCLIC_ENTRY *entry = &entries[i];
+        *entry = CYCLIC_ENTRY();
+        entry->frame = frame;
+        entry->period = period;
+        entry->bus = whichBus;
+        entry->inUse = true;
+        entry->enabled = true;
+        entry->intervalMin = 0xFFFFFFFF;
+        entry->due = currentTick + 1;
+        link(i);
+        entryCount++;
+        found = i;
+        break;
+    }
+    if (found >= 0) startTimer();
+    xSemaphoreGive(lock);
+    return found;
+}
+
+bool CyclicTx::removeEntry(int entry)
+{
+    if (!entries || entry < 0 || entry >= CYCLIC_MAX_ENTRIES) return false;
+    bool removed = false;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (entries[entry].inUse)
+    {
+        unlink(entry);
+        entries[entry].inUse = false;
+        entryCount--;
+        removed = true;
+        if (!entryCount) stopTimer();
+    }
+    xSemaphoreGive(lock);
+    return removed;
+}
+
+//A disabled entry stays on the wheel and keeps its phase, it just doesn't send
+bool CyclicTx::setEnabled(int entry, bool enabled)
+{
+    if (!entries || entry < 0 || entry >= CYCLIC_MAX_ENTRIES) return false;
+    bool found = false;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (entries[entry].inUse)
+    {
+        entries[entry].enabled = enabled;
+        found = true;
+    }
+    xSemaphoreGive(lock);
+    return found;
+}
+
+void CyclicTx::clear()
+{
+    if (!entries) return;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int i = 0; i < CYCLIC_WHEEL_SLOTS; i++) wheel[i] = -1;
+    for (int i = 0; i < CYCLIC_MAX_ENTRIES; i++) entries[i].inUse = false;
+    entryCount = 0;
+    stopTimer();
+    xSemaphoreGive(lock);
+}
+
+//With reset the timing figures start over once they have been copied, in one go so no send falls in between
+bool CyclicTx::getEntry(int entry, CYCLIC_ENTRY &copy, bool reset)
+{
+    if (!entries || entry < 0 || entry >= CYCLIC_MAX_ENTRIES) return false;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    bool found = entries[entry].inUse;
+    if (found)
+    {
+        copy = entries[entry];
+        if (reset) clearStats(&entries[entry]);
+    }
+    xSemaphoreGive(lock);
+    return found;
+}
+
+bool CyclicTx::resetStats(int entry)
+{
+    if (!entries || entry < 0 || entry >= CYCLIC_MAX_ENTRIES) return false;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (!entries[entry].inUse)
+    {
+        xSemaphoreGive(lock);
+        return false;
+    }
+    clearStats(&entries[entry]);
+    xSemaphoreGive(lock);
+    return true;
+}
+
+void CyclicTx::clearStats(CYCLIC_ENTRY *e)
+{
+    e->sent = 0;
+    e->missed = 0;
+    e->lateTotal = 0;
+    e->lateMax = 0;
+    e->intervalMin = 0xFFFFFFFF;
+    e->intervalMax = 0;
+    e->lastSentAt = 0;
+}
+
+void CyclicTx::link(int entry)
+{
+    int16_t *slot = &wheel[entries[entry].due & (CYCLIC_WHEEL_SLOTS - 1)];
+    entries[entry].next = *slot;
+    *slot = entry;
+}
+
+void CyclicTx::unlink(int entry)
+{
+    int16_t *pos = &wheel[entries[entry].due & (CYCLIC_WHEEL_SLOTS - 1)];
+    while (*pos != -1)
+    {
+        if (*pos == entry)
+        {
+            *pos = entries[entry].next;
+            return;
+        }
+        pos = &entries[*pos].next;
+    }
+}
+
+//Everything in this tick's slot that is due now goes out and moves on to the slot for its next time.
+//Entries further out stay where they are until the wheel comes around to them again.
+void CyclicTx::runTick(uint32_t tick)
+{
+    int16_t *pos = &wheel[tick & (CYCLIC_WHEEL_SLOTS - 1)];
+    while (*pos != -1)
+    {
+        int idx = *pos;
+        CYCLIC_ENTRY *entry = &entries[idx];
+        if ((int32_t)(entry->due - tick) > 0)
+        {
+            pos = &entry->next;
+            continue;
+        }
+        *pos = entry->next;
+        fire(entry, tick);
+        entry->due = tick + entry->period * (1000 / CYCLIC_TICK_US);
+        link(idx);
+    }
+}
+
+void CyclicTx::fire(CYCLIC_ENTRY *entry, uint32_t tick)
+{
+    if (!entry->enabled || !settings.canSettings[entry->bus].enabled) return;
+
+    uint64_t now = TimeBase::now();
+    uint32_t late = (uint32_t)(now - (startTime + (uint64_t)tick * CYCLIC_TICK_US));
+    //a frame that would go out more than a whole period late is skipped rather than sent in a burst with the next one
+    if (late >= (uint32_t)entry->period * 1000)
+    {
+        entry->missed++;
+        return;
+    }
+    CAN_FRAME out = entry->frame;
+    frameGenerator.apply(entry->bus, out);
+    if (!txScheduler.sendNow(entry->bus, out))
+    {
+        entry->missed++;
+        return;
+    }
+    frameGenerator.advance(entry->bus, out);
+
+    uint32_t sentAt = (uint32_t)now;
+    if (entry->sent)
+    {
+        uint32_t interval = sentAt - entry->lastSentAt;
+        if (interval < entry->intervalMin) entry->intervalMin = interval;
+        if (interval > entry->intervalMax) entry->intervalMax = interval;
+    }
+    entry->lastSentAt = sentAt;
+    entry->sent++;
+    entry->lateTotal += late;
+    if (late > entry->lateMax) entry->lateMax = late;
+}
+
+//Runs in the esp_timer task which has to stay quick, so it only wakes ours
+void CyclicTx::timerCallback(void *param)
+{
+    CyclicTx *cyclic = (CyclicTx *)param;
+    xTaskNotifyGive(cyclic->task);
+}
+
+//Works out the tick from the clock rather than counting wakeups so a late wakeup runs every tick it missed
+void CyclicTx::taskLoop(void *param)
+{
+    CyclicTx *cyclic = (CyclicTx *)param;
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        uint32_t nowTick = (uint32_t)((TimeBase::now() - cyclic->startTime) / CYCLIC_TICK_US);
+        xSemaphoreTake(cyclic->lock, portMAX_DELAY);
+        while ((int32_t)(nowTick - cyclic->currentTick) > 0)
+        {
+            cyclic->currentTick++;
+            cyclic->runTick(cyclic->currentTick);
+        }
+        xSemaphoreGive(cyclic->lock);
+    }
+}
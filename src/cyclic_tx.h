@@ -0,0 +1,70 @@
+#pragma once
+#include <Arduino.h>
+#include "freertos/semphr.h"
+#include <esp_timer.h>
+#include "config.h"
+#include "esp32_can.h"
+
+typedef struct {
+    CAN_FRAME frame;
+    uint16_t period;        //ms
+    uint8_t bus;
+    bool inUse;
+    bool enabled;
+    int16_t next;           //next entry in the same wheel slot, -1 ends the list
+    uint32_t due;           //tick it goes out on next
+
+    //Lateness is how long after its scheduled time a frame reached the controller. Intervals are between
+    //frames that actually went out so their spread is the jitter the bus sees.
+    uint32_t sent;
+    uint32_t missed;        //the controller was full or the task was more than a period behind
+    uint64_t lateTotal;
+    uint32_t lateMax;
+    uint32_t intervalMin;
+    uint32_t intervalMax;
+    uint32_t lastSentAt;
+} CYCLIC_ENTRY;
+
+/*
+Table of frames sent over and over at a fixed period, for standing in for ECUs without the host having to
+send every frame. An esp_timer ticks every CYCLIC_TICK_US and wakes a task that sends whatever is due.
+The timer only runs while the table has entries in it.
+Entries hang off a timer wheel of CYCLIC_WHEEL_SLOTS slots by the tick they are due on so a tick only
+looks at the entries in its own slot, not the whole table. Periods longer than the wheel just go around it
+more than once. The frames go to the controller through TxScheduler::sendNow so they don't wait behind
+the transmit queues.
+*/
+class CyclicTx
+{
+public:
+    CyclicTx();
+    int addEntry(int whichBus, CAN_FRAME &frame, uint16_t period);
+    bool removeEntry(int entry);
+    bool setEnabled(int entry, bool enabled);
+    void clear();
+    bool getEntry(int entry, CYCLIC_ENTRY &copy, bool reset = false);
+    bool resetStats(int entry);
+    int getEntryCount() { return entryCount; }
+
+private:
+    CYCLIC_ENTRY *entries;
+    int16_t wheel[CYCLIC_WHEEL_SLOTS];
+    int entryCount;
+    uint32_t currentTick;   //last tick that has been run
+    uint64_t startTime;     //esp_timer time of tick 0
+    SemaphoreHandle_t lock; //table and wheel, held by the task while it runs ticks
+    TaskHandle_t task;
+    esp_timer_handle_t timer;
+    bool timerRunning;
+
+    bool begin();
+    void link(int entry);
+    void unlink(int entry);
+    void clearStats(CYCLIC_ENTRY *e);
+    void startTimer();
+    void stopTimer();
+    void runTick(uint32_t tick);
+    void fire(CYCLIC_ENTRY *entry, uint32_t tick);
+    static void timerCallback(void *param);
+    static void taskLoop(void *param);
+};
@@ -0,0 +1,247 @@
+#include "frame_bits.h"
+
+//ACK slot, the three delimiters, EOF and intermission. Never stuffed.
+#define FRAME_TAIL_BITS     13
+
+uint16_t FrameBits::crc15Table[256];
+uint8_t FrameBits::stuffTable[10][256];
+bool FrameBits::tablesBuilt = false;
+
+//Stuffing state is the level of the last bit sent and how many bits in a row have had that level.
+//state = level * 5 + (run - 1). Each stuffTable entry is (stuff bits << 4) | next state.
+#define STUFF_STATE(level, run) (((level) * 5) + ((run) - 1))
+#define STUFF_IDLE              STUFF_STATE(1, 1) //bus is recessive before SOF
+
+//Frame bits are packed MSB first so the tables can eat them a byte at a time
+typedef struct {
+    uint8_t bytes[72];
+    uint32_t length;
+} BIT_STREAM;
+
+static void putBits(BIT_STREAM &stream, uint32_t value, int count)
+{
+    for (int i = count - 1; i >= 0; i--)
+    {
+        uint32_t byteIdx = stream.length >> 3;
+        uint8_t mask = 0x80 >> (stream.length & 7);
+        if (value & (1ul << i)) stream.bytes[byteIdx] |= mask;
+        else stream.bytes[byteIdx] &= ~mask;
+        stream.length++;
+    }
+}
+
+static inline int getBit(BIT_STREAM &stream, uint32_t pos)
+{
+    return (stream.bytes[pos >> 3] >> (7 - (pos & 7))) & 1;
+}
+
+//Step the stuffing state by one bit. Returns 1 if a stuff bit has to follow it.
+static inline int stuffBit(int &state, int bit)
+{
+    int level = state / 5;
+    int run = (state % 5) + 1;
+    int stuffed = 0;
+    if (bit == level) run++;
+    else
+    {
+        level = bit;
+        run = 1;
+    }
+    if (run == 5)
+    {
+        stuffed = 1;
+        level = !level;
+        run = 1;
+    }
+    state = STUFF_STATE(level, run);
+    return stuffed;
+}
+
+static void putData(BIT_STREAM &stream, uint8_t *data, int length)
+{
+    for (int i = 0; i < length; i++) putBits(stream, data[i], 8);
+}
+
+void FrameBits::init()
+{
+    if (tablesBuilt) return;
+
+    for (int i = 0; i < 256; i++)
+    {
+        uint16_t crc = i << 7;
+        for (int b = 0; b < 8; b++)
+        {
+            if (crc & 0x4000) crc = (crc << 1) ^ 0x4599;
+            else crc <<= 1;
+        }
+        crc15Table[i] = crc & 0x7FFF;
+    }
+
+    for (int state = 0; state < 10; state++)
+    {
+        for (int byt = 0; byt < 256; byt++)
+        {
+            int next = state;
+            int stuffed = 0;
+            for (int b = 7; b >= 0; b--) stuffed += stuffBit(next, (byt >> b) & 1);
+            stuffTable[state][byt] = (stuffed << 4) | next;
+        }
+    }
+    tablesBuilt = true;
+}
+
+//CRC15 over the first length bits of the stream
+static uint16_t calcCRC15(BIT_STREAM &stream, uint32_t length, uint16_t *table)
+{
+    uint16_t crc = 0;
+    uint32_t pos = 0;
+    for (; pos + 8 <= length; pos += 8)
+    {
+        crc = ((crc << 8) ^ table[((crc >> 7) ^ stream.bytes[pos >> 3]) & 0xFF]) & 0x7FFF;
+    }
+    for (; pos < length; pos++)
+    {
+        int next = getBit(stream, pos) ^ ((crc >> 14) & 1);
+        crc = (crc << 1) & 0x7FFF;
+        if (next) crc ^= 0x4599;
+    }
+    return crc;
+}
+
+//Count the stuff bits needed for bits [start, end) of the stream, carrying the stuffing state along.
+//Bit at a time up to a byte boundary, whole bytes through the table, then whatever is left over.
+static uint32_t countStuffBits(BIT_STREAM &stream, uint32_t start, uint32_t end, int &state, uint8_t (*table)[256])
+{
+    uint32_t stuffed = 0;
+    uint32_t pos = start;
+
+    for (; pos < end && (pos & 7); pos++) stuffed += stuffBit(state, getBit(stream, pos));
+    for (; pos + 8 <= end; pos += 8)
+    {
+        uint8_t entry = table[state][stream.bytes[pos >> 3]];
+        stuffed += entry >> 4;
+        state = entry & 0x0F;
+    }
+    for (; pos < end; pos++) stuffed += stuffBit(state, getBit(stream, pos));
+    return stuffed;
+}
+
+uint32_t FrameBits::classicBits(CAN_FRAME &frame)
+{
+    BIT_STREAM stream;
+    int length = frame.length;
+    if (length > 8) length = 8;
+    int dataBytes = frame.rtr ? 0 : length;
+
+    init();
+    stream.length = 0;
+    putBits(stream, 0, 1); //SOF
+    if (frame.extended)
+    {
+        putBits(stream, frame.id >> 18, 11);
+        putBits(stream, 1, 1); //SRR
+        putBits(stream, 1, 1); //IDE
+        putBits(stream, frame.id & 0x3FFFF, 18);
+        putBits(stream, frame.rtr ? 1 : 0, 1);
+        putBits(stream, 0, 2); //r1, r0
+    }
+    else
+    {
+        putBits(stream, frame.id & 0x7FF, 11);
+        putBits(stream, frame.rtr ? 1 : 0, 1);
+        putBits(stream, 0, 2); //IDE, r0
+    }
+    putBits(stream, length, 4);
+    putData(stream, frame.data.uint8, dataBytes);
+    putBits(stream, calcCRC15(stream, stream.length, crc15Table), 15);
+
+    int state = STUFF_IDLE;
+    uint32_t stuffed = countStuffBits(stream, 0, stream.length, state, stuffTable);
+    return stream.length + stuffed + FRAME_TAIL_BITS;
+}
+
+//Returns the bits sent at the nominal rate. The bits sent at the data rate come back in dataPhaseBits
+//and are 0 unless the frame switches bitrate.
+uint32_t FrameBits::fdBits(CAN_FRAME_FD &frame, uint32_t &dataPhaseBits)
+{
+    BIT_STREAM stream;
+    uint32_t arbitrationEnd;
+    dataPhaseBits = 0;
+
+    if (!frame.fdMode)
+    {
+        //a classic frame that went through the FD interface
+        CAN_FRAME classic;
+        classic.id = frame.id;
+        classic.extended = frame.extended;
+        classic.rtr = frame.rrs;
+        classic.length = (frame.length > 8) ? 8 : frame.length;
+        memcpy(classic.data.uint8, frame.data.uint8, classic.length);
+        return classicBits(classic);
+    }
+
+    uint8_t dlc = fdLengthToDLC(frame.length);
+    int dataBytes = fdDLCToLength(dlc);
+
+    init();
+    stream.length = 0;
+    putBits(stream, 0, 1); //SOF
+    if (frame.extended)
+    {
+        putBits(stream, frame.id >> 18, 11);
+        putBits(stream, 1, 1); //SRR
+        putBits(stream, 1, 1); //IDE
+        putBits(stream, frame.id & 0x3FFFF, 18);
+        putBits(stream, 0, 1); //RRS
+    }
+    else
+    {
+        putBits(stream, frame.id & 0x7FF, 11);
+        putBits(stream, 0, 1); //RRS
+        putBits(stream, 0, 1); //IDE
+    }
+    putBits(stream, 1, 1); //FDF
+    putBits(stream, 0, 1); //res
+    putBits(stream, 1, 1); //BRS
+    arbitrationEnd = stream.length;
+    putBits(stream, 0, 1); //ESI
+    putBits(stream, dlc, 4);
+    //unused bytes of a padded length go out as zero
+    for (int i = 0; i < dataBytes; i++) putBits(stream, (i < frame.length) ? frame.data.uint8[i] : 0, 8);
+
+    int state = STUFF_IDLE;
+    uint32_t nominal = arbitrationEnd + countStuffBits(stream, 0, arbitrationEnd, state, stuffTable);
+    uint32_t data = (stream.length - arbitrationEnd) + countStuffBits(stream, arbitrationEnd, stream.length, state, stuffTable);
+
+    //stuff count, CRC and their fixed stuff bits. 17 bit CRC with 6 fixed stuff bits up to 16 bytes, 21 bit CRC with 7 above
+    data += 4 + ((dataBytes > 16) ? (21 + 7) : (17 + 6));
+    dataPhaseBits = data;
+    return nominal + FRAME_TAIL_BITS;
+}
+
+uint8_t FrameBits::fdLengthToDLC(uint8_t length)
+{
+    if (length <= 8) return length;
+    if (length <= 12) return 9;
+    if (length <= 16) return 10;
+    if (length <= 20) return 11;
+    if (length <= 24) return 12;
+    if (length <= 32) return 13;
+    if (length <= 48) return 14;
+    return 15;
+}
+
+uint8_t FrameBits::fdDLCToLength(uint8_t dlc)
+{
+    static const uint8_t lengths[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+    return lengths[dlc & 0x0F];
+}
+
+//Time on the bus in nominal bit times, so the data phase bits only weigh in at their share of that
+uint32_t FrameBits::fdLoadBits(CAN_FRAME_FD &frame, uint32_t nomSpeed, uint32_t fdSpeed)
+{
+    uint32_t dataBits;
+    uint32_t nominalBits = fdBits(frame, dataBits);
+    if (dataBits && fdSpeed > nomSpeed) dataBits = ((uint64_t)dataBits * nomSpeed) / fdSpeed;
+    return nominalBits + dataBits;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <Arduino.h>
+#include "esp32_can.h"
+
+/*
+Exact on the wire length of a frame, stuff bits included. The frame is laid out bit by bit exactly as
+the controller would send it, the CRC is calculated over that and then the stuff bits are counted.
+Both the CRC and the stuffing are done a byte at a time out of tables so this is cheap enough to run
+on every frame.
+
+CAN FD frames come back split into the bits sent at the nominal rate and the bits sent at the data rate.
+The CRC field of an FD frame uses fixed stuff bits so its length does not depend on the CRC value.
+*/
+class FrameBits
+{
+public:
+    static void init();
+    static uint32_t classicBits(CAN_FRAME &frame);
+    static uint32_t fdBits(CAN_FRAME_FD &frame, uint32_t &dataPhaseBits);
+    static uint32_t fdLoadBits(CAN_FRAME_FD &frame, uint32_t nomSpeed, uint32_t fdSpeed);
+    static uint8_t fdLengthToDLC(uint8_t length);
+    static uint8_t fdDLCToLength(uint8_t dlc);
+
+private:
+    static uint16_t crc15Table[256];
+    static uint8_t stuffTable[10][256];
+    static bool tablesBuilt;
+};
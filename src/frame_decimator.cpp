@@ -0,0 +1,150 @@
+#include "frame_decimator.h"
+
+FrameDecimator::FrameDecimator()
+{
+    memset(buses, 0, sizeof(buses));
+    for (int i = 0; i < NUM_BUSES; i++)
+    {
+        active[i] = false;
+        generation[i] = 1; //new table entries start at 0 so they always resolve their rule first
+        thinned[i] = 0;
+    }
+}
+
+void FrameDecimator::loadSettings()
+{
+    char buff[16];
+    nvPrefs.begin(PREF_NAME, true);
+    for (int i = 0; i < NUM_BUSES; i++)
+    {
+        sprintf(buff, "decimate%i", i);
+        if (nvPrefs.getBytesLength(buff) != sizeof(DECIMATE_BUS)) continue;
+        nvPrefs.getBytes(buff, &buses[i], sizeof(DECIMATE_BUS));
+        rulesChanged(i);
+    }
+    nvPrefs.end();
+}
+
+void FrameDecimator::saveSettings(int whichBus)
+{
+    char buff[16];
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return;
+    sprintf(buff, "decimate%i", whichBus);
+    nvPrefs.begin(PREF_NAME, false);
+    nvPrefs.putBytes(buff, &buses[whichBus], sizeof(DECIMATE_BUS));
+    nvPrefs.end();
+}
+
+void FrameDecimator::rulesChanged(int whichBus)
+{
+    DECIMATE_BUS &b = buses[whichBus];
+    active[whichBus] = (b.busDefault.type != DECIMATE_NONE) || (b.ruleCount > 0);
+    generation[whichBus]++;
+    if (generation[whichBus] == 0) generation[whichBus] = 1;
+}
+
+void FrameDecimator::resolveRule(int whichBus, ID_ENTRY *entry)
+{
+    DECIMATE_BUS &b = buses[whichBus];
+    DECIMATE_RULE *rule = &b.busDefault;
+    for (int i = 0; i < b.ruleCount; i++)
+    {
+        if (b.rules[i].key == entry->key)
+        {
+            rule = &b.rules[i];
+            break;
+        }
+    }
+    entry->decimateType = rule->type;
+    entry->decimateValue = rule->value;
+    entry->skipCount = 0;
+    entry->ruleGeneration = generation[whichBus];
+}
+
+/*
+DECIMATE_RATE lets a frame through once nextDue has come around and then moves nextDue on by one interval,
+so a frame that arrives a little early because of jitter doesn't cost a whole period. If the ID went quiet
+for a while it starts over from now instead of letting a burst through to catch up.
+*/
+bool FrameDecimator::passes(int whichBus, ID_ENTRY *entry, uint32_t timestamp)
+{
+    if (entry->ruleGeneration != generation[whichBus]) resolveRule(whichBus, entry);
+
+    switch (entry->decimateType)
+    {
+    case DECIMATE_RATE:
+    {
+        if (entry->decimateValue == 0) break;
+        uint32_t interval = 1000000ul / entry->decimateValue;
+        if (entry->nextDue != 0 && (int32_t)(timestamp - entry->nextDue) < 0) break;
+        if (entry->nextDue == 0 || (timestamp - entry->nextDue) >= interval) entry->nextDue = timestamp + interval;
+        else entry->nextDue += interval;
+        if (entry->nextDue == 0) entry->nextDue = 1;
+        return true;
+    }
+    case DECIMATE_NTH:
+        if (entry->decimateValue <= 1) return true;
+        if (entry->skipCount == 0)
+        {
+            entry->skipCount = entry->decimateValue - 1;
+            return true;
+        }
+        entry->skipCount--;
+        break;
+    default:
+        return true;
+    }
+
+    entry->thinned++;
+    thinned[whichBus]++;
+    return false;
+}
+
+void FrameDecimator::setDefault(int whichBus, DECIMATE_TYPE type, uint16_t value)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return;
+    buses[whichBus].busDefault.type = type;
+    buses[whichBus].busDefault.value = value;
+    rulesChanged(whichBus);
+}
+
+//A type of DECIMATE_NONE removes the rule for that ID so it falls back to the bus default
+bool FrameDecimator::setRule(int whichBus, uint32_t key, DECIMATE_TYPE type, uint16_t value)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return false;
+    DECIMATE_BUS &b = buses[whichBus];
+    int idx;
+    for (idx = 0; idx < b.ruleCount; idx++) if (b.rules[idx].key == key) break;
+
+    if (type == DECIMATE_NONE)
+    {
+        if (idx == b.ruleCount) return false;
+        b.rules[idx] = b.rules[--b.ruleCount];
+    }
+    else
+    {
+        if (idx == b.ruleCount)
+        {
+            if (b.ruleCount >= DECIMATE_MAX_RULES) return false;
+            b.ruleCount++;
+        }
+        b.rules[idx].key = key;
+        b.rules[idx].type = type;
+        b.rules[idx].value = value;
+    }
+    rulesChanged(whichBus);
+    return true;
+}
+
+void FrameDecimator::clearRules(int whichBus)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return;
+    memset(&buses[whichBus], 0, sizeof(DECIMATE_BUS));
+    rulesChanged(whichBus);
+}
+
+DECIMATE_BUS *FrameDecimator::getRules(int whichBus)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return nullptr;
+    return &buses[whichBus];
+}
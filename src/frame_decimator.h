@@ -0,0 +1,54 @@
+#pragma once
+#include <Arduino.h>
+#include "config.h"
+#include "id_table.h"
+
+enum DECIMATE_TYPE
+{
+    DECIMATE_NONE = 0,
+    DECIMATE_RATE = 1,  //value = most frames per second that get through
+    DECIMATE_NTH = 2    //value = K, every Kth frame gets through
+};
+
+#define DECIMATE_MAX_RULES  16
+
+typedef struct {
+    uint32_t key;   //IDTable key of the ID this applies to
+    uint8_t type;
+    uint16_t value;
+} DECIMATE_RULE;
+
+typedef struct {
+    DECIMATE_RULE busDefault;   //key unused. Applies to every ID without its own rule
+    uint8_t ruleCount;
+    DECIMATE_RULE rules[DECIMATE_MAX_RULES];
+} DECIMATE_BUS;
+
+/*
+Thins out chatty IDs before they are encoded so they can't use up the output bandwidth every other ID needs.
+The rule for an ID is looked up once and cached in its IDTable entry. Changing any rule on a bus bumps
+that bus' generation so entries pick up the new rule the next time their ID shows up.
+*/
+class FrameDecimator
+{
+public:
+    FrameDecimator();
+    void loadSettings();
+    void saveSettings(int whichBus);
+    bool isActive(int whichBus) { return active[whichBus]; }
+    bool passes(int whichBus, ID_ENTRY *entry, uint32_t timestamp);
+    void setDefault(int whichBus, DECIMATE_TYPE type, uint16_t value);
+    bool setRule(int whichBus, uint32_t key, DECIMATE_TYPE type, uint16_t value);
+    void clearRules(int whichBus);
+    DECIMATE_BUS *getRules(int whichBus);
+    uint32_t getThinned(int whichBus) { return thinned[whichBus]; }
+
+private:
+    DECIMATE_BUS buses[NUM_BUSES];
+    bool active[NUM_BUSES];
+    uint8_t generation[NUM_BUSES];
+    uint32_t thinned[NUM_BUSES];
+
+    void rulesChanged(int whichBus);
+    void resolveRule(int whichBus, ID_ENTRY *entry);
+};
@@ -0,0 +1,319 @@
+#include "frame_filter.h"
+
+FrameFilter::FrameFilter()
+{
+    for (int i = 0; i < NUM_BUSES; i++)
+    {
+        clear(i);
+        buses[i].mode = FILTER_OFF;
+    }
+}
+
+//Filters are stored one blob per bus. Blobs saved before the mask slots were added are everything up to
+//maskSlots, those load with no slots recorded and their tombstones cleared out. Any other size is ignored.
+void FrameFilter::loadSettings()
+{
+    char buff[16];
+    nvPrefs.begin(PREF_NAME, true);
+    for (int i = 0; i < NUM_BUSES; i++)
+    {
+        sprintf(buff, "filter%i", i);
+        size_t length = nvPrefs.getBytesLength(buff);
+        if (length != sizeof(FILTER_BUS) && length != FILTER_BUS_V1_SIZE) continue;
+        nvPrefs.getBytes(buff, &buses[i], length);
+        if (length == FILTER_BUS_V1_SIZE) memset(buses[i].maskSlots, 0, sizeof(buses[i].maskSlots));
+        rebuildExt(buses[i]);
+    }
+    nvPrefs.end();
+}
+
+void FrameFilter::saveSettings(int whichBus)
+{
+    char buff[16];
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return;
+    sprintf(buff, "filter%i", whichBus);
+    nvPrefs.begin(PREF_NAME, false);
+    nvPrefs.putBytes(buff, &buses[whichBus], sizeof(FILTER_BUS));
+    nvPrefs.end();
+}
+
+void FrameFilter::setMode(int whichBus, FILTER_MODE mode)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return;
+    buses[whichBus].mode = mode;
+}
+
+FILTER_MODE FrameFilter::getMode(int whichBus)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return FILTER_OFF;
+    return (FILTER_MODE)buses[whichBus].mode;
+}
+
+//Empty the list. The mode is left alone.
+void FrameFilter::clear(int whichBus)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return;
+    FILTER_BUS &f = buses[whichBus];
+    memset(f.stdBitmap, 0, sizeof(f.stdBitmap));
+    for (int i = 0; i < FILTER_EXT_SLOTS; i++) f.extSlots[i] = FILTER_SLOT_EMPTY;
+    f.extCount = 0;
+    f.rangeCount = 0;
+    memset(f.maskSlots, 0, sizeof(f.maskSlots));
+    rejected[whichBus] = 0;
+}
+
+//Hash every extended ID in again, dropping tombstones left by older builds
+void FrameFilter::rebuildExt(FILTER_BUS &f)
+{
+    uint32_t ids[FILTER_EXT_SLOTS];
+    int count = 0;
+    for (int i = 0; i < FILTER_EXT_SLOTS; i++)
+    {
+        uint32_t val = f.extSlots[i];
+        if (val != FILTER_SLOT_EMPTY && val != FILTER_SLOT_DELETED) ids[count++] = val;
+        f.extSlots[i] = FILTER_SLOT_EMPTY;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t slot = hashSlot(ids[i]) & (FILTER_EXT_SLOTS - 1);
+        while (f.extSlots[slot] != FILTER_SLOT_EMPTY) slot = (slot + 1) & (FILTER_EXT_SLOTS - 1);
+        f.extSlots[slot] = ids[i];
+    }
+    f.extCount = count;
+}
+
+//Fibonacci hashing. IDs in a system tend to share their high bits so those get mixed into the low ones.
+uint32_t FrameFilter::hashSlot(uint32_t id)
+{
+    return (id * 2654435761ul) >> 24;
+}
+
+int FrameFilter::findExt(FILTER_BUS &f, uint32_t id)
+{
+    uint32_t slot = hashSlot(id) & (FILTER_EXT_SLOTS - 1);
+    for (int i = 0; i < FILTER_EXT_SLOTS; i++)
+    {
+        uint32_t val = f.extSlots[slot];
+        if (val == id) return slot;
+        if (val == FILTER_SLOT_EMPTY) return -1;
+        slot = (slot + 1) & (FILTER_EXT_SLOTS - 1);
+    }
+    return -1;
+}
+
+bool FrameFilter::isExtListed(FILTER_BUS &f, uint32_t id)
+{
+    if (f.extCount && findExt(f, id) >= 0) return true;
+    for (int i = 0; i < f.rangeCount; i++)
+    {
+        if (id >= f.ranges[i].low && id <= f.ranges[i].high) return true;
+    }
+    return false;
+}
+
+bool FrameFilter::addID(int whichBus, uint32_t id, bool extended)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return false;
+    FILTER_BUS &f = buses[whichBus];
+    if (!extended)
+    {
+        id &= 0x7FF;
+        f.stdBitmap[id >> 5] |= (1ul << (id & 31));
+        return true;
+    }
+
+    id &= 0x1FFFFFFF;
+    if (findExt(f, id) >= 0) return true;
+    if (f.extCount >= FILTER_EXT_MAX) return false;
+    uint32_t slot = hashSlot(id) & (FILTER_EXT_SLOTS - 1);
+    while (f.extSlots[slot] != FILTER_SLOT_EMPTY)
+    {
+        slot = (slot + 1) & (FILTER_EXT_SLOTS - 1);
+    }
+    f.extSlots[slot] = id;
+    f.extCount++;
+    return true;
+}
+
+//Only removes single IDs. An ID inside a range stays listed.
+bool FrameFilter::removeID(int whichBus, uint32_t id, bool extended)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return false;
+    FILTER_BUS &f = buses[whichBus];
+    if (!extended)
+    {
+        id &= 0x7FF;
+        f.stdBitmap[id >> 5] &= ~(1ul << (id & 31));
+        return true;
+    }
+
+    int found = findExt(f, id & 0x1FFFFFFF);
+    if (found < 0) return false;
+    //backward shift delete. Entries further along the probe chain that could live in the hole move up into
+    //it so the chain never has a gap and no tombstones are needed
+    uint32_t hole = found;
+    uint32_t next = (hole + 1) & (FILTER_EXT_SLOTS - 1);
+    while (f.extSlots[next] != FILTER_SLOT_EMPTY)
+    {
+        uint32_t home = hashSlot(f.extSlots[next]) & (FILTER_EXT_SLOTS - 1);
+        if (((next - home) & (FILTER_EXT_SLOTS - 1)) >= ((next - hole) & (FILTER_EXT_SLOTS - 1)))
+        {
+            f.extSlots[hole] = f.extSlots[next];
+            hole = next;
+        }
+        next = (next + 1) & (FILTER_EXT_SLOTS - 1);
+    }
+    f.extSlots[hole] = FILTER_SLOT_EMPTY;
+    f.extCount--;
+    return true;
+}
+
+//Standard ID ranges just go into the bitmap. Extended ranges are kept as ranges.
+bool FrameFilter::addRange(int whichBus, uint32_t low, uint32_t high, bool extended)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return false;
+    if (low > high) return false;
+    FILTER_BUS &f = buses[whichBus];
+    if (!extended)
+    {
+        if (high > 0x7FF) high = 0x7FF;
+        for (uint32_t id = low; id <= high; id++) f.stdBitmap[id >> 5] |= (1ul << (id & 31));
+        return true;
+    }
+
+    if (f.rangeCount >= FILTER_EXT_RANGES) return false;
+    f.ranges[f.rangeCount].low = low & 0x1FFFFFFF;
+    f.ranges[f.rangeCount].high = high & 0x1FFFFFFF;
+    f.rangeCount++;
+    return true;
+}
+
+/*
+Hardware style ID/mask pair, a 1 bit in the mask means that bit has to match. For standard IDs every match
+goes straight into the bitmap. An extended mask whose don't care bits are all at the bottom becomes a range,
+otherwise it is expanded into single IDs as long as that comes to no more than 64 of them.
+*/
+bool FrameFilter::addMask(int whichBus, uint32_t id, uint32_t mask, bool extended)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return false;
+    FILTER_BUS &f = buses[whichBus];
+    if (!extended)
+    {
+        mask &= 0x7FF;
+        id &= mask;
+        for (uint32_t i = 0; i < 2048; i++)
+        {
+            if ((i & mask) == id) f.stdBitmap[i >> 5] |= (1ul << (i & 31));
+        }
+        return true;
+    }
+
+    mask &= 0x1FFFFFFF;
+    id &= mask;
+    uint32_t dontCare = ~mask & 0x1FFFFFFF;
+    if ((dontCare & (dontCare + 1)) == 0) return addRange(whichBus, id, id | dontCare, true);
+    if (__builtin_popcount(dontCare) > 6) return false;
+    //walk every combination of the don't care bits
+    uint32_t sub = 0;
+    do {
+        if (!addID(whichBus, id | sub, true)) return false;
+        sub = (sub - dontCare) & dontCare;
+    } while (sub != 0);
+    return true;
+}
+
+//Takes out what addMask() with the same values put in. IDs something else also listed go too
+void FrameFilter::removeMask(int whichBus, uint32_t id, uint32_t mask, bool extended)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return;
+    FILTER_BUS &f = buses[whichBus];
+    if (!extended)
+    {
+        mask &= 0x7FF;
+        id &= mask;
+        for (uint32_t i = 0; i < 2048; i++)
+        {
+            if ((i & mask) == id) f.stdBitmap[i >> 5] &= ~(1ul << (i & 31));
+        }
+        return;
+    }
+
+    mask &= 0x1FFFFFFF;
+    id &= mask;
+    uint32_t dontCare = ~mask & 0x1FFFFFFF;
+    if ((dontCare & (dontCare + 1)) == 0)
+    {
+        for (int i = 0; i < f.rangeCount; i++)
+        {
+            if (f.ranges[i].low != id || f.ranges[i].high != (id | dontCare)) continue;
+            f.ranges[i] = f.ranges[--f.rangeCount];
+            break;
+        }
+        return;
+    }
+    if (__builtin_popcount(dontCare) > 6) return;
+    uint32_t sub = 0;
+    do {
+        removeID(whichBus, id | sub, true);
+        sub = (sub - dontCare) & dontCare;
+    } while (sub != 0);
+}
+
+/*
+CANxFILTERy. Whatever the slot put in before comes back out, then the other enabled slots go in again in case
+they overlapped it, then the new one if it is enabled. Enabling one switches the bus over to only passing listed IDs.
+*/
+bool FrameFilter::setMaskSlot(int whichBus, int slot, uint32_t id, uint32_t mask, bool extended, bool enabled)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES || slot < 0 || slot >= FILTER_MASK_SLOTS) return false;
+    FILTER_BUS &f = buses[whichBus];
+    FILTER_MASK_SLOT *old = &f.maskSlots[slot];
+    if (old->enabled)
+    {
+        removeMask(whichBus, old->id, old->mask, old->extended);
+        old->enabled = 0;
+        for (int i = 0; i < FILTER_MASK_SLOTS; i++)
+        {
+            FILTER_MASK_SLOT *other = &f.maskSlots[i];
+            if (other->enabled) addMask(whichBus, other->id, other->mask, other->extended);
+        }
+    }
+    if (!enabled) return true;
+    if (!addMask(whichBus, id, mask, extended))
+    {
+        removeMask(whichBus, id, mask, extended);
+        return false;
+    }
+    old->id = id;
+    old->mask = mask;
+    old->extended = extended;
+    old->enabled = 1;
+    if (f.mode == FILTER_OFF) f.mode = FILTER_ACCEPT;
+    return true;
+}
+
+uint16_t FrameFilter::getStdCount(int whichBus)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return 0;
+    uint16_t count = 0;
+    for (int i = 0; i < 2048 / 32; i++) count += __builtin_popcount(buses[whichBus].stdBitmap[i]);
+    return count;
+}
+
+uint16_t FrameFilter::getExtCount(int whichBus)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return 0;
+    return buses[whichBus].extCount;
+}
+
+uint8_t FrameFilter::getRangeCount(int whichBus)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return 0;
+    return buses[whichBus].rangeCount;
+}
+
+uint32_t FrameFilter::getRejected(int whichBus)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return 0;
+    return rejected[whichBus];
+}
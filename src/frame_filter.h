@@ -0,0 +1,91 @@
+#pragma once
+#include <Arduino.h>
+#include "config.h"
+
+//What happens to frames whose ID is in a bus' list
+enum FILTER_MODE
+{
+    FILTER_OFF = 0,     //everything passes, the list is kept but ignored
+    FILTER_ACCEPT = 1,  //only listed IDs pass
+    FILTER_REJECT = 2   //everything but the listed IDs passes
+};
+
+#define FILTER_EXT_SLOTS    256 //hash slots for 29 bit IDs, must be a power of two
+#define FILTER_EXT_MAX      192 //keep the hash at most 3/4 full so probes stay short
+#define FILTER_EXT_RANGES   8
+#define FILTER_SLOT_EMPTY   0xFFFFFFFFul
+#define FILTER_SLOT_DELETED 0xFFFFFFFEul    //only found in lists saved by older builds, cleared out on load
+#define FILTER_MASK_SLOTS   8               //CANxFILTERy from the console
+
+typedef struct {
+    uint32_t low;
+    uint32_t high;
+} FILTER_RANGE;
+
+//What one CANxFILTERy slot put in the list, so setting it again or turning it off can take it back out
+typedef struct {
+    uint32_t id;
+    uint32_t mask;
+    uint8_t extended;
+    uint8_t enabled;
+} FILTER_MASK_SLOT;
+
+typedef struct {
+    uint8_t mode;
+    uint32_t stdBitmap[2048 / 32];          //one bit per 11 bit ID
+    uint32_t extSlots[FILTER_EXT_SLOTS];    //open addressing, linear probing
+    uint16_t extCount;
+    uint8_t rangeCount;
+    FILTER_RANGE ranges[FILTER_EXT_RANGES]; //29 bit ID ranges, inclusive
+    FILTER_MASK_SLOT maskSlots[FILTER_MASK_SLOTS];
+} FILTER_BUS;
+
+//Saved size of a FILTER_BUS from builds before maskSlots, which is where that layout ended
+#define FILTER_BUS_V1_SIZE  offsetof(FILTER_BUS, maskSlots)
+
+/*
+Software acceptance filter that runs on every received frame before it is encoded for any output.
+Looking up a standard ID is one bit test, an extended ID is a short hash probe plus a few range compares,
+so the cost is the same whether the list holds 3 IDs or 300.
+*/
+class FrameFilter
+{
+public:
+    FrameFilter();
+    void loadSettings();
+    void saveSettings(int whichBus);
+    void setMode(int whichBus, FILTER_MODE mode);
+    FILTER_MODE getMode(int whichBus);
+    void clear(int whichBus);
+    bool addID(int whichBus, uint32_t id, bool extended);
+    bool removeID(int whichBus, uint32_t id, bool extended);
+    bool addRange(int whichBus, uint32_t low, uint32_t high, bool extended);
+    bool addMask(int whichBus, uint32_t id, uint32_t mask, bool extended);
+    void removeMask(int whichBus, uint32_t id, uint32_t mask, bool extended);
+    bool setMaskSlot(int whichBus, int slot, uint32_t id, uint32_t mask, bool extended, bool enabled);
+    uint16_t getStdCount(int whichBus);
+    uint16_t getExtCount(int whichBus);
+    uint8_t getRangeCount(int whichBus);
+    uint32_t getRejected(int whichBus);
+
+    inline bool accepts(int whichBus, uint32_t id, bool extended)
+    {
+        FILTER_BUS &f = buses[whichBus];
+        if (f.mode == FILTER_OFF) return true;
+        bool listed;
+        if (extended) listed = isExtListed(f, id);
+        else listed = (f.stdBitmap[(id & 0x7FF) >> 5] >> (id & 31)) & 1;
+        if (listed == (f.mode == FILTER_ACCEPT)) return true;
+        rejected[whichBus]++;
+        return false;
+    }
+
+private:
+    FILTER_BUS buses[NUM_BUSES];
+    uint32_t rejected[NUM_BUSES];
+
+    static uint32_t hashSlot(uint32_t id);
+    bool isExtListed(FILTER_BUS &f, uint32_t id);
+    int findExt(FILTER_BUS &f, uint32_t id);
+    void rebuildExt(FILTER_BUS &f);
+};
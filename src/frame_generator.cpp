@@ -0,0 +1,193 @@
+#include "frame_generator.h"
+#include "id_table.h"
+#include "utility.h"
+#include <math.h>
+
+FrameGenerator::FrameGenerator()
+{
+    memset(rules, 0, sizeof(rules));
+    ruleCount = 0;
+    lock = nullptr;
+}
+
+//Returns the rule number or -1 if the rule makes no sense or the table is full
+int FrameGenerator::addRule(int whichBus, uint32_t id, bool extended, GEN_TYPE type, uint16_t startBit, uint8_t width,
+                            int32_t a, int32_t b, uint16_t period)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return -1;
+    if (type == GEN_NONE || type > GEN_CRC8) return -1;
+    if (width == 0 || width > 32 || (startBit + width) > 512) return -1;
+    if ((type == GEN_RAMP || type == GEN_SINE) && period == 0) return -1;
+    if (!lock) lock = xSemaphoreCreateMutex();
+    if (!lock) return -1;
+
+    int found = -1;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int i = 0; i < GEN_MAX_RULES; i++)
+    {
+        if (rules[i].type != GEN_NONE) continue;
+        GEN_RULE *rule = &rules[i];
+        rule->key = IDTable::makeKey(id, extended);
+        rule->bus = whichBus;
+        rule->startBit = startBit;
+        rule->width = width;
+        rule->a = a;
+        rule->b = b;
+        rule->period = period;
+        rule->count = 0;
+        rule->type = type;
+        ruleCount++;
+        found = i;
+        break;
+    }
+    xSemaphoreGive(lock);
+    return found;
+}
+
+bool FrameGenerator::removeRule(int rule)
+{
+    if (rule < 0 || rule >= GEN_MAX_RULES || rules[rule].type == GEN_NONE) return false;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    rules[rule].type = GEN_NONE;
+    ruleCount--;
+    xSemaphoreGive(lock);
+    return true;
+}
+
+void FrameGenerator::clear()
+{
+    if (!lock) return;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int i = 0; i < GEN_MAX_RULES; i++) rules[i].type = GEN_NONE;
+    ruleCount = 0;
+    xSemaphoreGive(lock);
+}
+
+bool FrameGenerator::getRule(int rule, GEN_RULE &copy)
+{
+    if (rule < 0 || rule >= GEN_MAX_RULES || rules[rule].type == GEN_NONE) return false;
+    copy = rules[rule];
+    return true;
+}
+
+void FrameGenerator::apply(int whichBus, CAN_FRAME &frame)
+{
+    if (!ruleCount || frame.rtr) return;
+    applyRules(whichBus, IDTable::makeKey(frame.id, frame.extended), frame.data.uint8, frame.length);
+}
+
+void FrameGenerator::apply(int whichBus, CAN_FRAME_FD &frame)
+{
+    if (!ruleCount) return;
+    applyRules(whichBus, IDTable::makeKey(frame.id, frame.extended), frame.data.uint8, frame.length);
+}
+
+void FrameGenerator::advance(int whichBus, CAN_FRAME &frame)
+{
+    if (!ruleCount || frame.rtr) return;
+    advanceRules(whichBus, IDTable::makeKey(frame.id, frame.extended), frame.length);
+}
+
+void FrameGenerator::advance(int whichBus, CAN_FRAME_FD &frame)
+{
+    if (!ruleCount) return;
+    advanceRules(whichBus, IDTable::makeKey(frame.id, frame.extended), frame.length);
+}
+
+//Counters on the frame just sent step then wrap, done in 64 bits so a 32 bit field can't overflow past the top unnoticed
+void FrameGenerator::advanceRules(int whichBus, uint32_t key, uint8_t length)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int i = 0; i < GEN_MAX_RULES; i++)
+    {
+        GEN_RULE *rule = &rules[i];
+        if (rule->type != GEN_COUNTER || rule->key != key || rule->bus != whichBus) continue;
+        if ((rule->startBit + rule->width) > (length * 8)) continue;
+        uint32_t fieldMax = (rule->width == 32) ? 0xFFFFFFFF : ((1ul << rule->width) - 1);
+        uint32_t top = rule->b ? ((uint32_t)rule->b & fieldMax) : fieldMax;
+        uint32_t step = rule->a ? (uint32_t)rule->a : 1;
+        uint64_t next = (uint64_t)rule->count + step;
+        rule->count = (next > top) ? 0 : (uint32_t)next;
+    }
+    xSemaphoreGive(lock);
+}
+
+//Two passes over the rules, everything but checksums then the checksums
+void FrameGenerator::applyRules(int whichBus, uint32_t key, uint8_t *data, uint8_t length)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int i = 0; i < GEN_MAX_RULES; i++)
+        {
+            GEN_RULE *rule = &rules[i];
+            if (rule->type == GEN_NONE || rule->key != key || rule->bus != whichBus) continue;
+            if ((rule->type >= GEN_XOR) != (pass == 1)) continue;
+            if ((rule->startBit + rule->width) > (length * 8)) continue;
+            putBits(data, rule->startBit, rule->width, ruleValue(rule, data, length));
+        }
+    }
+    xSemaphoreGive(lock);
+}
+
+uint32_t FrameGenerator::ruleValue(GEN_RULE *rule, uint8_t *data, uint8_t length)
+{
+    switch (rule->type)
+    {
+    case GEN_COUNTER:
+        return rule->count;
+    case GEN_RAMP:
+    {
+        //in 64 bits, a float only has 24 bits of mantissa and wider fields would come out in steps
+        int64_t span = (int64_t)rule->b - rule->a;
+        int64_t step = span * (int64_t)(millis() % rule->period) / rule->period;
+        return (uint32_t)(int32_t)(rule->a + step);
+    }
+    case GEN_SINE:
+    {
+        double phase = (double)(millis() % rule->period) / rule->period;
+        double span = (double)((int64_t)rule->b - rule->a);
+        int64_t offset = llround(span * 0.5 * (1.0 + sin(phase * 2.0 * M_PI)));
+        return (uint32_t)(int32_t)(rule->a + offset);
+    }
+    default:
+        break;
+    }
+
+    //checksums. Bytes the checksum itself sits in don't count
+    int first = rule->a & 0xFF;
+    int last = (rule->a >> 8) & 0xFF;
+    if (last >= length) last = length - 1;
+    int ownFirst = rule->startBit / 8;
+    int ownLast = (rule->startBit + rule->width - 1) / 8;
+    uint8_t sum = rule->b;
+    for (int i = first; i <= last; i++)
+    {
+        if (i >= ownFirst && i <= ownLast) continue;
+        switch (rule->type)
+        {
+        case GEN_XOR: sum ^= data[i]; break;
+        case GEN_SUM: sum += data[i]; break;
+        case GEN_CRC8_J1850: sum = Utility::crc8J1850(&data[i], 1, sum); break;
+        case GEN_CRC8: sum = Utility::crc8(&data[i], 1, sum); break;
+        }
+    }
+    if (rule->type == GEN_CRC8_J1850) sum ^= 0xFF;
+    return sum;
+}
+
+void FrameGenerator::putBits(uint8_t *data, uint16_t startBit, uint8_t width, uint32_t value)
+{
+    uint32_t bit = startBit;
+    while (width)
+    {
+        uint8_t shift = bit & 7;
+        uint8_t take = 8 - shift;
+        if (take > width) take = width;
+        uint8_t mask = ((1u << take) - 1) << shift;
+        data[bit >> 3] = (data[bit >> 3] & ~mask) | ((value << shift) & mask);
+        value >>= take;
+        bit += take;
+        width -= take;
+    }
+}
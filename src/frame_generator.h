@@ -0,0 +1,66 @@
+#pragma once
+#include <Arduino.h>
+#include "freertos/semphr.h"
+#include "config.h"
+#include "esp32_can.h"
+
+//What a rule writes into its field. a and b mean different things for each
+enum GEN_TYPE
+{
+    GEN_NONE = 0,
+    GEN_COUNTER = 1,    //goes up by a (0 = 1) each frame and wraps to 0 after b (0 = the largest the field holds)
+    GEN_RAMP = 2,       //climbs from a to b over period ms then starts over
+    GEN_SINE = 3,       //swings between a and b once every period ms
+    GEN_XOR = 4,        //checksums. a = first byte | last byte << 8 of the bytes covered, the checksum's own
+    GEN_SUM = 5,        //bytes are always left out. b = start value
+    GEN_CRC8_J1850 = 6, //SAE J1850, the standard one starts at 0xFF. Always XORed with 0xFF at the end
+    GEN_CRC8 = 7        //polynomial 0x07, no final XOR
+};
+
+#define GEN_MAX_RULES   32
+
+typedef struct {
+    uint32_t key;       //IDTable key of the frames it applies to
+    uint8_t bus;
+    uint8_t type;       //GEN_NONE marks a free slot
+    uint16_t startBit;  //little endian numbering, bit 0 is the low bit of byte 0 and a field runs upward from there
+    uint8_t width;      //1 - 32 bits
+    int32_t a;
+    int32_t b;
+    uint16_t period;    //ms, ramp and sine only
+    uint32_t count;     //counter state
+} GEN_RULE;
+
+/*
+Rules that fill in part of every frame sent with a given ID on a given bus, so the device can keep alive
+counters and checksums right without the host sending anything but the base frame. They run as the frame
+is handed to the controller, by TxScheduler for queued frames and by the cyclic table. Checksums always run
+after the other rules on the frame so they cover the new counter and signal values. apply() doesn't move
+the counters on, advance() does once the controller has taken the frame, so a frame that has to be tried
+again or never goes out at all doesn't use up a count.
+*/
+class FrameGenerator
+{
+public:
+    FrameGenerator();
+    int addRule(int whichBus, uint32_t id, bool extended, GEN_TYPE type, uint16_t startBit, uint8_t width,
+                int32_t a, int32_t b, uint16_t period);
+    bool removeRule(int rule);
+    void clear();
+    bool getRule(int rule, GEN_RULE &copy);
+    int getRuleCount() { return ruleCount; }
+    void apply(int whichBus, CAN_FRAME &frame);
+    void apply(int whichBus, CAN_FRAME_FD &frame);
+    void advance(int whichBus, CAN_FRAME &frame);
+    void advance(int whichBus, CAN_FRAME_FD &frame);
+
+private:
+    GEN_RULE rules[GEN_MAX_RULES];
+    int ruleCount;
+    SemaphoreHandle_t lock; //rules are changed from the main loop and used from the cyclic task too
+
+    void applyRules(int whichBus, uint32_t key, uint8_t *data, uint8_t length);
+    void advanceRules(int whichBus, uint32_t key, uint8_t length);
+    uint32_t ruleValue(GEN_RULE *rule, uint8_t *data, uint8_t length);
+    static void putBits(uint8_t *data, uint16_t startBit, uint8_t width, uint32_t value);
+};
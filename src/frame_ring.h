@@ -0,0 +1,71 @@
+#pragma once
+#include <Arduino.h>
+#include <atomic>
+#include <new>
+
+/*
+Lock free ring buffer for exactly one producer and one consumer. The producer only ever moves head
+and the consumer only ever moves tail so neither side needs a lock and neither side ever blocks.
+Storage is allocated once in begin() so nothing gets allocated while frames are flowing.
+Capacity must be a power of two.
+*/
+template <class T> class FrameRing
+{
+public:
+    FrameRing() : buffer(nullptr), mask(0), head(0), tail(0), overflows(0) {}
+
+    bool begin(uint32_t capacity)
+    {
+        if (buffer) return true;
+        if (capacity == 0 || (capacity & (capacity - 1))) return false;
+        buffer = new (std::nothrow) T[capacity];
+        if (!buffer) return false;
+        mask = capacity - 1;
+        return true;
+    }
+
+    bool isAllocated() { return buffer != nullptr; }
+
+    //producer side only. If there is no room the item is dropped and counted
+    bool push(const T &item)
+    {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if ((h - tail.load(std::memory_order_acquire)) > mask)
+        {
+            overflows.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        buffer[h & mask] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    //consumer side only
+    bool pop(T &item)
+    {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) return false;
+        item = buffer[t & mask];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    //consumer side only. The oldest item without taking it out, nullptr when empty
+    T *peek()
+    {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) return nullptr;
+        return &buffer[t & mask];
+    }
+
+    uint32_t count() { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+    uint32_t capacity() { return buffer ? (mask + 1) : 0; }
+    uint32_t getOverflows() { return overflows.load(std::memory_order_relaxed); }
+
+private:
+    T *buffer;
+    uint32_t mask;
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> overflows;
+};
@@ -0,0 +1,116 @@
+#include "frame_router.h"
+
+FrameRouter::FrameRouter()
+{
+    for (int i = 0; i < NUM_SINKS; i++)
+    {
+        sinks[i].buffer = nullptr;
+        sinks[i].isActive = nullptr;
+    }
+    for (int i = 0; i < NUM_BUSES; i++) routes[i] = ROUTE_AUTO;
+}
+
+void FrameRouter::registerSink(SINK_ID id, CommBuffer *buffer, SinkActiveCheck isActive)
+{
+    if (id >= NUM_SINKS) return;
+    sinks[id].buffer = buffer;
+    sinks[id].isActive = isActive;
+}
+
+void FrameRouter::setRoute(int whichBus, uint8_t sinkMask)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return;
+    routes[whichBus] = sinkMask & ((1 << NUM_SINKS) - 1);
+}
+
+uint8_t FrameRouter::getRoute(int whichBus)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return ROUTE_AUTO;
+    return routes[whichBus];
+}
+
+//Which sinks should get frames from this bus right now
+uint8_t FrameRouter::getActiveSinks(int whichBus)
+{
+    uint8_t mask = 0;
+
+    if (routes[whichBus] == ROUTE_AUTO)
+    {
+        if (sinks[SINK_WIFI].buffer && sinks[SINK_WIFI].isActive()) return (1 << SINK_WIFI);
+        if (sinks[SINK_SERIAL].buffer && sinks[SINK_SERIAL].isActive()) return (1 << SINK_SERIAL);
+        return 0;
+    }
+
+    for (int i = 0; i < NUM_SINKS; i++)
+    {
+        if (!(routes[whichBus] & (1 << i))) continue;
+        if (sinks[i].buffer && sinks[i].isActive()) mask |= (1 << i);
+    }
+    return mask;
+}
+
+void FrameRouter::routeFrame(CAN_FRAME &frame, int whichBus)
+{
+    uint8_t record[COMM_MAX_RECORD];
+    size_t recordLength;
+    uint8_t mask = getActiveSinks(whichBus);
+
+    for (int format = 0; format < NUM_WIRE_FORMATS && mask; format++)
+    {
+        recordLength = 0;
+        for (int i = 0; i < NUM_SINKS; i++)
+        {
+            if (!(mask & (1 << i))) continue;
+            if (sinks[i].buffer->getWireFormat() != format) continue;
+            if (format == FORMAT_GVRET_BATCH)
+            {
+                //batches carry per buffer state so each one encodes the frame itself
+                sinks[i].buffer->sendFrameToBuffer(frame, whichBus);
+                mask &= ~(1 << i);
+                continue;
+            }
+            if (recordLength == 0) recordLength = CommBuffer::encodeFrame(frame, whichBus, (WIRE_FORMAT)format, record);
+            sinks[i].buffer->sendRecordToBuffer(record, recordLength, 1, whichBus);
+            mask &= ~(1 << i);
+        }
+    }
+}
+
+void FrameRouter::routeFrame(CAN_FRAME_FD &frame, int whichBus)
+{
+    uint8_t record[COMM_MAX_RECORD];
+    size_t recordLength;
+    uint8_t mask = getActiveSinks(whichBus);
+
+    for (int format = 0; format < NUM_WIRE_FORMATS && mask; format++)
+    {
+        recordLength = 0;
+        for (int i = 0; i < NUM_SINKS; i++)
+        {
+            if (!(mask & (1 << i))) continue;
+            if (sinks[i].buffer->getWireFormat() != format) continue;
+            if (format == FORMAT_GVRET_BATCH)
+            {
+                //batches carry per buffer state so each one encodes the frame itself
+                sinks[i].buffer->sendFrameToBuffer(frame, whichBus);
+                mask &= ~(1 << i);
+                continue;
+            }
+            if (recordLength == 0) recordLength = CommBuffer::encodeFrame(frame, whichBus, (WIRE_FORMAT)format, record);
+            sinks[i].buffer->sendRecordToBuffer(record, recordLength, 1, whichBus);
+            mask &= ~(1 << i);
+        }
+    }
+}
+
+//True when every sink a frame from this bus would go to can take it. Sinks the bus isn't routed to don't
+//hold it back, so a stalled WiFi client doesn't stop buses that only go to serial
+bool FrameRouter::hasRoomForFrame(int whichBus)
+{
+    uint8_t mask = getActiveSinks(whichBus);
+    for (int i = 0; i < NUM_SINKS; i++)
+    {
+        if ((mask & (1 << i)) && !sinks[i].buffer->hasRoomForFrame()) return false;
+    }
+    return true;
+}
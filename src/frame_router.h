@@ -0,0 +1,42 @@
+#pragma once
+#include "config.h"
+#include "commbuffer.h"
+
+//Places captured frames can be sent to. Each one is backed by the CommBuffer of its GVRET handler
+enum SINK_ID
+{
+    SINK_SERIAL = 0,
+    SINK_WIFI = 1,
+    NUM_SINKS
+};
+
+#define ROUTE_AUTO  0   //route value meaning WiFi if a client is active, otherwise serial (the old behavior)
+
+typedef bool (*SinkActiveCheck)();
+
+typedef struct {
+    CommBuffer *buffer;
+    SinkActiveCheck isActive;
+} FRAME_SINK;
+
+/*
+Fans captured frames out to every sink the routing table says should get them. The routing table holds
+a bitmask of sinks for every bus. A frame is encoded once for each wire format in use by its sinks and
+that same record is then copied into each of those sinks' buffers.
+*/
+class FrameRouter
+{
+public:
+    FrameRouter();
+    void registerSink(SINK_ID id, CommBuffer *buffer, SinkActiveCheck isActive);
+    void setRoute(int whichBus, uint8_t sinkMask);
+    uint8_t getRoute(int whichBus);
+    uint8_t getActiveSinks(int whichBus);
+    void routeFrame(CAN_FRAME &frame, int whichBus);
+    void routeFrame(CAN_FRAME_FD &frame, int whichBus);
+    bool hasRoomForFrame(int whichBus);
+
+private:
+    FRAME_SINK sinks[NUM_SINKS];
+    uint8_t routes[NUM_BUSES];
+};
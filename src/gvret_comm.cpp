@@ -6,11 +6,110 @@ Implements handling of the GVRET comm protocol, both sending and receiving
 #include "SerialConsole.h"
 #include "config.h"
 #include "can_manager.h"
+#include "utility.h"
+#include "timebase.h"
+#include "frame_filter.h"
+#include "frame_decimator.h"
+#include "tx_scheduler.h"
+#include "cyclic_tx.h"
+#include "frame_generator.h"
+#include "replay_engine.h"
+#include "black_box.h"
+#include "staging_queue.h"
 
 GVRET_Comm_Handler::GVRET_Comm_Handler()
 {
     step = 0;
     state = IDLE;
+    reportCmd = 0;
+    extendedTime = false;
+    syncSequence = 0;
+    lastSyncTime = 0;
+    hostSamples = 0;
+    lastDropReport = 0;
+    rxCRCErrors = 0;
+}
+
+//periodic work for this connection
+void GVRET_Comm_Handler::loop()
+{
+    if (reportCmd) continueReport();
+    if (extendedTime && getWireFormat() != FORMAT_GVRET_TEXT)
+    {
+        if ((TimeBase::now() - lastSyncTime) >= EXT_TIME_SYNC_INTERVAL) sendTimeSync();
+    }
+    if (getIntegrity() && (micros() - lastDropReport) >= DROP_REPORT_INTERVAL) reportDrops();
+}
+
+/*
+Input straight from a read of the serial port or a WiFi client. Commands that are whole within the span and
+that come often (frames to send and the extended commands) are decoded in place. Everything else, and a
+command cut off by the end of the span, goes through processIncomingByte() which carries on with the rest of
+it next time.
+*/
+void GVRET_Comm_Handler::processIncomingBytes(uint8_t *bytes, size_t length)
+{
+    size_t pos = 0;
+    while (pos < length)
+    {
+        if (state == IDLE && bytes[pos] == 0xF1)
+        {
+            size_t used = decodeCommand(&bytes[pos], length - pos);
+            if (used)
+            {
+                pos += used;
+                continue;
+            }
+        }
+        processIncomingByte(bytes[pos++]);
+    }
+}
+
+//Decode one command starting at its 0xF1. Returns the bytes it took up or 0 to leave it to the byte parser.
+size_t GVRET_Comm_Handler::decodeCommand(uint8_t *bytes, size_t length)
+{
+    if (length < 3) return 0;
+    uint8_t cmd = bytes[1];
+
+    if (cmd == PROTO_BUILD_CAN_FRAME)
+    {
+        //F1 00 <id u32> <bus> <length> <data> <checksum>
+        if (length < 8) return 0;
+        int dataLength = bytes[7] & 0xF;
+        if (dataLength > 8) dataLength = 8;
+        size_t total = 8 + dataLength + 1;
+        if (length < total) return 0;
+
+        if (getIntegrity() && Utility::crc8(bytes, total - 1) != bytes[total - 1])
+        {
+            rxCRCErrors++;
+            return total;
+        }
+        CAN_FRAME frame;
+        uint32_t id = Utility::readLE32(&bytes[2]);
+        frame.extended = (id & (1ul << 31)) != 0;
+        frame.id = id & 0x7FFFFFFF;
+        frame.length = dataLength;
+        memcpy(frame.data.uint8, &bytes[8], dataLength);
+        sendBuiltFrame(frame, bytes[6] & 3);
+        return total;
+    }
+
+    if (cmd >= PROTO_FIRST_EXT_CMD)
+    {
+        //F1 <cmd> <length> <payload>, handled without copying the payload out
+        size_t total = 3 + bytes[2];
+        if (length < total) return 0;
+        handleExtCommand(cmd, &bytes[3], bytes[2]);
+        return total;
+    }
+    return 0;
+}
+
+void GVRET_Comm_Handler::sendBuiltFrame(CAN_FRAME &frame, int whichBus)
+{
+    frame.rtr = 0;
+    if (whichBus < NUM_BUSES) canManager.sendFrame(whichBus, frame);
 }
 
 void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
@@ -20,6 +119,8 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
 
     uint8_t temp8;
     uint16_t temp16;
+    uint8_t reply[20];
+    int replyLength = 0;
 
     switch (state) {
     case IDLE:
@@ -30,6 +131,7 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
         else if(in_byte == 0xE7)
         {
             settings.useBinarySerialComm = true;
+            setWireFormat(FORMAT_GVRET_BINARY); //only this connection, another one might still be in text mode
             SysSettings.lawicelMode = false;
             //setPromiscuousMode(); //going into binary comm will set promisc. mode too.
         } 
@@ -49,50 +151,50 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
         case PROTO_TIME_SYNC:
             state = TIME_SYNC;
             step = 0;
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 1; //time sync
-            transmitBuffer[transmitBufferLength++] = (uint8_t) (now & 0xFF);
-            transmitBuffer[transmitBufferLength++] = (uint8_t) (now >> 8);
-            transmitBuffer[transmitBufferLength++] = (uint8_t) (now >> 16);
-            transmitBuffer[transmitBufferLength++] = (uint8_t) (now >> 24);
+            reply[replyLength++] = 0xF1;
+            reply[replyLength++] = 1; //time sync
+            reply[replyLength++] = (uint8_t) (now & 0xFF);
+            reply[replyLength++] = (uint8_t) (now >> 8);
+            reply[replyLength++] = (uint8_t) (now >> 16);
+            reply[replyLength++] = (uint8_t) (now >> 24);
             break;
         case PROTO_DIG_INPUTS:
             //immediately return the data for digital inputs
             temp8 = 0; //getDigital(0) + (getDigital(1) << 1) + (getDigital(2) << 2) + (getDigital(3) << 3) + (getDigital(4) << 4) + (getDigital(5) << 5);
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 2; //digital inputs
-            transmitBuffer[transmitBufferLength++] = temp8;
+            reply[replyLength++] = 0xF1;
+            reply[replyLength++] = 2; //digital inputs
+            reply[replyLength++] = temp8;
             temp8 = checksumCalc(buff, 2);
-            transmitBuffer[transmitBufferLength++]  = temp8;
+            reply[replyLength++] = temp8;
             state = IDLE;
             break;
         case PROTO_ANA_INPUTS:
             //immediately return data on analog inputs
             temp16 = 0;// getAnalog(0);  // Analogue input 1
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 3;
-            transmitBuffer[transmitBufferLength++] = temp16 & 0xFF;
-            transmitBuffer[transmitBufferLength++] = uint8_t(temp16 >> 8);
+            reply[replyLength++] = 0xF1;
+            reply[replyLength++] = 3;
+            reply[replyLength++] = temp16 & 0xFF;
+            reply[replyLength++] = uint8_t(temp16 >> 8);
             temp16 = 0;//getAnalog(1);  // Analogue input 2
-            transmitBuffer[transmitBufferLength++] = temp16 & 0xFF;
-            transmitBuffer[transmitBufferLength++] = uint8_t(temp16 >> 8);
+            reply[replyLength++] = temp16 & 0xFF;
+            reply[replyLength++] = uint8_t(temp16 >> 8);
             temp16 = 0;//getAnalog(2);  // Analogue input 3
-            transmitBuffer[transmitBufferLength++] = temp16 & 0xFF;
-            transmitBuffer[transmitBufferLength++] = uint8_t(temp16 >> 8);
+            reply[replyLength++] = temp16 & 0xFF;
+            reply[replyLength++] = uint8_t(temp16 >> 8);
             temp16 = 0;//getAnalog(3);  // Analogue input 4
-            transmitBuffer[transmitBufferLength++] = temp16 & 0xFF;
-            transmitBuffer[transmitBufferLength++] = uint8_t(temp16 >> 8);
+            reply[replyLength++] = temp16 & 0xFF;
+            reply[replyLength++] = uint8_t(temp16 >> 8);
             temp16 = 0;//getAnalog(4);  // Analogue input 5
-            transmitBuffer[transmitBufferLength++] = temp16 & 0xFF;
-            transmitBuffer[transmitBufferLength++] = uint8_t(temp16 >> 8);
+            reply[replyLength++] = temp16 & 0xFF;
+            reply[replyLength++] = uint8_t(temp16 >> 8);
             temp16 = 0;//getAnalog(5);  // Analogue input 6
-            transmitBuffer[transmitBufferLength++] = temp16 & 0xFF;
-            transmitBuffer[transmitBufferLength++] = uint8_t(temp16 >> 8);
+            reply[replyLength++] = temp16 & 0xFF;
+            reply[replyLength++] = uint8_t(temp16 >> 8);
             temp16 = 0;//getAnalog(6);  // Vehicle Volts
-            transmitBuffer[transmitBufferLength++] = temp16 & 0xFF;
-            transmitBuffer[transmitBufferLength++] = uint8_t(temp16 >> 8);
+            reply[replyLength++] = temp16 & 0xFF;
+            reply[replyLength++] = uint8_t(temp16 >> 8);
             temp8 = checksumCalc(buff, 9);
-            transmitBuffer[transmitBufferLength++] = temp8;
+            reply[replyLength++] = temp8;
             state = IDLE;
             break;
         case PROTO_SET_DIG_OUT:
@@ -106,30 +208,30 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
             break;
         case PROTO_GET_CANBUS_PARAMS:
             //immediately return data on canbus params
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 6;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[0].enabled + ((unsigned char) settings.canSettings[0].listenOnly << 4);
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[0].nomSpeed;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[0].nomSpeed >> 8;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[0].nomSpeed >> 16;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[0].nomSpeed >> 24;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[1].enabled + ((unsigned char) settings.canSettings[1].listenOnly << 4);
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[1].nomSpeed;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[1].nomSpeed >> 8;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[1].nomSpeed >> 16;
-            transmitBuffer[transmitBufferLength++] = settings.canSettings[1].nomSpeed >> 24;
+            reply[replyLength++] = 0xF1;
+            reply[replyLength++] = 6;
+            reply[replyLength++] = settings.canSettings[0].enabled + ((unsigned char) settings.canSettings[0].listenOnly << 4);
+            reply[replyLength++] = settings.canSettings[0].nomSpeed;
+            reply[replyLength++] = settings.canSettings[0].nomSpeed >> 8;
+            reply[replyLength++] = settings.canSettings[0].nomSpeed >> 16;
+            reply[replyLength++] = settings.canSettings[0].nomSpeed >> 24;
+            reply[replyLength++] = settings.canSettings[1].enabled + ((unsigned char) settings.canSettings[1].listenOnly << 4);
+            reply[replyLength++] = settings.canSettings[1].nomSpeed;
+            reply[replyLength++] = settings.canSettings[1].nomSpeed >> 8;
+            reply[replyLength++] = settings.canSettings[1].nomSpeed >> 16;
+            reply[replyLength++] = settings.canSettings[1].nomSpeed >> 24;
             state = IDLE;
             break;
         case PROTO_GET_DEV_INFO:
             //immediately return device information
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 7;
-            transmitBuffer[transmitBufferLength++] = CFG_BUILD_NUM & 0xFF;
-            transmitBuffer[transmitBufferLength++] = (CFG_BUILD_NUM >> 8);
-            transmitBuffer[transmitBufferLength++] = 0x20;
-            transmitBuffer[transmitBufferLength++] = 0;
-            transmitBuffer[transmitBufferLength++] = 0;
-            transmitBuffer[transmitBufferLength++] = 0; //was single wire mode. Should be rethought for this board.
+            reply[replyLength++] = 0xF1;
+            reply[replyLength++] = 7;
+            reply[replyLength++] = CFG_BUILD_NUM & 0xFF;
+            reply[replyLength++] = (CFG_BUILD_NUM >> 8);
+            reply[replyLength++] = 0x20;
+            reply[replyLength++] = 0;
+            reply[replyLength++] = 0;
+            reply[replyLength++] = 0; //was single wire mode. Should be rethought for this board.
             state = IDLE;
             break;
         case PROTO_SET_SW_MODE:
@@ -138,10 +240,10 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
             step = 0;
             break;
         case PROTO_KEEPALIVE:
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 0x09;
-            transmitBuffer[transmitBufferLength++] = 0xDE;
-            transmitBuffer[transmitBufferLength++] = 0xAD;
+            reply[replyLength++] = 0xF1;
+            reply[replyLength++] = 0x09;
+            reply[replyLength++] = 0xDE;
+            reply[replyLength++] = 0xAD;
             state = IDLE;
             break;
         case PROTO_SET_SYSTYPE:
@@ -155,15 +257,15 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
             step = 0;
             break;
         case PROTO_GET_NUMBUSES:
-            transmitBuffer[transmitBufferLength++] = 0xF1;
-            transmitBuffer[transmitBufferLength++] = 12;
-            transmitBuffer[transmitBufferLength++] = SysSettings.numBuses;
+            reply[replyLength++] = 0xF1;
+            reply[replyLength++] = 12;
+            reply[replyLength++] = SysSettings.numBuses;
             state = IDLE;
             break;
         case PROTO_GET_EXT_BUSES:
-            transmitBuffer[transmitBufferLength++]  = 0xF1;
-            transmitBuffer[transmitBufferLength++]  = 13;
-            for (int u = 2; u < 17; u++) transmitBuffer[transmitBufferLength++] = 0;
+            reply[replyLength++] = 0xF1;
+            reply[replyLength++] = 13;
+            for (int u = 2; u < 17; u++) reply[replyLength++] = 0;
             step = 0;
             state = IDLE;
             break;
@@ -172,6 +274,32 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
             step = 0;
             buff[0] = 0xF1;
             break;
+        default:
+            if (in_byte >= PROTO_FIRST_EXT_CMD)
+            {
+                extCmd = in_byte;
+                state = EXT_CMD_LENGTH;
+            }
+            else state = IDLE;
+            break;
+        }
+        break;
+    case EXT_CMD_LENGTH:
+        extLength = in_byte;
+        step = 0;
+        if (extLength == 0)
+        {
+            state = IDLE;
+            handleExtCommand(extCmd, extPayload, 0);
+        }
+        else state = EXT_CMD_PAYLOAD;
+        break;
+    case EXT_CMD_PAYLOAD:
+        extPayload[step++] = in_byte;
+        if (step >= extLength)
+        {
+            state = IDLE;
+            handleExtCommand(extCmd, extPayload, extLength);
         }
         break;
     case BUILD_CAN_FRAME:
@@ -213,10 +341,17 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
             else
             {
                 state = IDLE;
-                //this would be the checksum byte. Compute and compare.
-                //temp8 = checksumCalc(buff, step);
-                build_out_frame.rtr = 0;
-                if (out_bus < NUM_BUSES) canManager.sendFrame(canBuses[out_bus], build_out_frame);
+                //this is the checksum byte. Only integrity mode holds the host to it, other hosts send 0
+                if (getIntegrity())
+                {
+                    const uint8_t start[2] = {0xF1, PROTO_BUILD_CAN_FRAME};
+                    if (Utility::crc8(&buff[1], step, Utility::crc8(start, 2)) != in_byte)
+                    {
+                        rxCRCErrors++;
+                        break;
+                    }
+                }
+                sendBuiltFrame(build_out_frame, out_bus);
             }
             break;
         }
@@ -419,6 +554,7 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
                     //{
                     toggleRXLED();
                     //if(isConnected) {
+                    build_out_frame.timestamp = micros();
                     canManager.displayFrame(build_out_frame, 0);
                     //}
                     //}
@@ -475,6 +611,666 @@ void GVRET_Comm_Handler::processIncomingByte(uint8_t in_byte)
         step++;
         break;
     }
+
+    //replies go into the buffer as one record so they are never split by a full buffer
+    if (replyLength > 0) sendBytesToBuffer(reply, replyLength);
+}
+
+//Commands at or above PROTO_FIRST_EXT_CMD arrive here with their whole payload
+void GVRET_Comm_Handler::handleExtCommand(uint8_t cmd, uint8_t *payload, int length)
+{
+    uint8_t reply[8];
+
+    switch (cmd)
+    {
+    case PROTO_SET_EXT_TIME:
+        if (length < 1) break;
+        extendedTime = (payload[0] != 0);
+        reply[0] = extendedTime ? 1 : 0;
+        sendExtReply(PROTO_SET_EXT_TIME, reply, 1);
+        if (extendedTime) sendTimeSync(); //give the host a starting point right away
+        break;
+    case PROTO_EXT_TIME_SYNC:
+        if (length >= 8) addHostTimeSample(Utility::readLE64(payload), TimeBase::now());
+        sendTimeSync();
+        break;
+    case PROTO_GET_BUSLOAD:
+    {
+        int bus = (length > 0) ? payload[0] : 0xFF;
+        for (int i = 0; i < SysSettings.numBuses; i++)
+        {
+            if (bus != 0xFF && bus != i) continue;
+            BUSLOAD *load = canManager.getBusLoad(i);
+            uint8_t loadReply[13];
+            loadReply[0] = i;
+            Utility::writeLE16(&loadReply[1], load->loadInstant);
+            Utility::writeLE16(&loadReply[3], load->load1s);
+            Utility::writeLE16(&loadReply[5], load->load10s);
+            Utility::writeLE16(&loadReply[7], load->loadPeak);
+            Utility::writeLE32(&loadReply[9], load->framesPerSecond);
+            sendExtReply(PROTO_GET_BUSLOAD, loadReply, 13);
+            if (length > 1 && payload[1]) canManager.resetBusLoadPeak(i);
+        }
+        break;
+    }
+    case PROTO_SET_FILTER:
+    {
+        if (length < 2 || payload[0] >= NUM_BUSES) break;
+        int bus = payload[0];
+        bool ok = false;
+        uint32_t id = (length >= 6) ? Utility::readLE32(&payload[2]) : 0;
+        uint32_t arg = (length >= 10) ? Utility::readLE32(&payload[6]) : 0;
+        bool extended = (id & (1ul << 31)) != 0;
+        id &= 0x1FFFFFFF;
+        switch (payload[1])
+        {
+        case 0:
+            if (length >= 3 && payload[2] <= FILTER_REJECT)
+            {
+                frameFilter.setMode(bus, (FILTER_MODE)payload[2]);
+                ok = true;
+            }
+            break;
+        case 1:
+            if (length >= 6) ok = frameFilter.addID(bus, id, extended);
+            break;
+        case 2:
+            if (length >= 6) ok = frameFilter.removeID(bus, id, extended);
+            break;
+        case 3:
+            if (length >= 10) ok = frameFilter.addRange(bus, id, arg & 0x1FFFFFFF, extended);
+            break;
+        case 4:
+            if (length >= 10) ok = frameFilter.addMask(bus, id, arg, extended);
+            break;
+        case 5:
+            frameFilter.clear(bus);
+            ok = true;
+            break;
+        }
+        reply[0] = bus;
+        reply[1] = ok ? 1 : 0;
+        reply[2] = frameFilter.getMode(bus);
+        Utility::writeLE16(&reply[3], frameFilter.getStdCount(bus));
+        Utility::writeLE16(&reply[5], frameFilter.getExtCount(bus));
+        reply[7] = frameFilter.getRangeCount(bus);
+        sendExtReply(PROTO_SET_FILTER, reply, 8);
+        break;
+    }
+    case PROTO_SET_DELTA:
+    {
+        if (length < 1 || payload[0] >= NUM_BUSES) break;
+        int bus = payload[0];
+        bool enabled = (length >= 2) ? (payload[1] != 0) : settings.deltaMode[bus];
+        uint16_t heartbeat = (length >= 4) ? Utility::readLE16(&payload[2]) : settings.deltaHeartbeat[bus];
+        canManager.setDeltaMode(bus, enabled, heartbeat);
+        reply[0] = bus;
+        reply[1] = settings.deltaMode[bus];
+        Utility::writeLE16(&reply[2], settings.deltaHeartbeat[bus]);
+        Utility::writeLE32(&reply[4], canManager.getDeltaSuppressed(bus));
+        sendExtReply(PROTO_SET_DELTA, reply, 8);
+        break;
+    }
+    case PROTO_SET_DECIMATION:
+    {
+        if (length < 2 || payload[0] >= NUM_BUSES) break;
+        int bus = payload[0];
+        bool ok = false;
+        switch (payload[1])
+        {
+        case 0:
+            if (length >= 5 && payload[2] <= DECIMATE_NTH)
+            {
+                frameDecimator.setDefault(bus, (DECIMATE_TYPE)payload[2], Utility::readLE16(&payload[3]));
+                ok = true;
+            }
+            break;
+        case 1:
+            if (length >= 9 && payload[6] <= DECIMATE_NTH)
+            {
+                uint32_t id = Utility::readLE32(&payload[2]);
+                uint32_t key = IDTable::makeKey(id & 0x1FFFFFFF, (id & (1ul << 31)) != 0);
+                ok = frameDecimator.setRule(bus, key, (DECIMATE_TYPE)payload[6], Utility::readLE16(&payload[7]));
+            }
+            break;
+        case 2:
+            frameDecimator.clearRules(bus);
+            ok = true;
+            break;
+        }
+        DECIMATE_BUS *rules = frameDecimator.getRules(bus);
+        reply[0] = bus;
+        reply[1] = ok ? 1 : 0;
+        reply[2] = rules->busDefault.type;
+        Utility::writeLE16(&reply[3], rules->busDefault.value);
+        reply[5] = rules->ruleCount;
+        sendExtReply(PROTO_SET_DECIMATION, reply, 6);
+        break;
+    }
+    case PROTO_SET_BATCH:
+        if (length < 1) break;
+        setWireFormat(payload[0] ? FORMAT_GVRET_BATCH : FORMAT_GVRET_BINARY);
+        reply[0] = payload[0] ? 1 : 0;
+        sendExtReply(PROTO_SET_BATCH, reply, 1);
+        break;
+    case PROTO_SET_COMPRESSION:
+        if (length < 1) break;
+        //the reply still goes out the old way so the host knows exactly where the switch happens
+        reply[0] = (payload[0] && prepareCompression()) ? 1 : 0;
+        sendExtReply(PROTO_SET_COMPRESSION, reply, 1);
+        setCompression(reply[0]);
+        break;
+    case PROTO_TX_SCHEDULER:
+    {
+        if (length < 1 || payload[0] >= NUM_BUSES) break;
+        uint8_t bus = payload[0];
+        uint8_t txReply[29];
+        if (length >= 3) settings.txGap[bus] = Utility::readLE16(&payload[1]);
+        TX_STATS *tx = txScheduler.getStats(bus);
+        uint32_t waiting = txScheduler.getWaiting(bus);
+        txReply[0] = bus;
+        Utility::writeLE16(&txReply[1], settings.txGap[bus]);
+        Utility::writeLE16(&txReply[3], (waiting > 0xFFFF) ? 0xFFFF : waiting);
+        Utility::writeLE32(&txReply[5], tx->queued);
+        Utility::writeLE32(&txReply[9], tx->sent);
+        Utility::writeLE32(&txReply[13], tx->dropped);
+        Utility::writeLE32(&txReply[17], tx->failed);
+        Utility::writeLE32(&txReply[21], tx->arbLost);
+        Utility::writeLE32(&txReply[25], tx->busy);
+        //the counts so far are in the reply, reset only clears them after that
+        if (length >= 4 && payload[3]) txScheduler.resetStats(bus);
+        sendExtReply(PROTO_TX_SCHEDULER, txReply, 29);
+        break;
+    }
+    case PROTO_CYCLIC_TX:
+    {
+        if (length < 1) break;
+        uint8_t cycReply[39];
+        CYCLIC_ENTRY entry;
+        int idx = (length >= 2) ? payload[1] : -1;
+        bool ok = false;
+        int replyLen = 4;
+        switch (payload[0])
+        {
+        case 0:
+            if (length >= 9 && payload[1] < NUM_BUSES && payload[8] <= 8 && length >= 9 + payload[8])
+            {
+                CAN_FRAME frame;
+                uint32_t id = Utility::readLE32(&payload[2]);
+                frame.id = id & 0x1FFFFFFF;
+                frame.extended = (id & (1ul << 31)) != 0;
+                frame.rtr = 0;
+                frame.length = payload[8];
+                memcpy(frame.data.uint8, &payload[9], frame.length);
+                idx = cyclicTx.addEntry(payload[1], frame, Utility::readLE16(&payload[6]));
+                ok = (idx >= 0);
+            }
+            break;
+        case 1:
+            ok = cyclicTx.removeEntry(idx);
+            break;
+        case 2:
+            if (length >= 3) ok = cyclicTx.setEnabled(idx, payload[2]);
+            break;
+        case 3:
+            cyclicTx.clear();
+            ok = true;
+            break;
+        case 4:
+            //figures so far go in the reply, reset only clears them after that
+            ok = cyclicTx.getEntry(idx, entry, length >= 3 && payload[2]);
+            if (ok)
+            {
+                cycReply[4] = entry.bus;
+                cycReply[5] = entry.enabled;
+                Utility::writeLE32(&cycReply[6], entry.frame.id | (entry.frame.extended ? (1ul << 31) : 0));
+                Utility::writeLE16(&cycReply[10], entry.period);
+                Utility::writeLE32(&cycReply[12], entry.sent);
+                Utility::writeLE32(&cycReply[16], entry.missed);
+                Utility::writeLE32(&cycReply[20], entry.sent ? (uint32_t)(entry.lateTotal / entry.sent) : 0);
+                Utility::writeLE32(&cycReply[24], entry.lateMax);
+                Utility::writeLE32(&cycReply[28], (entry.sent > 1) ? entry.intervalMin : 0);
+                Utility::writeLE32(&cycReply[32], entry.intervalMax);
+                replyLen = 36;
+            }
+            break;
+        }
+        cycReply[0] = payload[0];
+        cycReply[1] = ok ? 1 : 0;
+        cycReply[2] = (idx >= 0) ? idx : 0xFF;
+        cycReply[3] = cyclicTx.getEntryCount();
+        sendExtReply(PROTO_CYCLIC_TX, cycReply, replyLen);
+        break;
+    }
+    case PROTO_SET_GENERATOR:
+    {
+        if (length < 1) break;
+        uint8_t genReply[23];
+        GEN_RULE rule;
+        int idx = (length >= 2) ? payload[1] : -1;
+        bool ok = false;
+        int replyLen = 4;
+        switch (payload[0])
+        {
+        case 0:
+            if (length >= 20 && payload[1] < NUM_BUSES)
+            {
+                uint32_t id = Utility::readLE32(&payload[2]);
+                idx = frameGenerator.addRule(payload[1], id & 0x1FFFFFFF, (id & (1ul << 31)) != 0, (GEN_TYPE)payload[6],
+                                             Utility::readLE16(&payload[7]), payload[9], (int32_t)Utility::readLE32(&payload[10]),
+                                             (int32_t)Utility::readLE32(&payload[14]), Utility::readLE16(&payload[18]));
+                ok = (idx >= 0);
+            }
+            break;
+        case 1:
+            ok = frameGenerator.removeRule(idx);
+            break;
+        case 2:
+            frameGenerator.clear();
+            ok = true;
+            break;
+        case 3:
+            ok = frameGenerator.getRule(idx, rule);
+            if (ok)
+            {
+                genReply[4] = rule.bus;
+                Utility::writeLE32(&genReply[5], (rule.key & 0x1FFFFFFF) | ((rule.key & ID_KEY_EXTENDED) ? (1ul << 31) : 0));
+                genReply[9] = rule.type;
+                Utility::writeLE16(&genReply[10], rule.startBit);
+                genReply[12] = rule.width;
+                Utility::writeLE32(&genReply[13], rule.a);
+                Utility::writeLE32(&genReply[17], rule.b);
+                Utility::writeLE16(&genReply[21], rule.period);
+                replyLen = 23;
+            }
+            break;
+        }
+        genReply[0] = payload[0];
+        genReply[1] = ok ? 1 : 0;
+        genReply[2] = (idx >= 0) ? idx : 0xFF;
+        genReply[3] = frameGenerator.getRuleCount();
+        sendExtReply(PROTO_SET_GENERATOR, genReply, replyLen);
+        break;
+    }
+    case PROTO_REPLAY:
+    {
+        if (length < 1) break;
+        uint8_t replayReply[39];
+        bool ok = false;
+        int replyLen = 11;
+        switch (payload[0])
+        {
+        case 0:
+            if (length >= 5) ok = replayEngine.beginUpload(Utility::readLE32(&payload[1]));
+            break;
+        case 1:
+            if (length >= 5) ok = replayEngine.addData(Utility::readLE32(&payload[1]), &payload[5], length - 5);
+            break;
+        case 2:
+            if (length >= 5)
+            {
+                ok = replayEngine.start(Utility::readLE16(&payload[1]), Utility::readLE16(&payload[3]),
+                                        (length >= 5 + NUM_BUSES) ? &payload[5] : nullptr);
+            }
+            break;
+        case 3:
+            replayEngine.stop();
+            ok = true;
+            break;
+        case 4:
+        {
+            REPLAY_STATS *stats = replayEngine.getStats();
+            Utility::writeLE32(&replayReply[11], replayEngine.getPosition());
+            Utility::writeLE32(&replayReply[15], stats->loopsDone);
+            Utility::writeLE32(&replayReply[19], stats->framesSent);
+            Utility::writeLE32(&replayReply[23], stats->framesSkipped);
+            Utility::writeLE32(&replayReply[27], stats->underruns);
+            Utility::writeLE32(&replayReply[31], stats->framesSent ? (uint32_t)(stats->lateTotal / stats->framesSent) : 0);
+            Utility::writeLE32(&replayReply[35], stats->lateMax);
+            replyLen = 39;
+            ok = true;
+            break;
+        }
+        }
+        replayReply[0] = payload[0];
+        replayReply[1] = ok ? 1 : 0;
+        replayReply[2] = replayEngine.getState();
+        Utility::writeLE32(&replayReply[3], replayEngine.getSize());
+        Utility::writeLE32(&replayReply[7], replayEngine.getUploaded());
+        sendExtReply(PROTO_REPLAY, replayReply, replyLen);
+        break;
+    }
+    case PROTO_BLACKBOX:
+    {
+        if (length < 1) break;
+        uint8_t bbReply[24];
+        bool ok = false;
+        switch (payload[0])
+        {
+        case 0:
+            if (length >= 9) ok = blackBox.setDepth(Utility::readLE32(&payload[1]), Utility::readLE32(&payload[5]));
+            break;
+        case 1:
+            if (length >= 29)
+            {
+                BB_TRIGGER trigger;
+                trigger.sources = payload[1];
+                trigger.bus = payload[2];
+                trigger.id = Utility::readLE32(&payload[3]);
+                trigger.idMask = Utility::readLE32(&payload[7]);
+                memcpy(trigger.data, &payload[11], 8);
+                memcpy(trigger.dataMask, &payload[19], 8);
+                trigger.input = payload[27];
+                trigger.inputLevel = payload[28];
+                ok = blackBox.setTrigger(trigger);
+            }
+            break;
+        case 2:
+            ok = blackBox.arm();
+            break;
+        case 3:
+            blackBox.disarm();
+            ok = true;
+            break;
+        case 4:
+            ok = (blackBox.getState() == BB_ARMED);
+            blackBox.fire(BB_EVENT_MANUAL);
+            break;
+        case 5:
+            ok = true;
+            break;
+        case 6:
+            ok = (blackBox.getState() == BB_FROZEN);
+            break;
+        }
+        bbReply[0] = payload[0];
+        bbReply[1] = ok ? 1 : 0;
+        bbReply[2] = blackBox.getState();
+        Utility::writeLE32(&bbReply[3], blackBox.getPre());
+        Utility::writeLE32(&bbReply[7], blackBox.getPost());
+        Utility::writeLE32(&bbReply[11], blackBox.getKept());
+        Utility::writeLE32(&bbReply[15], blackBox.getTriggerIndex());
+        Utility::writeLE32(&bbReply[19], blackBox.getTriggerTime());
+        bbReply[23] = blackBox.isInPSRAM() ? 1 : 0;
+        sendExtReply(PROTO_BLACKBOX, bbReply, 24);
+        if (payload[0] == 6 && ok)
+        {
+            //a deep capture runs to megabytes so it goes out from loop() as the buffer has room, like the ID reports
+            reportCmd = PROTO_BLACKBOX_DATA;
+            reportSlot = (length >= 5) ? Utility::readLE32(&payload[1]) : 0;
+            continueReport();
+        }
+        break;
+    }
+    case PROTO_STAGING:
+    {
+        uint8_t stageReply[34];
+        bool ok = true;
+        if (length >= 2)
+        {
+            uint32_t kb = Utility::readLE16(&payload[0]);
+            if (kb > (STAGING_MAX_SIZE / 1024)) kb = STAGING_MAX_SIZE / 1024;
+            ok = stagingQueue.setSize(kb * 1024);
+        }
+        if (length >= 3 && payload[2]) stagingQueue.resetHighWater();
+        stageReply[0] = ok ? 1 : 0;
+        Utility::writeLE32(&stageReply[1], stagingQueue.getSize());
+        stageReply[5] = stagingQueue.isInPSRAM() ? 1 : 0;
+        Utility::writeLE32(&stageReply[6], stagingQueue.getUsed());
+        Utility::writeLE32(&stageReply[10], stagingQueue.getWaiting());
+        Utility::writeLE32(&stageReply[14], stagingQueue.getHighWater());
+        Utility::writeLE32(&stageReply[18], stagingQueue.getHighWaterFrames());
+        Utility::writeLE32(&stageReply[22], stagingQueue.getStaged());
+        Utility::writeLE32(&stageReply[26], stagingQueue.getDropped());
+        Utility::writeLE32(&stageReply[30], stagingQueue.getLongestBacklog());
+        sendExtReply(PROTO_STAGING, stageReply, 34);
+        break;
+    }
+    case PROTO_SET_INTEGRITY:
+        if (length < 1) break;
+        setIntegrity(payload[0]);
+        if (payload[0])
+        {
+            //only drops from here on get reported
+            for (int i = 0; i < NUM_BUSES; i++)
+            {
+                reportedCaptureDrops[i] = canManager.getCaptureOverflows(i);
+                reportedOutputDrops[i] = getBusFramesDropped(i);
+                reportedUntracked[i] = canManager.getIDTable(i)->getUntracked();
+            }
+            rxCRCErrors = 0;
+        }
+        reply[0] = payload[0] ? 1 : 0;
+        Utility::writeLE32(&reply[1], rxCRCErrors);
+        sendExtReply(PROTO_SET_INTEGRITY, reply, 5);
+        break;
+    case PROTO_GET_THINNED:
+    case PROTO_GET_ID_STATS:
+        //these can run to several KB so they are sent a record at a time from loop() as the buffer has room
+        if (length < 1 || payload[0] >= NUM_BUSES) break;
+        reportCmd = cmd;
+        reportBus = payload[0];
+        reportSlot = 0;
+        reportReset = (length > 1 && payload[1]);
+        continueReport();
+        break;
+    }
+}
+
+bool GVRET_Comm_Handler::sendExtReply(uint8_t cmd, uint8_t *payload, int length)
+{
+    uint8_t record[260];
+    if (length > 255) length = 255;
+    record[0] = 0xF1;
+    record[1] = cmd;
+    record[2] = length;
+    memcpy(&record[3], payload, length);
+    length += 3;
+    if (getIntegrity())
+    {
+        record[length] = Utility::crc8(record, length);
+        length++;
+    }
+    return sendBytesToBuffer(record, length);
+}
+
+//Integrity mode. One PROTO_FRAMES_DROPPED record for every bus and place that lost frames since the last report
+//and a PROTO_ID_TABLE_FULL for every bus that passed frames through untracked.
+//If the buffer has no room for a report it is tried again next time, the count just keeps growing meanwhile.
+void GVRET_Comm_Handler::reportDrops()
+{
+    uint8_t payload[7];
+    lastDropReport = micros();
+    for (int i = 0; i < NUM_BUSES; i++)
+    {
+        uint32_t captureDrops = canManager.getCaptureOverflows(i);
+        uint32_t outputDrops = getBusFramesDropped(i);
+        if (captureDrops != reportedCaptureDrops[i])
+        {
+            payload[0] = i;
+            payload[1] = 0;
+            Utility::writeLE32(&payload[2], captureDrops - reportedCaptureDrops[i]);
+            if (!sendExtReply(PROTO_FRAMES_DROPPED, payload, 6)) return;
+            reportedCaptureDrops[i] = captureDrops;
+        }
+        if (outputDrops != reportedOutputDrops[i])
+        {
+            payload[0] = i;
+            payload[1] = 1;
+            Utility::writeLE32(&payload[2], outputDrops - reportedOutputDrops[i]);
+            if (!sendExtReply(PROTO_FRAMES_DROPPED, payload, 6)) return;
+            reportedOutputDrops[i] = outputDrops;
+        }
+        //not drops, the frames went out, but the host should know they weren't filtered
+        IDTable *table = canManager.getIDTable(i);
+        uint32_t untracked = table->getUntracked();
+        if (untracked < reportedUntracked[i]) reportedUntracked[i] = 0; //table was cleared
+        if (untracked != reportedUntracked[i])
+        {
+            payload[0] = i;
+            Utility::writeLE16(&payload[1], table->count());
+            Utility::writeLE32(&payload[3], untracked - reportedUntracked[i]);
+            if (!sendExtReply(PROTO_ID_TABLE_FULL, payload, 7)) return;
+            reportedUntracked[i] = untracked;
+        }
+    }
+}
+
+/*
+Walk the bus' ID table sending full records for as long as the buffer has room, then pick up from the same
+slot next time. The report ends with a record that isn't full, possibly one with no entries at all.
+*/
+void GVRET_Comm_Handler::continueReport()
+{
+    if (reportCmd == PROTO_BLACKBOX_DATA)
+    {
+        continueBlackBox();
+        return;
+    }
+    uint8_t record[2 + (31 * 8)];
+    int entrySize = (reportCmd == PROTO_GET_ID_STATS) ? 33 : 8;
+    int perRecord = (reportCmd == PROTO_GET_ID_STATS) ? 7 : 31;
+    IDTable *table = canManager.getIDTable(reportBus);
+    record[0] = reportBus;
+
+    while (freeBytes() >= (size_t)(5 + (perRecord * entrySize)))
+    {
+        int count = 0;
+        while (count < perRecord && reportSlot < table->capacity())
+        {
+            ID_ENTRY *entry = table->entryAt(reportSlot++);
+            if (!entry) continue;
+            if (reportCmd == PROTO_GET_THINNED && entry->thinned == 0) continue;
+            uint8_t *out = &record[2 + (count++ * entrySize)];
+            Utility::writeLE32(&out[0], entry->key); //same layout as the protocol, bit 31 = extended
+            if (reportCmd == PROTO_GET_THINNED) Utility::writeLE32(&out[4], entry->thinned);
+            else
+            {
+                Utility::writeLE32(&out[4], entry->count);
+                Utility::writeLE32(&out[8], entry->periodMin);
+                Utility::writeLE32(&out[12], entry->periodAvg);
+                Utility::writeLE32(&out[16], entry->periodMax);
+                Utility::writeLE32(&out[20], entry->jitter);
+                out[24] = entry->length;
+                memcpy(&out[25], entry->data, 8);
+            }
+        }
+        record[1] = count;
+        sendExtReply(reportCmd, record, 2 + (count * entrySize));
+        if (count < perRecord)
+        {
+            if (reportCmd == PROTO_GET_ID_STATS && reportReset) table->clear();
+            reportCmd = 0;
+            return;
+        }
+    }
+}
+
+/*
+Same idea for a black box download, from reportSlot to the last record kept. Re-arming the box part way
+through ends the download early with an empty record since what was being sent is gone.
+*/
+void GVRET_Comm_Handler::continueBlackBox()
+{
+    const int perRecord = 13;
+    uint8_t record[5 + (perRecord * sizeof(BB_RECORD))];
+    bool frozen = (blackBox.getState() == BB_FROZEN);
+
+    while (freeBytes() >= sizeof(record) + 4)
+    {
+        int count = 0;
+        BB_RECORD rec;
+        Utility::writeLE32(&record[0], reportSlot);
+        while (frozen && count < perRecord && blackBox.getRecord(reportSlot, rec))
+        {
+            uint8_t *out = &record[5 + (count++ * sizeof(BB_RECORD))];
+            Utility::writeLE32(&out[0], rec.timestamp);
+            Utility::writeLE32(&out[4], rec.id);
+            out[8] = rec.flags;
+            out[9] = rec.length;
+            memcpy(&out[10], rec.data, 8);
+            reportSlot++;
+        }
+        record[4] = count;
+        sendExtReply(PROTO_BLACKBOX_DATA, record, 5 + (count * sizeof(BB_RECORD)));
+        if (count < perRecord)
+        {
+            reportCmd = 0;
+            return;
+        }
+    }
+}
+
+/*
+Time sync record for extended time mode. Frames keep their 4 byte timestamps which are the low 32 bits of
+the device time, so with one of these at least every EXT_TIME_SYNC_INTERVAL the host can rebuild the full
+64 bit time of every frame. The sequence number lets the host notice a lost sync record. If the host has
+been sending us its own time we also pass along where we think its clock is and how fast it drifts from ours.
+*/
+void GVRET_Comm_Handler::sendTimeSync()
+{
+    uint8_t payload[24];
+    int32_t drift = 0;
+    uint64_t deviceTime = TimeBase::now();
+    uint64_t hostTime = estimateHostTime(deviceTime, drift);
+
+    Utility::writeLE32(&payload[0], syncSequence++);
+    Utility::writeLE64(&payload[4], deviceTime);
+    Utility::writeLE64(&payload[12], hostTime);
+    Utility::writeLE32(&payload[20], (uint32_t)drift);
+    sendExtReply(PROTO_EXT_TIME_SYNC, payload, 24);
+    lastSyncTime = deviceTime;
+}
+
+//Host time samples go in a window of the latest HOST_TIME_WINDOW. Older ones drop out so the fit follows
+//the clocks as they wander and nothing adds up without bound over a long session.
+void GVRET_Comm_Handler::addHostTimeSample(uint64_t hostTime, uint64_t deviceTime)
+{
+    int slot = hostSamples % HOST_TIME_WINDOW;
+    hostTimes[slot] = hostTime;
+    deviceTimes[slot] = deviceTime;
+    hostSamples++;
+}
+
+/*
+Host time that matches the given device time. Returns 0 if the host never sent its time. Least squares fit
+of host time against device time over the window. Every sample carries the link latency as noise but that
+averages out while the slope converges on the real drift between the two clocks. Everything is taken
+relative to the newest sample and the sums are centred on the window's means so the doubles only ever
+hold small numbers.
+*/
+uint64_t GVRET_Comm_Handler::estimateHostTime(uint64_t deviceTime, int32_t &driftPPB)
+{
+    driftPPB = 0;
+    if (hostSamples == 0) return 0;
+
+    int newest = (hostSamples - 1) % HOST_TIME_WINDOW;
+    int count = (hostSamples < HOST_TIME_WINDOW) ? hostSamples : HOST_TIME_WINDOW;
+    uint64_t hostOrigin = hostTimes[newest];
+    uint64_t deviceOrigin = deviceTimes[newest];
+
+    double meanX = 0.0, meanY = 0.0;
+    for (int i = 0; i < count; i++)
+    {
+        meanX += (double)(int64_t)(deviceTimes[i] - deviceOrigin);
+        meanY += (double)(int64_t)(hostTimes[i] - hostOrigin);
+    }
+    meanX /= count;
+    meanY /= count;
+
+    double sxx = 0.0, sxy = 0.0;
+    for (int i = 0; i < count; i++)
+    {
+        double dx = (double)(int64_t)(deviceTimes[i] - deviceOrigin) - meanX;
+        double dy = (double)(int64_t)(hostTimes[i] - hostOrigin) - meanY;
+        sxx += dx * dx;
+        sxy += dx * dy;
+    }
+    double slope = (count > 1 && sxx > 0.0) ? (sxy / sxx) : 1.0;
+    driftPPB = (int32_t)((slope - 1.0) * 1e9);
+
+    double x = (double)(int64_t)(deviceTime - deviceOrigin);
+    return hostOrigin + (int64_t)(meanY + (slope * (x - meanX)));
 }
 
 //Get the value of XOR'ing all the bytes together. This creates a reasonable checksum that can be used
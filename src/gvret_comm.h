@@ -18,7 +18,9 @@ enum STATE {
     SET_SINGLEWIRE_MODE,
     SET_SYSTYPE,
     ECHO_CAN_FRAME,
-    SETUP_EXT_BUSES
+    SETUP_EXT_BUSES,
+    EXT_CMD_LENGTH,
+    EXT_CMD_PAYLOAD
 };
 
 enum GVRET_PROTOCOL
@@ -41,6 +43,70 @@ enum GVRET_PROTOCOL
     PROTO_BUILD_FD_FRAME = 20,
     PROTO_SETUP_FD = 21,
     PROTO_GET_FD = 22,
+
+    //Commands from here on all use the same framing in both directions: 0xF1 <cmd> <length> <length bytes of payload>
+    PROTO_FIRST_EXT_CMD = 23,
+    PROTO_SET_EXT_TIME = 23,    //<mode> 1 = send 64 bit time sync records on this connection. Replies with the mode
+    PROTO_EXT_TIME_SYNC = 24,   //<host time u64>. Replies, and is sent every EXT_TIME_SYNC_INTERVAL, with
+                                //<sequence u32> <device time u64> <host time estimate u64> <drift ppb i32>
+    PROTO_GET_BUSLOAD = 25,     //[bus] [reset peak] no bus or 0xFF = all buses. One reply per bus:
+                                //<bus> <instant u16> <1s u16> <10s u16> <peak u16> <frames/s u32>, loads in 0.1%
+    PROTO_SET_FILTER = 26,      //<bus> <op> [args] software ID filter, IDs are u32 with bit 31 set for extended
+                                //op 0 <mode>, 1 add <id>, 2 remove <id>, 3 add range <low> <high>, 4 add <id> <mask>, 5 clear
+                                //Replies <bus> <ok> <mode> <standard IDs u16> <extended IDs u16> <ranges>
+    PROTO_SET_DELTA = 27,       //<bus> [enable] [heartbeat ms u16] only send frames whose payload changed. With just
+                                //the bus it is a query. Replies <bus> <enable> <heartbeat u16> <frames suppressed u32>
+    PROTO_SET_DECIMATION = 28,  //<bus> <op> op 0 <type> <value u16> bus default, 1 <id u32> <type> <value u16> one ID
+                                //(type 0 removes it), 2 remove all rules. Types: 0 off, 1 frames/s, 2 every Kth.
+                                //Replies <bus> <ok> <default type> <default value u16> <rule count>
+    PROTO_GET_THINNED = 29,     //<bus> Replies with as many records as it takes of <bus> <count> then count times
+                                //<id u32> <frames held back u32>. The last record has fewer than 31 entries
+    PROTO_GET_ID_STATS = 30,    //<bus> [reset] Replies with as many records as it takes of <bus> <count> then count times
+                                //<id u32> <frames u32> <period min u32> <avg u32> <max u32> <jitter u32> <length> <data 8>
+                                //Periods in microseconds. The last record has fewer than 7 entries
+    PROTO_SET_BATCH = 31,       //<enable> 1 = send frames in batch records from now on, 0 = back to one record per frame
+                                //Replies <enable>
+    PROTO_BATCH_FRAMES = 32,    //device to host only. <first timestamp u32> then per frame <time delta varint>
+                                //<ID varint> <flags> <data>, see CommBuffer::addToBatch
+    PROTO_SET_COMPRESSION = 33, //<enable> 1 = everything after the reply is sent as LZ4 blocks, see LZCompressor
+                                //Replies <enabled>, 0 if there wasn't the RAM for it
+    PROTO_SET_INTEGRITY = 34,   //<enable> 1 = CRC-8 after every extended record, checked on frames from the host, plus
+                                //sequence marks and dropped frame reports. Replies, already in the new mode,
+                                //<enabled> <frames from the host that failed their CRC u32>
+    PROTO_SEQUENCE = 35,        //device to host only. <sequence u16> <frames u32> at the end of each flush, see
+                                //CommBuffer::sendSequenceMark
+    PROTO_FRAMES_DROPPED = 36,  //device to host only. <bus> <where> <count u32> frames the device lost since the last
+                                //report. Where is 0 for capture (before any output) and 1 for this connection's buffer
+    PROTO_TX_SCHEDULER = 37,    //<bus> [gap u16] [reset after] minimum gap between transmitted frames in us. Replies <bus>
+                                //<gap u16> <waiting u16> <queued u32> <sent u32> <dropped u32> <failed u32>
+                                //<arbitration lost u32> <controller busy u32>
+    PROTO_CYCLIC_TX = 38,       //<op> cyclic transmit table. op 0 add <bus> <id u32> <period ms u16> <length> <data>,
+                                //1 remove <entry>, 2 enable <entry> <enable>, 3 clear all, 4 stats <entry> [reset after].
+                                //IDs have bit 31 set for extended. Replies <op> <ok> <entry> <entries in use> and for
+                                //op 4 then <bus> <enabled> <id u32> <period u16> <sent u32> <missed u32>
+                                //<average late u32> <max late u32> <min interval u32> <max interval u32>, times in us
+    PROTO_SET_GENERATOR = 39,   //<op> payload generators for sent frames. op 0 add <bus> <id u32> <type> <start bit u16>
+                                //<width> <a i32> <b i32> <period ms u16>, 1 remove <rule>, 2 clear all, 3 get <rule>.
+                                //See GEN_TYPE. Replies <op> <ok> <rule> <rules in use> and for op 3 the same fields
+                                //as an add from <bus> on
+    PROTO_REPLAY = 40,          //<op> timed replay, see ReplayEngine. op 0 begin upload <size u32>, 1 data <offset u32>
+                                //<entries>, 2 play <loops u16, 0 = until stopped> <speed % u16> [bus for each recorded
+                                //bus, 0xFF = don't send], 3 stop, 4 status. Replies <op> <ok> <state> <size u32>
+                                //<uploaded u32> and for op 4 then <position u32> <loops done u32> <sent u32>
+                                //<skipped u32> <underruns u32> <average late u32> <max late u32>, times in us
+    PROTO_BLACKBOX = 41,        //<op> black box capture, see BlackBox. op 0 depth <pre u32> <post u32>, 1 trigger
+                                //<sources> <bus> <id u32> <id mask u32> <data 8> <data mask 8> <input pin> <level>
+                                //(ok 0 and the old trigger kept if the pin is a flash, CAN or LED pin or not a GPIO),
+                                //2 arm, 3 disarm, 4 trigger now, 5 status, 6 download [first record u32] once frozen.
+                                //Replies <op> <ok> <state> <pre u32> <post u32> <records kept u32>
+                                //<trigger record u32> <trigger time u32> <in PSRAM>
+    PROTO_BLACKBOX_DATA = 42,   //device to host only. <first record u32> <count> then count BB_RECORDs of 18 bytes,
+                                //<time u32> <id u32> <flags> <length> <data 8>. The last record has fewer than 13
+    PROTO_STAGING = 43,         //[size KB u16, 0 = off] [reset] staging queue for output stalls, see StagingQueue.
+                                //Not saved. Replies <ok> <size u32> <in PSRAM> <used u32> <frames waiting u32>
+                                //<high water u32> <high water frames u32> <staged u32> <dropped u32> <longest backlog ms u32>
+    PROTO_ID_TABLE_FULL = 44,   //device to host only, integrity mode. <bus> <IDs tracked u16> <count u32> frames since the
+                                //last report from IDs the bus' ID table had no room for. Those skip delta and decimation
 };
 
 class GVRET_Comm_Handler: public CommBuffer
@@ -48,6 +114,8 @@ class GVRET_Comm_Handler: public CommBuffer
 public:
     GVRET_Comm_Handler();
     void processIncomingByte(uint8_t in_byte);
+    void processIncomingBytes(uint8_t *bytes, size_t length);
+    void loop();
     
 private:
     CAN_FRAME build_out_frame;
@@ -57,6 +125,40 @@ private:
     int step;
     STATE state;
     uint32_t build_int;
+    uint8_t extCmd;
+    uint8_t extLength;
+    uint8_t extPayload[256];
+
+    //ID table or black box report being sent out a record at a time. reportCmd is 0 when there isn't one
+    uint8_t reportCmd;
+    uint8_t reportBus;
+    uint32_t reportSlot;
+    bool reportReset;
+
+    //extended time mode and the fit of the host's clock against ours
+    bool extendedTime;
+    uint32_t syncSequence;
+    uint64_t lastSyncTime;
+    uint32_t hostSamples;       //samples ever taken, the newest is at (hostSamples - 1) % HOST_TIME_WINDOW
+    uint64_t hostTimes[HOST_TIME_WINDOW];
+    uint64_t deviceTimes[HOST_TIME_WINDOW];
+
+    //integrity mode, drops already reported and frames from the host that failed their CRC
+    uint32_t reportedCaptureDrops[NUM_BUSES];
+    uint32_t reportedOutputDrops[NUM_BUSES];
+    uint32_t reportedUntracked[NUM_BUSES];
+    uint32_t lastDropReport;
+    uint32_t rxCRCErrors;
 
     uint8_t checksumCalc(uint8_t *buffer, int length);
+    void handleExtCommand(uint8_t cmd, uint8_t *payload, int length);
+    bool sendExtReply(uint8_t cmd, uint8_t *payload, int length);
+    void sendTimeSync();
+    void continueReport();
+    void continueBlackBox();
+    void reportDrops();
+    size_t decodeCommand(uint8_t *bytes, size_t length);
+    void sendBuiltFrame(CAN_FRAME &frame, int whichBus);
+    void addHostTimeSample(uint64_t hostTime, uint64_t deviceTime);
+    uint64_t estimateHostTime(uint64_t deviceTime, int32_t &driftPPB);
 };
\ No newline at end of file
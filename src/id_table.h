@@ -0,0 +1,140 @@
+#pragma once
+#include <Arduino.h>
+#include "config.h"
+#include "utility.h"
+
+#define ID_KEY_EXTENDED (1ul << 31)
+#define ID_KEY_EMPTY    0xFFFFFFFFul
+
+#define ID_FLAG_SENT    1   //delta mode has sent this ID since it was turned on
+
+//Everything kept about one ID seen on a bus. Kept to 60 bytes, times are frame timestamps in microseconds.
+typedef struct {
+    uint32_t key;           //ID with ID_KEY_EXTENDED set for 29 bit IDs
+    uint32_t count;
+    uint32_t lastSeen;
+    uint32_t periodMin;
+    uint32_t periodMax;
+    uint32_t periodAvg;     //running average over roughly the last 8 periods
+    uint32_t jitter;        //running average of how far each period is from periodAvg
+    uint8_t data[8];        //first 8 bytes of the last payload
+    uint8_t length;
+    uint8_t flags;
+    uint8_t decimateType;
+    uint8_t ruleGeneration; //decimation rule cached here is current if this matches the bus' generation
+    uint8_t sentLength;     //delta mode, length of the payload last sent. The bytes are in the table, see sentPayload()
+    uint32_t lastEmitted;   //timestamp of the last frame of this ID that was sent out
+    uint32_t nextDue;       //rate decimation, timestamp the next frame may go out at
+    uint32_t thinned;       //frames held back by decimation
+    uint16_t decimateValue;
+    uint16_t skipCount;     //every Kth decimation, frames left to skip
+} ID_ENTRY;
+
+/*
+Fixed size table of the IDs seen on one bus. Storage is allocated once in begin() and entries are never removed
+one at a time, only all together with clear(), so lookups are a hash and a short linear probe.
+Once the table is full new IDs are not tracked and findOrAdd() returns nullptr for them.
+Capacity must be a power of two. Alongside the entries is room for the payload delta mode last sent for each
+one, payloadBytes per entry, 8 for classic buses and 64 for FD. Both go in PSRAM when there is some.
+*/
+class IDTable
+{
+public:
+    IDTable() : entries(nullptr), sent(nullptr), stride(0), mask(0), used(0), untracked(0) {}
+
+    bool begin(uint32_t capacity, uint8_t payloadBytes)
+    {
+        if (entries) return true;
+        if (capacity == 0 || (capacity & (capacity - 1))) return false;
+        entries = (ID_ENTRY *)Utility::allocLarge(capacity * sizeof(ID_ENTRY), ID_TABLE_MAX_INTERNAL);
+        if (!entries) return false;
+        sent = (uint8_t *)Utility::allocLarge(capacity * payloadBytes, ID_TABLE_MAX_INTERNAL);
+        if (!sent)
+        {
+            heap_caps_free(entries);
+            entries = nullptr;
+            return false;
+        }
+        stride = payloadBytes;
+        mask = capacity - 1;
+        clear();
+        return true;
+    }
+
+    void clear()
+    {
+        if (!entries) return;
+        for (uint32_t i = 0; i <= mask; i++) entries[i].key = ID_KEY_EMPTY;
+        used = 0;
+        untracked = 0;
+    }
+
+    static uint32_t makeKey(uint32_t id, bool extended) { return extended ? (id | ID_KEY_EXTENDED) : (id & 0x7FF); }
+
+    ID_ENTRY *find(uint32_t key)
+    {
+        if (!entries) return nullptr;
+        uint32_t slot = hashSlot(key);
+        for (uint32_t i = 0; i <= mask; i++)
+        {
+            if (entries[slot].key == key) return &entries[slot];
+            if (entries[slot].key == ID_KEY_EMPTY) return nullptr;
+            slot = (slot + 1) & mask;
+        }
+        return nullptr;
+    }
+
+    //New entries are zeroed apart from the key
+    ID_ENTRY *findOrAdd(uint32_t key, bool &added)
+    {
+        added = false;
+        if (!entries) return nullptr;
+        uint32_t slot = hashSlot(key);
+        for (uint32_t i = 0; i <= mask; i++)
+        {
+            if (entries[slot].key == key) return &entries[slot];
+            if (entries[slot].key == ID_KEY_EMPTY)
+            {
+                //leave a quarter of the slots empty so probes for missing IDs stay short
+                if (used >= ((mask + 1) - ((mask + 1) >> 2)))
+                {
+                    untracked++;
+                    return nullptr;
+                }
+                memset(&entries[slot], 0, sizeof(ID_ENTRY));
+                entries[slot].key = key;
+                used++;
+                added = true;
+                return &entries[slot];
+            }
+            slot = (slot + 1) & mask;
+        }
+        untracked++;
+        return nullptr;
+    }
+
+    //For walking the whole table. Slots that are not in use come back as nullptr.
+    ID_ENTRY *entryAt(uint32_t slot)
+    {
+        if (!entries || slot > mask || entries[slot].key == ID_KEY_EMPTY) return nullptr;
+        return &entries[slot];
+    }
+
+    //The last payload delta mode sent for this entry, payloadBytes() long
+    uint8_t *sentPayload(ID_ENTRY *entry) { return &sent[(entry - entries) * stride]; }
+    uint8_t payloadBytes() { return stride; }
+
+    uint32_t capacity() { return entries ? (mask + 1) : 0; }
+    uint32_t count() { return used; }
+    uint32_t getUntracked() { return untracked; }
+
+private:
+    ID_ENTRY *entries;
+    uint8_t *sent;
+    uint8_t stride;
+    uint32_t mask;
+    uint32_t used;
+    uint32_t untracked;
+
+    uint32_t hashSlot(uint32_t key) { return ((key * 2654435761ul) >> 16) & mask; }
+};
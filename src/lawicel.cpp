@@ -6,6 +6,19 @@ Implements the lawicel protocol.
 #include "config.h"
 #include <esp32_can.h>
 #include "utility.h"
+#include "timebase.h"
+#include "frame_filter.h"
+#include "frame_bits.h"
+#include "gvret_comm.h"
+#include "can_manager.h"
+
+LAWICELHandler::LAWICELHandler()
+{
+    polling = false;
+    draining = false;
+    queueLost = 0;
+    reportedOverflows = 0;
+}
 
 void LAWICELHandler::handleShortCmd(char cmd)
 {
@@ -15,54 +28,65 @@ void LAWICELHandler::handleShortCmd(char cmd)
         CAN0.setListenOnlyMode(false);
         CAN0.begin(settings.canSettings[0].nomSpeed, 255);
         CAN0.enable();
-        Serial.write(13); //send CR to mean "ok"
+        reply("\r"); //send CR to mean "ok"
         SysSettings.lawicelMode = true;
         break;
     case 'C': //LAWICEL close canbus port (First one)
         CAN0.disable();
-        Serial.write(13); //send CR to mean "ok"
+        stopPolling();
+        reply("\r"); //send CR to mean "ok"
         break;
     case 'L': //LAWICEL open canbus port in listen only mode
         CAN0.setListenOnlyMode(true);
         CAN0.begin(settings.canSettings[0].nomSpeed, 255); 
         CAN0.enable();
-        Serial.write(13); //send CR to mean "ok"
+        reply("\r"); //send CR to mean "ok"
         SysSettings.lawicelMode = true;
         break;
-    case 'P': //LAWICEL - poll for one waiting frame. Or, just CR if no frames
-        if (CAN0.available()) SysSettings.lawicelPollCounter = 1;
-        else Serial.write(13); //no waiting frames
+    case 'P': //LAWICEL - poll for one waiting frame. Or, just CR if no frames. BELL if auto poll is on
+        if (SysSettings.lawicelAutoPoll) reply("\a");
+        else if (!startPolling() || !sendQueuedFrame()) reply("\r"); //no waiting frames
         break;
-    case 'A': //LAWICEL - poll for all waiting frames - CR if no frames
-        SysSettings.lawicelPollCounter = CAN0.available();
-        if (SysSettings.lawicelPollCounter == 0) Serial.write(13);
+    case 'A': //LAWICEL - poll for all waiting frames, as many as the output buffer takes, then A and CR. BELL if auto poll is on
+        if (SysSettings.lawicelAutoPoll)
+        {
+            reply("\a");
+            break;
+        }
+        if (startPolling())
+        {
+            while (serialGVRET.hasRoomForFrame() && sendQueuedFrame());
+        }
+        reply("A\r");
         break;
     case 'F': //LAWICEL - read status bits
-        Serial.print("F00"); //bit 0 = RX Fifo Full, 1 = TX Fifo Full, 2 = Error warning, 3 = Data overrun, 5= Error passive, 6 = Arb. Lost, 7 = Bus Error
-        Serial.write(13);
+        sendStatus();
         break;
     case 'V': //LAWICEL - get version number
-        Serial.print("V1013\n");
+        reply("V1013\n");
         SysSettings.lawicelMode = true;
         break;
     case 'N': //LAWICEL - get serial number
-        Serial.print("ESP32RET\n");
+        reply("ESP32RET\n");
         SysSettings.lawicelMode = true;
         break;
     case 'x':
         SysSettings.lawicellExtendedMode = !SysSettings.lawicellExtendedMode;
         if (SysSettings.lawicellExtendedMode) {
-            Serial.print("V2\n");
+            reply("V2\n");
         }
         else {
-            Serial.print("LAWICEL\n");
+            reply("LAWICEL\n");
         }            
         break;
     case 'B': //LAWICEL V2 - Output list of supported buses
         if (SysSettings.lawicellExtendedMode) {
-            for (int i = 0; i < NUM_BUSES; i++) {
-                printBusName(i);
-                Serial.print("\n");
+            for (int i = 0; i < SysSettings.numBuses; i++) {
+                char name[10];
+                size_t length = putBusName(name, i);
+                name[length++] = '\n';
+                name[length] = 0;
+                reply(name);
             }
         }
         break;
@@ -71,11 +95,13 @@ void LAWICELHandler::handleShortCmd(char cmd)
         }
         break;        
     }
+    serialGVRET.flushBuffer();
 }
 
 void LAWICELHandler::handleLongCmd(char *buffer)
 {
     CAN_FRAME outFrame;
+    CAN_FRAME_FD fdFrame;
     char buff[80];
     int val;
     
@@ -91,20 +117,27 @@ void LAWICELHandler::handleLongCmd(char *buffer)
         for (int data = 0; data < outFrame.length; data++) {
             outFrame.data.bytes[data] = Utility::parseHexString(buffer + 5 + (2 * data), 2);
         }
-        CAN0.sendFrame(outFrame);
-        if (SysSettings.lawicelAutoPoll) Serial.print("z");
+        canManager.sendFrame(0, outFrame);
+        if (SysSettings.lawicelAutoPoll) reply("z");
         break;
     case 'T': //transmit extended frame
         outFrame.id = Utility::parseHexString(buffer + 1, 8);
         outFrame.length = buffer[9] - '0';
-        outFrame.extended = false;
+        outFrame.extended = true;
         if (outFrame.length < 0) outFrame.length = 0;
         if (outFrame.length > 8) outFrame.length = 8;
         for (int data = 0; data < outFrame.length; data++) {
             outFrame.data.bytes[data] = Utility::parseHexString(buffer + 10 + (2 * data), 2);
         }
-        CAN0.sendFrame(outFrame);
-        if (SysSettings.lawicelAutoPoll) Serial.print("Z");
+        canManager.sendFrame(0, outFrame);
+        if (SysSettings.lawicelAutoPoll) reply("Z");
+        break;
+    case 'd': //transmit FD frame, standard then extended ID. The b versions ask for bitrate switching which
+    case 'D': //the bus does or doesn't do according to its data rate, so they are handled the same
+    case 'b':
+    case 'B':
+        if (parseFDCmd(buffer, fdFrame)) canManager.sendFrame(0, fdFrame);
+        if (SysSettings.lawicelAutoPoll) reply((buffer[0] == 'd' || buffer[0] == 'b') ? "z" : "Z");
         break;
     case 'S': 
         if (!SysSettings.lawicellExtendedMode) {
@@ -152,22 +185,15 @@ void LAWICELHandler::handleLongCmd(char *buffer)
                 }
                 else break; //break for loop because we're obviously done.
             }
-            if (!strcasecmp(tokens[1], "CAN0")) {
+            int bus = parseBusName(tokens[1]);
+            if (bus >= 0) {
                 CAN_FRAME outFrame;
                 outFrame.id = id;
                 outFrame.length = numBytes;
                 outFrame.extended = false;
                 for (int b = 0; b < numBytes; b++) outFrame.data.bytes[b] = bytes[b];
-                CAN0.sendFrame(outFrame);
+                canManager.sendFrame(bus, outFrame);
             }
-            if (!strcasecmp(tokens[1], "CAN1")) {
-                CAN_FRAME outFrame;
-                outFrame.id = id;
-                outFrame.length = numBytes;
-                outFrame.extended = false;
-                for (int b = 0; b < numBytes; b++) outFrame.data.bytes[b] = bytes[b];
-                CAN1.sendFrame(outFrame);
-            }            
         }
     case 's': //setup canbus baud via register writes (we can't really do that...)
         //settings.CAN0Speed = 250000;
@@ -176,14 +202,25 @@ void LAWICELHandler::handleLongCmd(char *buffer)
         break;
     case 'R': 
         if (SysSettings.lawicellExtendedMode) { //Lawicel V2 - Set that we want to receive traffic from the given bus - R <BUSID>
-            if (!strcasecmp(tokens[1], "CAN0")) SysSettings.lawicelBusReception[0] = true;
-            if (!strcasecmp(tokens[1], "CAN1")) SysSettings.lawicelBusReception[1] = true;
+            int bus = parseBusName(tokens[1]);
+            if (bus >= 0) SysSettings.lawicelBusReception[bus] = true;
         }
         else { //Lawicel V1 - send extended RTR frame (NO! DON'T DO IT!)
         }
         break;
     case 'X': //Set autopoll off/on
-        if (buffer[1] == '1') SysSettings.lawicelAutoPoll = true;
+        if (buffer[1] == '1')
+        {
+            SysSettings.lawicelAutoPoll = true;
+            //back to sending frames as they arrive, starting with whatever was still queued. That goes out
+            //as fast as the output buffer takes it, new frames queue up behind it until it is all gone
+            if (polling)
+            {
+                polling = false;
+                draining = true;
+                drainQueued();
+            }
+        }
         else SysSettings.lawicelAutoPoll = false;
         break;
     case 'W': //Dual or single filter mode
@@ -191,17 +228,22 @@ void LAWICELHandler::handleLongCmd(char *buffer)
     case 'm': //set acceptance mask - these things seem to be odd and aren't actually implemented yet
     case 'M': 
         if (SysSettings.lawicellExtendedMode) { //Lawicel V2 - Set filter mask - M <busid> <Mask> <FilterID> <Ext?>
-            int mask = strtol(tokens[2], nullptr, 16);
-            int filt = strtol(tokens[3], nullptr, 16);
-            if (!strcasecmp(tokens[1], "CAN0")) 
-            {
-                if (!strcasecmp(tokens[4], "X")) CAN0.setRXFilter(0, filt, mask, true);
-                    else CAN0.setRXFilter(0, filt, mask, false);
-            }
-            if (!strcasecmp(tokens[1], "CAN1"))
+            //goes into the software filter so any number of these can be stacked up. A mask of 0 clears the list.
+            uint32_t mask = strtoul(tokens[2], nullptr, 16);
+            uint32_t filt = strtoul(tokens[3], nullptr, 16);
+            int bus = parseBusName(tokens[1]);
+            if (bus >= 0)
             {
-                if (!strcasecmp(tokens[4], "X")) CAN1.setRXFilter(0, filt, mask, true);
-                    else CAN1.setRXFilter(0, filt, mask, false);
+                if (mask == 0)
+                {
+                    frameFilter.clear(bus);
+                    frameFilter.setMode(bus, FILTER_OFF);
+                }
+                else
+                {
+                    frameFilter.addMask(bus, filt, mask, !strcasecmp(tokens[4], "X"));
+                    frameFilter.setMode(bus, FILTER_ACCEPT);
+                }
             }
         }
         else { //Lawicel V1 - set acceptance code
@@ -209,8 +251,8 @@ void LAWICELHandler::handleLongCmd(char *buffer)
         break;
     case 'H':
         if (SysSettings.lawicellExtendedMode) { //Lawicel V2 - Halt reception of traffic from given bus - H <busid>
-            if (!strcasecmp(tokens[1], "CAN0")) SysSettings.lawicelBusReception[0] = false;
-            if (!strcasecmp(tokens[1], "CAN1")) SysSettings.lawicelBusReception[1] = false;
+            int bus = parseBusName(tokens[1]);
+            if (bus >= 0) SysSettings.lawicelBusReception[bus] = false;
         } 
         break;        
     case 'U': //set uart speed. We just ignore this. You can't set a baud rate on a USB CDC port
@@ -225,16 +267,39 @@ void LAWICELHandler::handleLongCmd(char *buffer)
         if (SysSettings.lawicellExtendedMode) {
             //at least two parameters separated by spaces. First BUS ID (CAN0, CAN1, SWCAN, etc) then speed (or more params separated by #'s)
             int speed = atoi(tokens[2]);
-            if (!strcasecmp(tokens[1], "CAN0")) {
-                CAN0.begin(speed, 255);
-            }
-            if (!strcasecmp(tokens[1], "CAN1")) {
-                CAN1.begin(speed, 255);
-            }            
+            int bus = parseBusName(tokens[1]);
+            if (bus >= 0) canBuses[bus]->begin(speed, 255);
         }
         break;
     }
-    Serial.write(13);
+    reply("\r");
+    serialGVRET.flushBuffer();
+}
+
+//Responses go into the serial output buffer behind any frames already waiting so nothing overtakes them
+void LAWICELHandler::reply(const char *str)
+{
+    serialGVRET.sendBytesToBuffer((uint8_t *)str, strlen(str));
+}
+
+//<d|D|b|B><ID, 3 or 8 hex digits><DLC, one hex digit><data>. False if the line is too short for its DLC
+bool LAWICELHandler::parseFDCmd(char *buffer, CAN_FRAME_FD &frame)
+{
+    bool extended = (buffer[0] == 'D' || buffer[0] == 'B');
+    int idDigits = extended ? 8 : 3;
+    size_t lineLength = strlen(buffer);
+    if (lineLength < (size_t)(2 + idDigits)) return false;
+
+    frame.id = Utility::parseHexString(buffer + 1, idDigits);
+    frame.extended = extended;
+    frame.fdMode = 1;
+    frame.rrs = 0;
+    frame.length = FrameBits::fdDLCToLength(Utility::parseHexCharacter(buffer[1 + idDigits]));
+    if (lineLength < (size_t)(2 + idDigits + (2 * frame.length))) return false;
+    for (int i = 0; i < frame.length; i++) {
+        frame.data.uint8[i] = Utility::parseHexString(buffer + 2 + idDigits + (2 * i), 2);
+    }
+    return true;
 }
 
 //Tokenize cmdBuffer on space boundaries - up to 10 tokens supported
@@ -264,18 +329,25 @@ void LAWICELHandler::uppercaseToken(char *token) {
     token[idx] = 0;
 }
 
-void LAWICELHandler::printBusName(int bus) {
-    switch (bus) {
-    case 0:
-        Serial.print("CAN0");
-        break;
-    case 1:
-        Serial.print("CAN1");
-        break;
-    default:
-        Serial.print("UNKNOWN");
-        break;
+//CAN0 through CAN4, -1 for anything else
+int LAWICELHandler::parseBusName(char *token) {
+    if (strncasecmp(token, "CAN", 3) != 0) return -1;
+    int bus = token[3] - '0';
+    if (bus < 0 || bus >= SysSettings.numBuses || token[4] != 0) return -1;
+    return bus;
+}
+
+//CAN0 through CAN4, the same names parseBusName takes. Written into out, returns the length
+size_t LAWICELHandler::putBusName(char *out, int bus)
+{
+    if (bus < 0 || bus >= NUM_BUSES)
+    {
+        memcpy(out, "UNKNOWN", 7);
+        return 7;
     }
+    memcpy(out, "CAN", 3);
+    out[3] = '0' + bus;
+    return 4;
 }
 
 //Expecting to find ID in tokens[2] then zero or more data bytes
@@ -293,54 +365,259 @@ bool LAWICELHandler::parseLawicelCANCmd(CAN_FRAME &frame) {
     return true;
 }
 
+//Frames from buses that were halted with H are left out. In polled mode the rest wait in their bus' queue
 void LAWICELHandler::sendFrameToBuffer(CAN_FRAME &frame, int whichBus)
 {
-    uint8_t buff[40];
-    uint8_t writtenBytes;
-    uint8_t temp;
-    uint32_t now = micros();
-    
+    if (whichBus < 0 || whichBus >= NUM_BUSES || !SysSettings.lawicelBusReception[whichBus]) return;
+    if (!polling && !draining)
+    {
+        writeFrame(frame, whichBus);
+        return;
+    }
+    if (!pollQueue[whichBus].begin(LAWICEL_QUEUE_SIZE))
+    {
+        queueLost++;
+        return;
+    }
+    pollQueue[whichBus].push(frame);
+}
+
+void LAWICELHandler::sendFrameToBuffer(CAN_FRAME_FD &frame, int whichBus)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES || !SysSettings.lawicelBusReception[whichBus]) return;
+    if (!polling && !draining)
+    {
+        writeFrame(frame, whichBus);
+        return;
+    }
+    //only buses that actually see FD traffic get an FD queue
+    if (!pollFDQueue[whichBus].begin(LAWICEL_FD_QUEUE_SIZE))
+    {
+        queueLost++;
+        return;
+    }
+    pollFDQueue[whichBus].push(frame);
+}
+
+/*
+Frames are encoded straight into the serial output buffer and go out with everything else when it is
+flushed. Classic frames are t/T lines, FD frames d/D lines or b/B when the bus switches to a faster data
+rate, with the DLC as one hex digit.
+*/
+void LAWICELHandler::writeFrame(CAN_FRAME &frame, int whichBus)
+{
+    char buff[COMM_MAX_RECORD];
+    size_t pos = 0;
+
     if (SysSettings.lawicellExtendedMode) 
     {
-        Serial.print(micros());
-        Serial.print(" - ");
-        Serial.print(frame.id, HEX);            
-        if (frame.extended) Serial.print(" X ");
-        else Serial.print(" S ");
-        
-        printBusName(whichBus);
-        for (int d = 0; d < frame.length; d++) 
-        {
-            Serial.print(" ");
-            Serial.print(frame.data.uint8[d], HEX);
-        }
+        pos = putExtendedLine(buff, frame.timestamp, frame.id, frame.extended, whichBus, frame.data.uint8, frame.length);
+    }
+    else 
+    {
+        buff[pos++] = frame.extended ? 'T' : 't';
+        pos += Utility::putHex(&buff[pos], frame.id, frame.extended ? 8 : 3);
+        pos += Utility::putDecimal(&buff[pos], frame.length);
+        for (int i = 0; i < frame.length; i++) pos += Utility::putHex(&buff[pos], frame.data.uint8[i], 2);
+        pos += putTimestamp(&buff[pos], frame.timestamp);
+    }
+    buff[pos++] = 13;
+    serialGVRET.sendRecordToBuffer((uint8_t *)buff, pos, 1, whichBus);
+}
+
+void LAWICELHandler::writeFrame(CAN_FRAME_FD &frame, int whichBus)
+{
+    char buff[COMM_MAX_RECORD];
+    size_t pos = 0;
+
+    if (SysSettings.lawicellExtendedMode) 
+    {
+        pos = putExtendedLine(buff, frame.timestamp, frame.id, frame.extended, whichBus, frame.data.uint8, frame.length);
     }
     else 
     {
-        if (frame.extended) 
+        if (frame.fdMode)
         {
-            Serial.print("T");
-            sprintf((char *)buff, "%08x", frame.id);
-            Serial.print((char *)buff);
-        } 
-        else 
+            uint8_t dlc = FrameBits::fdLengthToDLC(frame.length);
+            int dataLength = FrameBits::fdDLCToLength(dlc);
+            bool brs = settings.canSettings[whichBus].fdSpeed > settings.canSettings[whichBus].nomSpeed;
+            if (frame.extended) buff[pos++] = brs ? 'B' : 'D';
+            else buff[pos++] = brs ? 'b' : 'd';
+            pos += Utility::putHex(&buff[pos], frame.id, frame.extended ? 8 : 3);
+            pos += Utility::putHex(&buff[pos], dlc, 1, true);
+            //padded lengths go out with zeros in the padding
+            for (int i = 0; i < dataLength; i++) pos += Utility::putHex(&buff[pos], (i < frame.length) ? frame.data.uint8[i] : 0, 2);
+        }
+        else
         {
-            Serial.print("t");
-            sprintf((char *)buff, "%03x", frame.id);
-            Serial.print((char *)buff);
+            //a classic frame that came in through the FD interface
+            int length = (frame.length > 8) ? 8 : frame.length;
+            buff[pos++] = frame.extended ? 'T' : 't';
+            pos += Utility::putHex(&buff[pos], frame.id, frame.extended ? 8 : 3);
+            pos += Utility::putDecimal(&buff[pos], length);
+            for (int i = 0; i < length; i++) pos += Utility::putHex(&buff[pos], frame.data.uint8[i], 2);
         }
-        Serial.print(frame.length);
-        for (int i = 0; i < frame.length; i++) 
+        pos += putTimestamp(&buff[pos], frame.timestamp);
+    }
+    buff[pos++] = 13;
+    serialGVRET.sendRecordToBuffer((uint8_t *)buff, pos, 1, whichBus);
+}
+
+//V2 extended mode line: <timestamp> - <ID> <X|S> <bus name> then the data bytes, all hex but the timestamp
+size_t LAWICELHandler::putExtendedLine(char *out, uint32_t timestamp, uint32_t id, bool extended, int whichBus, uint8_t *data, int length)
+{
+    size_t pos = Utility::putDecimal(out, timestamp);
+    memcpy(&out[pos], " - ", 3);
+    pos += 3;
+    pos += Utility::putHexTrimmed(&out[pos], id, true);
+    memcpy(&out[pos], extended ? " X " : " S ", 3);
+    pos += 3;
+    pos += putBusName(&out[pos], whichBus);
+    for (int d = 0; d < length; d++) 
+    {
+        out[pos++] = ' ';
+        pos += Utility::putHexTrimmed(&out[pos], data[d], true);
+    }
+    return pos;
+}
+
+//slcan timestamps are milliseconds that wrap at 60000. Uses the time the frame was received. Nothing if they're off
+size_t LAWICELHandler::putTimestamp(char *out, uint32_t timestamp)
+{
+    if (!SysSettings.lawicelTimestamping) return 0;
+    //from the 64 bit time, the 32 bit micros() stamp wraps at a point that isn't a multiple of 60 seconds
+    return Utility::putHex(out, (uint16_t)((TimeBase::extend(timestamp) / 1000) % 60000), 4);
+}
+
+/*
+Polled mode starts with the first P or A while auto poll is off and lasts until X1 or the port is closed.
+Hosts that never poll keep getting frames as they arrive. Returns false if polled mode can't be used.
+*/
+bool LAWICELHandler::startPolling()
+{
+    if (polling) return true;
+    if (SysSettings.lawicelAutoPoll) return false;
+    for (int i = 0; i < SysSettings.numBuses; i++)
+    {
+        if (!pollQueue[i].begin(LAWICEL_QUEUE_SIZE)) return false;
+    }
+    reportedOverflows = getQueueOverflows();
+    polling = true;
+    draining = false;
+    return true;
+}
+
+//Anything still queued is thrown away
+void LAWICELHandler::stopPolling()
+{
+    CAN_FRAME frame;
+    CAN_FRAME_FD fdFrame;
+    polling = false;
+    draining = false;
+    for (int i = 0; i < NUM_BUSES; i++)
+    {
+        while (pollQueue[i].pop(frame));
+        while (pollFDQueue[i].pop(fdFrame));
+    }
+}
+
+//Write out the oldest queued frame of any bus. False if every queue is empty
+bool LAWICELHandler::sendQueuedFrame()
+{
+    int oldestBus = -1;
+    bool oldestFD = false;
+    uint32_t oldestTime = 0;
+
+    for (int i = 0; i < NUM_BUSES; i++)
+    {
+        CAN_FRAME *frame = pollQueue[i].peek();
+        if (frame && (oldestBus < 0 || (int32_t)(frame->timestamp - oldestTime) < 0))
+        {
+            oldestBus = i;
+            oldestFD = false;
+            oldestTime = frame->timestamp;
+        }
+        CAN_FRAME_FD *fdFrame = pollFDQueue[i].peek();
+        if (fdFrame && (oldestBus < 0 || (int32_t)(fdFrame->timestamp - oldestTime) < 0))
         {
-            sprintf((char *)buff, "%02x", frame.data.uint8[i]);
-            Serial.print((char *)buff);
+            oldestBus = i;
+            oldestFD = true;
+            oldestTime = fdFrame->timestamp;
         }
-        if (SysSettings.lawicelTimestamping) 
+    }
+    if (oldestBus < 0) return false;
+
+    if (oldestFD)
+    {
+        CAN_FRAME_FD fdFrame;
+        pollFDQueue[oldestBus].pop(fdFrame);
+        writeFrame(fdFrame, oldestBus);
+    }
+    else
+    {
+        CAN_FRAME frame;
+        pollQueue[oldestBus].pop(frame);
+        writeFrame(frame, oldestBus);
+    }
+    return true;
+}
+
+//Frames left queued after X1 go out while the output buffer has room. Once they are all gone frames are sent as they arrive again
+void LAWICELHandler::drainQueued()
+{
+    while (serialGVRET.hasRoomForFrame())
+    {
+        if (!sendQueuedFrame())
         {
-            uint16_t timestamp = (uint16_t)millis();
-            sprintf((char *)buff, "%04x", timestamp);
-            Serial.print((char *)buff);
+            draining = false;
+            return;
         }
     }
-    Serial.write(13);
-}
\ No newline at end of file
+}
+
+void LAWICELHandler::loop()
+{
+    if (draining) drainQueued();
+}
+
+uint32_t LAWICELHandler::getQueueOverflows()
+{
+    uint32_t overflows = queueLost;
+    for (int i = 0; i < NUM_BUSES; i++) overflows += pollQueue[i].getOverflows() + pollFDQueue[i].getOverflows();
+    return overflows;
+}
+
+/*
+F reply. Bit 0 (RX FIFO full) is set while any poll queue is full and bit 3 (data overrun) if frames were lost
+since the last F. V2 extended mode adds the number of frames queued and the number lost after the flags.
+*/
+void LAWICELHandler::sendStatus()
+{
+    char buff[32];
+    size_t pos = 0;
+    uint8_t flags = 0;
+    uint32_t queued = 0;
+    uint32_t overflows = getQueueOverflows();
+
+    for (int i = 0; i < NUM_BUSES; i++)
+    {
+        queued += pollQueue[i].count() + pollFDQueue[i].count();
+        if (pollQueue[i].isAllocated() && pollQueue[i].count() == pollQueue[i].capacity()) flags |= 1;
+        if (pollFDQueue[i].isAllocated() && pollFDQueue[i].count() == pollFDQueue[i].capacity()) flags |= 1;
+    }
+    if (overflows != reportedOverflows) flags |= 8;
+
+    buff[pos++] = 'F';
+    pos += Utility::putHex(&buff[pos], flags, 2, true);
+    if (SysSettings.lawicellExtendedMode)
+    {
+        buff[pos++] = ' ';
+        pos += Utility::putDecimal(&buff[pos], queued);
+        buff[pos++] = ' ';
+        pos += Utility::putDecimal(&buff[pos], overflows - reportedOverflows);
+    }
+    buff[pos++] = '\r';
+    buff[pos] = 0;
+    reply(buff);
+    reportedOverflows = overflows;
+}
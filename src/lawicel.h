@@ -1,19 +1,48 @@
 #pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+#include "frame_ring.h"
 
 class CAN_FRAME;
+class CAN_FRAME_FD;
 
 class LAWICELHandler
 {
 public:
+    LAWICELHandler();
     void handleLongCmd(char *buffer);
     void handleShortCmd(char cmd);
     void sendFrameToBuffer(CAN_FRAME &frame, int whichBus);
+    void sendFrameToBuffer(CAN_FRAME_FD &frame, int whichBus);
+    void loop();
 
 private:
     char tokens[14][10];
 
+    //polled mode, frames wait here for P or A
+    bool polling;
+    bool draining;              //X1 turned polling off with frames still queued, they go out ahead of new ones
+    FrameRing<CAN_FRAME> pollQueue[NUM_BUSES];
+    FrameRing<CAN_FRAME_FD> pollFDQueue[NUM_BUSES];
+    uint32_t queueLost;         //frames that arrived when there wasn't the RAM for their queue
+    uint32_t reportedOverflows; //frames lost as of the last F
+
     void tokenizeCmdString(char *buff);
     void uppercaseToken(char *token);
-    void printBusName(int bus);
+    size_t putBusName(char *out, int bus);
+    int parseBusName(char *token);
     bool parseLawicelCANCmd(CAN_FRAME &frame);
+    bool parseFDCmd(char *buffer, CAN_FRAME_FD &frame);
+    void reply(const char *str);
+    size_t putExtendedLine(char *out, uint32_t timestamp, uint32_t id, bool extended, int whichBus, uint8_t *data, int length);
+    size_t putTimestamp(char *out, uint32_t timestamp);
+    void writeFrame(CAN_FRAME &frame, int whichBus);
+    void writeFrame(CAN_FRAME_FD &frame, int whichBus);
+    bool startPolling();
+    void stopPolling();
+    bool sendQueuedFrame();
+    void drainQueued();
+    uint32_t getQueueOverflows();
+    void sendStatus();
 };
\ No newline at end of file
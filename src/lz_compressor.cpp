@@ -0,0 +1,92 @@
+#include "lz_compressor.h"
+#include "utility.h"
+
+//LZ4 block format limits. The last match has to start at least 12 bytes before the end and the last
+//5 bytes are always literals.
+#define LZ_MIN_MATCH        4
+#define LZ_MF_LIMIT         12
+#define LZ_LAST_LITERALS    5
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t val;
+    memcpy(&val, p, 4);
+    return val;
+}
+
+static inline size_t putLength(uint8_t *dst, size_t len)
+{
+    size_t op = 0;
+    while (len >= 255)
+    {
+        dst[op++] = 255;
+        len -= 255;
+    }
+    dst[op++] = len;
+    return op;
+}
+
+//Returns the size of the finished block, header included
+size_t LZCompressor::compressBlock(const uint8_t *src, size_t length)
+{
+    if (length > LZ_MAX_INPUT) length = LZ_MAX_INPUT;
+    size_t packed = compress(src, length, &block[LZ_BLOCK_HEADER]);
+    if (packed >= length)
+    {
+        memcpy(&block[LZ_BLOCK_HEADER], src, length);
+        Utility::writeLE16(&block[0], length | LZ_STORED_FLAG);
+        packed = length;
+    }
+    else Utility::writeLE16(&block[0], packed);
+    Utility::writeLE16(&block[2], length);
+    return LZ_BLOCK_HEADER + packed;
+}
+
+//Greedy single probe LZ4. Not the best ratio but fast and CAN traffic repeats so much that it doesn't matter.
+size_t LZCompressor::compress(const uint8_t *src, size_t length, uint8_t *dst)
+{
+    size_t ip = 0, anchor = 0, op = 0;
+
+    memset(hashTable, 0, sizeof(hashTable));
+    if (length > LZ_MF_LIMIT)
+    {
+        size_t limit = length - LZ_MF_LIMIT;
+        while (ip < limit)
+        {
+            uint32_t seq = read32(&src[ip]);
+            uint32_t h = (uint32_t)(seq * 2654435761ul) >> (32 - LZ_HASH_BITS);
+            size_t ref = hashTable[h];
+            hashTable[h] = ip;
+            if (ref >= ip || read32(&src[ref]) != seq)
+            {
+                ip++;
+                continue;
+            }
+
+            size_t matchLength = LZ_MIN_MATCH;
+            while ((ip + matchLength) < (length - LZ_LAST_LITERALS) && src[ref + matchLength] == src[ip + matchLength]) matchLength++;
+
+            size_t literals = ip - anchor;
+            uint8_t *token = &dst[op++];
+            *token = ((literals < 15) ? literals : 15) << 4;
+            if (literals >= 15) op += putLength(&dst[op], literals - 15);
+            memcpy(&dst[op], &src[anchor], literals);
+            op += literals;
+            dst[op++] = (ip - ref) & 0xFF;
+            dst[op++] = (ip - ref) >> 8;
+            size_t extra = matchLength - LZ_MIN_MATCH;
+            *token |= (extra < 15) ? extra : 15;
+            if (extra >= 15) op += putLength(&dst[op], extra - 15);
+
+            ip += matchLength;
+            anchor = ip;
+            if (op >= length) return op; //not going to be smaller, caller stores it instead
+        }
+    }
+
+    size_t literals = length - anchor;
+    dst[op++] = ((literals < 15) ? literals : 15) << 4;
+    if (literals >= 15) op += putLength(&dst[op], literals - 15);
+    memcpy(&dst[op], &src[anchor], literals);
+    return op + literals;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <Arduino.h>
+#include "config.h"
+
+#define LZ_HASH_BITS        10
+#define LZ_MAX_INPUT        COMM_RING_SIZE
+#define LZ_BLOCK_HEADER     4
+#define LZ_STORED_FLAG      0x8000 //block header flag, the data is stored as is
+
+/*
+Streaming compression for an output connection. Every span of bytes a sender writes out is turned into one
+self contained block:
+    <data length u16> <original length u16> <data>
+The data is in LZ4 block format so any LZ4 library can unpack it. If compressing didn't make the span smaller
+the data is the original bytes and the data length has LZ_STORED_FLAG set.
+Blocks don't refer back to earlier blocks so RAM is just the hash table and one output block.
+*/
+class LZCompressor
+{
+public:
+    size_t compressBlock(const uint8_t *src, size_t length);
+    uint8_t *getBlock() { return block; }
+
+private:
+    uint16_t hashTable[1 << LZ_HASH_BITS];
+    uint8_t block[LZ_BLOCK_HEADER + LZ_MAX_INPUT + (LZ_MAX_INPUT / 255) + 16];
+
+    size_t compress(const uint8_t *src, size_t length, uint8_t *dst);
+};
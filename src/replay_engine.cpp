@@ -0,0 +1,294 @@
+#include "replay_engine.h"
+#include "tx_scheduler.h"
+#include "frame_bits.h"
+#include "timebase.h"
+
+ReplayEngine::ReplayEngine()
+{
+    buffer = nullptr;
+    size = 0;
+    filled = 0;
+    position = 0;
+    state = REPLAY_IDLE;
+    stopRequested = false;
+    loops = 1;
+    speed = 100;
+    for (int i = 0; i < NUM_BUSES; i++) busMap[i] = i;
+    memset(&stats, 0, sizeof(stats));
+    task = nullptr;
+    timer = nullptr;
+    lastBlocked = 0;
+}
+
+//Throws away whatever was uploaded before, stopping it first if it is playing
+bool ReplayEngine::beginUpload(uint32_t newSize)
+{
+    stop();
+    filled = 0;
+    position = 0;
+    if (newSize == 0 || newSize > REPLAY_MAX_SIZE) return false;
+    if (newSize != size)
+    {
+        free(buffer);
+        size = 0;
+        buffer = (uint8_t *)malloc(newSize);
+        if (!buffer) return false;
+        size = newSize;
+    }
+    return true;
+}
+
+//Chunks have to come in order. A chunk for the wrong offset is refused and the host can carry on from getUploaded()
+bool ReplayEngine::addData(uint32_t offset, uint8_t *data, uint32_t length)
+{
+    uint32_t current = filled.load(std::memory_order_relaxed);
+    if (!buffer || offset != current || length > (size - current)) return false;
+    memcpy(&buffer[current], data, length);
+    filled.store(current + length, std::memory_order_release);
+    return true;
+}
+
+bool ReplayEngine::start(uint16_t newLoops, uint16_t newSpeed, uint8_t *newBusMap)
+{
+    stop();
+    if (!buffer || filled.load() == 0 || newSpeed == 0) return false;
+    if (!startTask()) return false;
+    loops = newLoops;
+    speed = newSpeed;
+    if (newBusMap) memcpy(busMap, newBusMap, NUM_BUSES);
+    memset(&stats, 0, sizeof(stats));
+    position = 0;
+    stopRequested = false;
+    state = REPLAY_PLAYING;
+    xTaskNotifyGive(task);
+    return true;
+}
+
+//Doesn't return until the task has let go of the buffer
+void ReplayEngine::stop()
+{
+    if (state.load() == REPLAY_IDLE) return;
+    stopRequested = true;
+    xTaskNotifyGive(task);
+    while (state.load() != REPLAY_IDLE) vTaskDelay(1);
+}
+
+bool ReplayEngine::startTask()
+{
+    if (task) return true;
+    esp_timer_create_args_t args;
+    memset(&args, 0, sizeof(args));
+    args.callback = ReplayEngine::timerCallback;
+    args.arg = this;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "replay";
+    if (esp_timer_create(&args, &timer) != ESP_OK)
+    {
+        timer = nullptr;
+        return false;
+    }
+    if (xTaskCreatePinnedToCore(ReplayEngine::taskLoop, "REPLAY", REPLAY_TASK_STACK, this,
+                                REPLAY_TASK_PRIORITY, &task, REPLAY_TASK_CORE) != pdPASS)
+    {
+        task = nullptr;
+        esp_timer_delete(timer);
+        timer = nullptr;
+        return false;
+    }
+    return true;
+}
+
+static int getVarint(uint8_t *in, uint32_t available, uint32_t &value)
+{
+    value = 0;
+    for (uint32_t i = 0; i < available && i < 5; i++)
+    {
+        value |= (uint32_t)(in[i] & 0x7F) << (7 * i);
+        if (!(in[i] & 0x80)) return i + 1;
+    }
+    return 0;
+}
+
+//Returns the length of the entry at pos, 0 if it isn't all there yet
+int ReplayEngine::decodeEntry(uint32_t pos, uint32_t available, int32_t &delta, CAN_FRAME &frame, CAN_FRAME_FD &fdFrame,
+                              bool &isFD, int &bus)
+{
+    uint8_t *in = &buffer[pos];
+    uint32_t value;
+    int used = getVarint(in, available, value);
+    if (!used) return 0;
+    delta = (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+    int len = getVarint(in + used, available - used, value);
+    if (!len || (uint32_t)(used + len) >= available) return 0;
+    used += len;
+    uint8_t flags = in[used++];
+    isFD = (flags & 0x80) != 0;
+    bus = (flags >> 4) & 7;
+    int dataLength = isFD ? FrameBits::fdDLCToLength(flags & 0x0F) : (flags & 0x0F);
+    if (!isFD && dataLength > 8) dataLength = 8;
+    if ((uint32_t)(used + dataLength) > available) return 0;
+
+    if (isFD)
+    {
+        fdFrame.id = value >> 1;
+        fdFrame.extended = value & 1;
+        fdFrame.fdMode = 1;
+        fdFrame.length = dataLength;
+        memcpy(fdFrame.data.uint8, &in[used], dataLength);
+    }
+    else
+    {
+        frame.id = value >> 1;
+        frame.extended = value & 1;
+        frame.rtr = 0;
+        frame.length = dataLength;
+        memcpy(frame.data.uint8, &in[used], dataLength);
+    }
+    return used + dataLength;
+}
+
+//Dense captures or a run of skipped frames never give the timer a chance to put the task to sleep, so play()
+//calls this before waiting on each frame. Sitting out a tick can cost up to a tick of lateness, so it's only
+//done when nextDue is far enough off to absorb it, or as a last resort after REPLAY_MAX_BUSY
+void ReplayEngine::yieldIfBusy(uint64_t nextDue)
+{
+    uint64_t now = TimeBase::now();
+    uint64_t busy = now - lastBlocked;
+    if (busy < (portTICK_PERIOD_MS * 1000)) return;
+    bool roomToSleep = (nextDue > now) && ((nextDue - now) > (portTICK_PERIOD_MS * 1000 + REPLAY_YIELD_MARGIN));
+    if (!roomToSleep && busy < REPLAY_MAX_BUSY) return;
+    vTaskDelay(1);
+    lastBlocked = TimeBase::now();
+}
+
+//Sleep on the timer until REPLAY_SPIN_US before the target then spin. False if stopped meanwhile
+bool ReplayEngine::waitUntil(uint64_t target)
+{
+    for (;;)
+    {
+        if (stopRequested.load()) return false;
+        uint64_t now = TimeBase::now();
+        if (now >= target) return true;
+        uint64_t left = target - now;
+        if (left > REPLAY_SPIN_US)
+        {
+            esp_timer_stop(timer);
+            esp_timer_start_once(timer, left - REPLAY_SPIN_US);
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            lastBlocked = TimeBase::now();
+        }
+    }
+}
+
+//Wait for an upload still under way to get up to needed. False if stopped
+bool ReplayEngine::waitForData(uint32_t needed)
+{
+    stats.underruns++;
+    state = REPLAY_WAITING;
+    while (filled.load(std::memory_order_acquire) < needed && filled.load() < size)
+    {
+        if (stopRequested.load()) return false;
+        vTaskDelay(1);
+    }
+    lastBlocked = TimeBase::now();
+    state = REPLAY_PLAYING;
+    return true;
+}
+
+void ReplayEngine::play()
+{
+    CAN_FRAME frame;
+    CAN_FRAME_FD fdFrame;
+    uint64_t startTime = TimeBase::now();
+    int64_t recordTime = 0;     //us into the capture of the current entry
+    lastBlocked = startTime;
+
+    for (;;)
+    {
+        uint32_t uploaded = filled.load(std::memory_order_acquire);
+        uint32_t available = uploaded - position;
+        int32_t delta;
+        bool isFD;
+        int bus;
+        int used = available ? decodeEntry(position, available, delta, frame, fdFrame, isFD, bus) : 0;
+        if (!used)
+        {
+            if (uploaded < size)
+            {
+                //caught up with the upload. The time spent waiting doesn't count against the frames after it
+                uint64_t waitStart = TimeBase::now();
+                if (!waitForData(uploaded + 1)) return;
+                startTime += TimeBase::now() - waitStart;
+                continue;
+            }
+            //end of the capture. Anything cut off at the very end is left out
+            if (position == 0) return;
+            stats.loopsDone++;
+            if (loops && stats.loopsDone >= loops) return;
+            position = 0;
+            recordTime = 0;
+            startTime = TimeBase::now();
+            continue;
+        }
+        position += used;
+
+        recordTime += delta;
+        int64_t offset = (recordTime * 100) / speed;
+        uint64_t due = startTime + ((offset > 0) ? offset : 0);
+        yieldIfBusy(due);
+        if (!waitUntil(due)) return;
+
+        int outBus = (bus < NUM_BUSES) ? busMap[bus] : 0xFF;
+        if (outBus >= NUM_BUSES || !settings.canSettings[outBus].enabled)
+        {
+            stats.framesSkipped++;
+            continue;
+        }
+
+        //the controller gets REPLAY_MAX_LATE to make room before the frame is given up on. Past the spin time
+        //the task sleeps between tries so a saturated bus doesn't starve everything else on this core
+        bool accepted;
+        uint64_t now;
+        for (;;)
+        {
+            accepted = isFD ? txScheduler.sendNow(outBus, fdFrame) : txScheduler.sendNow(outBus, frame);
+            now = TimeBase::now();
+            if (accepted || (now - due) >= REPLAY_MAX_LATE || stopRequested.load()) break;
+            if ((now - due) > REPLAY_SPIN_US)
+            {
+                vTaskDelay(1);
+                lastBlocked = TimeBase::now();
+            }
+        }
+
+        if (!accepted)
+        {
+            stats.framesSkipped++;
+            continue;
+        }
+        uint32_t late = (uint32_t)(now - due);
+        stats.framesSent++;
+        stats.lateTotal += late;
+        if (late > stats.lateMax) stats.lateMax = late;
+    }
+}
+
+//Runs in the esp_timer task, only wakes ours
+void ReplayEngine::timerCallback(void *param)
+{
+    ReplayEngine *replay = (ReplayEngine *)param;
+    xTaskNotifyGive(replay->task);
+}
+
+void ReplayEngine::taskLoop(void *param)
+{
+    ReplayEngine *replay = (ReplayEngine *)param;
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (replay->state.load() == REPLAY_IDLE) continue;
+        replay->play();
+        esp_timer_stop(replay->timer);
+        replay->state = REPLAY_IDLE;
+    }
+}
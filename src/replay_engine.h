@@ -0,0 +1,75 @@
+#pragma once
+#include <Arduino.h>
+#include <atomic>
+#include <esp_timer.h>
+#include "config.h"
+#include "esp32_can.h"
+
+enum REPLAY_STATE
+{
+    REPLAY_IDLE = 0,
+    REPLAY_PLAYING = 1,
+    REPLAY_WAITING = 2     //caught up with an upload that isn't finished yet
+};
+
+typedef struct {
+    uint32_t loopsDone;
+    uint32_t framesSent;
+    uint32_t framesSkipped;     //bus mapped to nowhere or the controller wouldn't take the frame in time
+    uint32_t underruns;         //times playback had to wait for more of the upload
+    uint64_t lateTotal;         //us between when a frame should have gone out and when the controller took it
+    uint32_t lateMax;
+} REPLAY_STATS;
+
+/*
+Plays back a capture the host uploads, with the capture's own timing. The upload is a run of entries in the
+same form as a GVRET batch record: <time delta varint> <ID varint> <flags> <data>, see CommBuffer::addToBatch.
+The first entry's delta is from the start of playback. Playback can start before the upload is complete and
+then follows it, waiting if it catches up, so a capture larger than the buffer can't be played but one that
+is still arriving can.
+
+A task of its own sleeps on an esp_timer until just before each frame is due and spins the rest of the way,
+then hands the frame straight to the controller with TxScheduler::sendNow. Frames go out exactly as recorded,
+payload generators are not applied.
+*/
+class ReplayEngine
+{
+public:
+    ReplayEngine();
+    bool beginUpload(uint32_t size);
+    bool addData(uint32_t offset, uint8_t *data, uint32_t length);
+    bool start(uint16_t loops, uint16_t speed, uint8_t *busMap);
+    void stop();
+    REPLAY_STATE getState() { return state.load(); }
+    uint32_t getSize() { return size; }
+    uint32_t getUploaded() { return filled.load(); }
+    uint32_t getPosition() { return position; }
+    uint16_t getLoops() { return loops; }
+    uint16_t getSpeed() { return speed; }
+    REPLAY_STATS *getStats() { return &stats; }
+
+private:
+    uint8_t *buffer;
+    uint32_t size;
+    std::atomic<uint32_t> filled;   //bytes uploaded so far. Only ever grows during an upload
+    uint32_t position;              //next entry to play
+    std::atomic<REPLAY_STATE> state;
+    std::atomic<bool> stopRequested;
+    uint16_t loops;                 //0 = until stopped
+    uint16_t speed;                 //percent, 100 = as recorded
+    uint8_t busMap[NUM_BUSES];      //bus each recorded bus goes out on, 0xFF = not sent
+    REPLAY_STATS stats;
+    TaskHandle_t task;
+    esp_timer_handle_t timer;
+    uint64_t lastBlocked;           //last time the task gave up the CPU
+
+    bool startTask();
+    void play();
+    bool waitUntil(uint64_t target);
+    bool waitForData(uint32_t needed);
+    void yieldIfBusy(uint64_t nextDue);
+    int decodeEntry(uint32_t pos, uint32_t available, int32_t &delta, CAN_FRAME &frame, CAN_FRAME_FD &fdFrame,
+                    bool &isFD, int &bus);
+    static void timerCallback(void *param);
+    static void taskLoop(void *param);
+};
@@ -0,0 +1,150 @@
+#include "staging_queue.h"
+#include "frame_router.h"
+#include "utility.h"
+
+StagingQueue::StagingQueue()
+{
+    buffer = nullptr;
+    size = 0;
+    inPSRAM = false;
+    head = 0;
+    tail = 0;
+    used = 0;
+    waiting = 0;
+    highWater = 0;
+    highWaterFrames = 0;
+    staged = 0;
+    backlogStart = 0;
+    longestBacklog = 0;
+    dropped = 0;
+}
+
+/*
+0 turns staging off. Anything still queued is thrown away. Without PSRAM a size over STAGING_MAX_INTERNAL
+gets a pool of STAGING_MAX_INTERNAL instead. False if there wasn't even the memory for that, staging is off then.
+*/
+bool StagingQueue::setSize(uint32_t bytes)
+{
+    if (buffer) heap_caps_free(buffer);
+    buffer = nullptr;
+    size = 0;
+    inPSRAM = false;
+    head = tail = used = waiting = 0;
+    if (bytes == 0) return true;
+    if (bytes < STAGE_MAX_RECORD) bytes = STAGE_MAX_RECORD;
+    if (bytes > STAGING_MAX_SIZE) bytes = STAGING_MAX_SIZE;
+
+    buffer = (uint8_t *)Utility::allocLarge(bytes, STAGING_MAX_INTERNAL, &inPSRAM);
+    if (!buffer && bytes > STAGING_MAX_INTERNAL)
+    {
+        bytes = STAGING_MAX_INTERNAL;
+        buffer = (uint8_t *)Utility::allocLarge(bytes, STAGING_MAX_INTERNAL, &inPSRAM);
+    }
+    if (!buffer) return false;
+    size = bytes;
+    return true;
+}
+
+void StagingQueue::push(CAN_FRAME &frame, int whichBus)
+{
+    uint8_t flags = (whichBus & STAGE_FLAG_BUS) | (frame.extended ? STAGE_FLAG_EXT : 0);
+    pushRecord(flags, frame.timestamp, frame.id, (frame.length > 8) ? 8 : frame.length, frame.data.uint8);
+}
+
+void StagingQueue::push(CAN_FRAME_FD &frame, int whichBus)
+{
+    uint8_t flags = (whichBus & STAGE_FLAG_BUS) | STAGE_FLAG_FD | (frame.extended ? STAGE_FLAG_EXT : 0);
+    pushRecord(flags, frame.timestamp, frame.id, (frame.length > 64) ? 64 : frame.length, frame.data.uint8);
+}
+
+//Captured frames only come in while hasRoom() is true. Frames from anywhere else can still find it full
+void StagingQueue::pushRecord(uint8_t flags, uint32_t timestamp, uint32_t id, uint8_t length, uint8_t *data)
+{
+    if (!hasRoom())
+    {
+        dropped++;
+        return;
+    }
+    uint8_t header[STAGE_HEADER];
+    header[0] = flags;
+    header[1] = length;
+    Utility::writeLE32(&header[2], timestamp);
+    Utility::writeLE32(&header[6], id);
+    if (used == 0) backlogStart = millis();
+    put(header, STAGE_HEADER);
+    put(data, length);
+    waiting++;
+    staged++;
+    if (used > highWater) highWater = used;
+    if (waiting > highWaterFrames) highWaterFrames = waiting;
+}
+
+//Hands frames to the router for as long as the sinks the oldest one is routed to have room for it.
+//The first byte of a record is its flags, which carry the bus
+void StagingQueue::drain()
+{
+    uint8_t header[STAGE_HEADER];
+    CAN_FRAME frame;
+    CAN_FRAME_FD fdFrame;
+
+    while (used && frameRouter.hasRoomForFrame(buffer[tail] & STAGE_FLAG_BUS))
+    {
+        get(header, STAGE_HEADER);
+        int whichBus = header[0] & STAGE_FLAG_BUS;
+        if (header[0] & STAGE_FLAG_FD)
+        {
+            fdFrame.timestamp = Utility::readLE32(&header[2]);
+            fdFrame.id = Utility::readLE32(&header[6]);
+            fdFrame.extended = (header[0] & STAGE_FLAG_EXT) != 0;
+            fdFrame.fdMode = 1;
+            fdFrame.length = header[1];
+            get(fdFrame.data.uint8, header[1]);
+            frameRouter.routeFrame(fdFrame, whichBus);
+        }
+        else
+        {
+            frame.timestamp = Utility::readLE32(&header[2]);
+            frame.id = Utility::readLE32(&header[6]);
+            frame.extended = (header[0] & STAGE_FLAG_EXT) != 0;
+            frame.rtr = 0;
+            frame.length = header[1];
+            get(frame.data.uint8, header[1]);
+            frameRouter.routeFrame(frame, whichBus);
+        }
+        waiting--;
+        if (used == 0)
+        {
+            uint32_t backlog = millis() - backlogStart;
+            if (backlog > longestBacklog) longestBacklog = backlog;
+        }
+    }
+}
+
+void StagingQueue::resetHighWater()
+{
+    highWater = used;
+    highWaterFrames = waiting;
+    staged = 0;
+    longestBacklog = 0;
+    dropped = 0;
+}
+
+void StagingQueue::put(uint8_t *bytes, uint32_t length)
+{
+    uint32_t first = size - head;
+    if (first > length) first = length;
+    memcpy(&buffer[head], bytes, first);
+    memcpy(buffer, bytes + first, length - first);
+    head = (head + length) % size;
+    used += length;
+}
+
+void StagingQueue::get(uint8_t *bytes, uint32_t length)
+{
+    uint32_t first = size - tail;
+    if (first > length) first = length;
+    memcpy(bytes, &buffer[tail], first);
+    memcpy(bytes + first, buffer, length - first);
+    tail = (tail + length) % size;
+    used -= length;
+}
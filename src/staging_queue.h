@@ -0,0 +1,62 @@
+#pragma once
+#include <Arduino.h>
+#include "config.h"
+#include "esp32_can.h"
+
+//Staged frame header: <flags> <length> <timestamp u32> <id u32> then length bytes of data
+#define STAGE_HEADER        10
+#define STAGE_MAX_RECORD    (STAGE_HEADER + 64)
+#define STAGE_FLAG_BUS      0x07
+#define STAGE_FLAG_FD       0x08
+#define STAGE_FLAG_EXT      0x10
+
+/*
+Elastic queue in front of the frame router for when the outputs stall. A CommBuffer ring only holds a few
+KB, a WiFi hiccup or a host that stops reading fills it in milliseconds and then CANManager stops draining
+the controllers and frames are lost in hardware. With staging on, frames headed out that the router has no
+room for are packed in here instead, in order, and hasOutputRoom() only goes false once this is full too.
+CANManager::loop empties it into the router first thing every time around, so it catches up as fast as the
+link takes the data. It goes in PSRAM when the board has it, otherwise it is capped at STAGING_MAX_INTERNAL.
+Only used from the main loop.
+*/
+class StagingQueue
+{
+public:
+    StagingQueue();
+    bool setSize(uint32_t bytes);
+    bool isActive() { return buffer != nullptr; }
+    bool isEmpty() { return used == 0; }
+    bool hasRoom() { return (size - used) >= STAGE_MAX_RECORD; }
+    void push(CAN_FRAME &frame, int whichBus);
+    void push(CAN_FRAME_FD &frame, int whichBus);
+    void drain();
+    void resetHighWater();
+    uint32_t getSize() { return size; }
+    bool isInPSRAM() { return inPSRAM; }
+    uint32_t getUsed() { return used; }
+    uint32_t getWaiting() { return waiting; }
+    uint32_t getHighWater() { return highWater; }
+    uint32_t getHighWaterFrames() { return highWaterFrames; }
+    uint32_t getStaged() { return staged; }
+    uint32_t getLongestBacklog() { return longestBacklog; }
+    uint32_t getDropped() { return dropped; }
+
+private:
+    uint8_t *buffer;
+    uint32_t size;
+    bool inPSRAM;
+    uint32_t head;              //offset the next record is written at
+    uint32_t tail;              //offset of the oldest record
+    uint32_t used;
+    uint32_t waiting;           //frames in the queue
+    uint32_t highWater;         //most bytes and frames it has held at once
+    uint32_t highWaterFrames;
+    uint32_t staged;            //frames that have gone through the queue instead of straight out
+    uint32_t backlogStart;      //millis() when the queue last went from empty to not
+    uint32_t longestBacklog;    //longest the queue has taken to empty out again, ms
+    uint32_t dropped;           //frames pushed with the queue already full
+
+    void pushRecord(uint8_t flags, uint32_t timestamp, uint32_t id, uint8_t length, uint8_t *data);
+    void put(uint8_t *bytes, uint32_t length);
+    void get(uint8_t *bytes, uint32_t length);
+};
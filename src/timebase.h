@@ -0,0 +1,23 @@
+#pragma once
+#include <Arduino.h>
+#include <esp_timer.h>
+
+/*
+Device time. micros() is the low 32 bits of the esp_timer count and wraps about every 71 minutes.
+The full 64 bit count never wraps so anything that needs to survive a long capture works in that.
+*/
+class TimeBase
+{
+public:
+    static uint64_t now()
+    {
+        return (uint64_t)esp_timer_get_time();
+    }
+
+    //Rebuild the 64 bit time for a 32 bit micros() stamp. Only valid for stamps taken within the last ~71 minutes
+    static uint64_t extend(uint32_t stamp)
+    {
+        uint64_t current = now();
+        return current - (uint32_t)((uint32_t)current - stamp);
+    }
+};
@@ -0,0 +1,248 @@
+#include "tx_scheduler.h"
+#include "can_manager.h"
+#include "frame_bits.h"
+#include "frame_generator.h"
+#include "driver/twai.h"
+
+TxScheduler::TxScheduler()
+{
+    for (int i = 0; i < NUM_BUSES; i++)
+    {
+        buses[i].lastSent = 0;
+        buses[i].sequence = 0;
+        buses[i].lock = nullptr;
+        buses[i].directBits = 0;
+        buses[i].directFrames = 0;
+        memset(&buses[i].stats, 0, sizeof(TX_STATS));
+    }
+    statusTimer = 0;
+    lastTWAIFailed = 0;
+    lastTWAIArbLost = 0;
+}
+
+void TxScheduler::setup()
+{
+    for (int i = 0; i < NUM_BUSES; i++)
+    {
+        if (!buses[i].lock) buses[i].lock = xSemaphoreCreateMutex();
+    }
+}
+
+//The frame goes straight out if nothing is waiting ahead of it and the gap allows. False if it had to be dropped.
+bool TxScheduler::queueFrame(int whichBus, CAN_FRAME &frame, TX_PRIORITY priority)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES || !canBuses[whichBus]) return false;
+    if (priority >= NUM_TX_PRIORITIES) priority = TX_PRIO_NORMAL;
+    TX_BUS *bus = &buses[whichBus];
+
+    CAN_FRAME queued = frame;
+    queued.timestamp = bus->sequence;
+    if (!bus->queues[priority].begin(TX_QUEUE_SIZE) || !bus->queues[priority].push(queued))
+    {
+        bus->stats.dropped++;
+        return false;
+    }
+    bus->sequence++;
+    bus->stats.queued++;
+    serviceBus(whichBus);
+    return true;
+}
+
+bool TxScheduler::queueFrame(int whichBus, CAN_FRAME_FD &frame)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES || !canBuses[whichBus]) return false;
+    TX_BUS *bus = &buses[whichBus];
+
+    CAN_FRAME_FD queued = frame;
+    queued.timestamp = bus->sequence;
+    if (!bus->fdQueue.begin(TX_FD_QUEUE_SIZE) || !bus->fdQueue.push(queued))
+    {
+        bus->stats.dropped++;
+        return false;
+    }
+    bus->sequence++;
+    bus->stats.queued++;
+    serviceBus(whichBus);
+    return true;
+}
+
+void TxScheduler::loop()
+{
+    for (int i = 0; i < SysSettings.numBuses; i++) serviceBus(i);
+    if ((millis() - statusTimer) >= TX_STATUS_INTERVAL)
+    {
+        statusTimer = millis();
+        readControllerStatus();
+    }
+}
+
+void TxScheduler::serviceBus(int whichBus)
+{
+    TX_BUS *bus = &buses[whichBus];
+    //someone else has the controller right now. Whatever is waiting goes on the next pass
+    if (bus->lock && xSemaphoreTake(bus->lock, 0) != pdTRUE) return;
+    if (bus->directFrames)
+    {
+        canManager.addBitCount(whichBus, bus->directBits, bus->directFrames);
+        bus->directBits = 0;
+        bus->directFrames = 0;
+    }
+    sendQueued(whichBus);
+    if (bus->lock) xSemaphoreGive(bus->lock);
+}
+
+//Hand frames to the controller until it is out of room, the queues are empty or the gap says to wait
+void TxScheduler::sendQueued(int whichBus)
+{
+    TX_BUS *bus = &buses[whichBus];
+    CAN_COMMON *port = canBuses[whichBus];
+    uint32_t gap = settings.txGap[whichBus];
+
+    while (port)
+    {
+        if (gap && (micros() - bus->lastSent) < gap) return;
+
+        CAN_FRAME *frame = bus->queues[TX_PRIO_HIGH].peek();
+        CAN_FRAME_FD *fdFrame = nullptr;
+        int priority = TX_PRIO_HIGH;
+        if (!frame)
+        {
+            priority = TX_PRIO_NORMAL;
+            frame = bus->queues[TX_PRIO_NORMAL].peek();
+            fdFrame = bus->fdQueue.peek();
+            if (frame && fdFrame)
+            {
+                //whichever was queued first
+                if ((int32_t)(fdFrame->timestamp - frame->timestamp) < 0) frame = nullptr;
+                else fdFrame = nullptr;
+            }
+            if (!frame && !fdFrame)
+            {
+                priority = TX_PRIO_LOW;
+                frame = bus->queues[TX_PRIO_LOW].peek();
+            }
+        }
+        if (!frame && !fdFrame) return;
+
+        //generator rules fill in the frame now it is going out. Filling it in again on a retry is harmless,
+        //counters only move on once the controller takes it
+        bool accepted;
+        if (fdFrame)
+        {
+            frameGenerator.apply(whichBus, *fdFrame);
+            accepted = port->sendFrameFD(*fdFrame);
+        }
+        else
+        {
+            frameGenerator.apply(whichBus, *frame);
+            accepted = port->sendFrame(*frame);
+        }
+        if (!accepted)
+        {
+            bus->stats.busy++;
+            return;
+        }
+        if (fdFrame)
+        {
+            CAN_FRAME_FD sent;
+            bus->fdQueue.pop(sent);
+            frameGenerator.advance(whichBus, sent);
+            canManager.addBits(whichBus, sent);
+        }
+        else
+        {
+            CAN_FRAME sent;
+            bus->queues[priority].pop(sent);
+            frameGenerator.advance(whichBus, sent);
+            canManager.addBits(whichBus, sent);
+        }
+        bus->stats.sent++;
+        bus->lastSent = micros();
+    }
+}
+
+/*
+Straight to the controller from any task, without waiting behind the queues or for the gap. Frames sent
+after it still keep the gap from this one. Its bus load is counted the next time the main loop services the
+bus since the load figures belong to that loop.
+*/
+bool TxScheduler::sendNow(int whichBus, CAN_FRAME &frame)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return false;
+    TX_BUS *bus = &buses[whichBus];
+    CAN_COMMON *port = canBuses[whichBus];
+    if (!port || !bus->lock) return false;
+
+    xSemaphoreTake(bus->lock, portMAX_DELAY);
+    bool accepted = port->sendFrame(frame);
+    if (accepted)
+    {
+        bus->stats.sent++;
+        bus->lastSent = micros();
+        bus->directBits += FrameBits::classicBits(frame);
+        bus->directFrames++;
+    }
+    else bus->stats.busy++;
+    xSemaphoreGive(bus->lock);
+    return accepted;
+}
+
+bool TxScheduler::sendNow(int whichBus, CAN_FRAME_FD &frame)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return false;
+    TX_BUS *bus = &buses[whichBus];
+    CAN_COMMON *port = canBuses[whichBus];
+    if (!port || !bus->lock) return false;
+
+    xSemaphoreTake(bus->lock, portMAX_DELAY);
+    bool accepted = port->sendFrameFD(frame);
+    if (accepted)
+    {
+        bus->stats.sent++;
+        bus->lastSent = micros();
+        bus->directBits += FrameBits::fdLoadBits(frame, settings.canSettings[whichBus].nomSpeed,
+                                                 settings.canSettings[whichBus].fdSpeed);
+        bus->directFrames++;
+    }
+    else bus->stats.busy++;
+    xSemaphoreGive(bus->lock);
+    return accepted;
+}
+
+/*
+The built in controller is always CAN0. Its driver keeps running totals of failed transmissions and lost
+arbitration which are read here rather than taking its alerts, those belong to the CAN library. The totals
+start over from zero whenever the driver is reinstalled.
+*/
+void TxScheduler::readControllerStatus()
+{
+    twai_status_info_t status;
+    if (twai_get_status_info(&status) != ESP_OK) return;
+
+    if (status.tx_failed_count < lastTWAIFailed) lastTWAIFailed = 0;
+    if (status.arb_lost_count < lastTWAIArbLost) lastTWAIArbLost = 0;
+    buses[0].stats.failed += status.tx_failed_count - lastTWAIFailed;
+    buses[0].stats.arbLost += status.arb_lost_count - lastTWAIArbLost;
+    lastTWAIFailed = status.tx_failed_count;
+    lastTWAIArbLost = status.arb_lost_count;
+}
+
+uint32_t TxScheduler::getWaiting(int whichBus)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return 0;
+    uint32_t waiting = buses[whichBus].fdQueue.count();
+    for (int i = 0; i < NUM_TX_PRIORITIES; i++) waiting += buses[whichBus].queues[i].count();
+    return waiting;
+}
+
+TX_STATS *TxScheduler::getStats(int whichBus)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return nullptr;
+    return &buses[whichBus].stats;
+}
+
+void TxScheduler::resetStats(int whichBus)
+{
+    if (whichBus < 0 || whichBus >= NUM_BUSES) return;
+    memset(&buses[whichBus].stats, 0, sizeof(TX_STATS));
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <Arduino.h>
+#include "freertos/semphr.h"
+#include "config.h"
+#include "frame_ring.h"
+
+class CAN_FRAME;
+class CAN_FRAME_FD;
+
+enum TX_PRIORITY
+{
+    TX_PRIO_HIGH = 0,   //diagnostic requests, anything a reply is being waited on for
+    TX_PRIO_NORMAL = 1, //frames the host sends
+    TX_PRIO_LOW = 2,    //background traffic that can wait
+    NUM_TX_PRIORITIES
+};
+
+typedef struct {
+    uint32_t queued;    //taken into the scheduler
+    uint32_t sent;      //handed to the controller
+    uint32_t dropped;   //turned away because the queue for that priority was full
+    uint32_t failed;    //controller says the transmission failed. Only the built in (TWAI) controller reports this
+    uint32_t arbLost;   //controller says arbitration was lost. Built in controller only
+    uint32_t busy;      //times the controller had no room so the frame stayed queued
+} TX_STATS;
+
+typedef struct {
+    FrameRing<CAN_FRAME> queues[NUM_TX_PRIORITIES];
+    FrameRing<CAN_FRAME_FD> fdQueue;
+    uint32_t lastSent;  //micros() the last frame went to the controller
+    uint32_t sequence;  //order frames were queued in, kept in the timestamp of a waiting frame
+    TX_STATS stats;
+    SemaphoreHandle_t lock; //held by whoever is handing frames to the controller
+    uint32_t directBits;    //sent by sendNow and not yet counted in the bus load
+    uint32_t directFrames;
+} TX_BUS;
+
+/*
+Per bus transmit queues. Frames wait in one queue per priority and go to the controller highest priority
+first and in order within a priority. FD frames have a queue of their own and go with the normal priority
+frames in the order they were queued. With a gap set for the bus frames are handed to the controller at
+least that many microseconds apart. A frame the controller has no room for stays at the head of its queue
+until there is. Queues are allocated the first time a bus sends something.
+sendNow skips the queues and the gap for frames that have to go out at an exact time, such as the cyclic table.
+*/
+class TxScheduler
+{
+public:
+    TxScheduler();
+    void setup();
+    bool queueFrame(int whichBus, CAN_FRAME &frame, TX_PRIORITY priority);
+    bool queueFrame(int whichBus, CAN_FRAME_FD &frame);
+    bool sendNow(int whichBus, CAN_FRAME &frame);
+    bool sendNow(int whichBus, CAN_FRAME_FD &frame);
+    void loop();
+    uint32_t getWaiting(int whichBus);
+    TX_STATS *getStats(int whichBus);
+    void resetStats(int whichBus);
+
+private:
+    TX_BUS buses[NUM_BUSES];
+    uint32_t statusTimer;
+    uint32_t lastTWAIFailed;
+    uint32_t lastTWAIArbLost;
+
+    void serviceBus(int whichBus);
+    void sendQueued(int whichBus);
+    void readControllerStatus();
+};
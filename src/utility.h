@@ -1,8 +1,22 @@
 #pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <esp_heap_caps.h>
 
 class Utility
 {
 public:
+    //Big buffers go in PSRAM on boards that have it. Without it they come out of internal RAM but only up to
+    //internalLimit bytes so one buffer can't take the RAM WiFi needs. Free with heap_caps_free.
+    static void *allocLarge(size_t size, size_t internalLimit, bool *inPSRAM = nullptr)
+    {
+        void *mem = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (inPSRAM) *inPSRAM = (mem != nullptr);
+        if (mem || size > internalLimit) return mem;
+        return heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
+
     static unsigned int parseHexCharacter(char chr)
     {
         unsigned int result = 0;
@@ -19,4 +33,140 @@ public:
         for (int i = 0; i < length; i++) result += parseHexCharacter(str[i]) << (4 * (length - i - 1));
         return result;
     }
-};
\ No newline at end of file
+
+    //little endian packing used by the binary protocols
+    static void writeLE16(uint8_t *buf, uint16_t val)
+    {
+        buf[0] = val & 0xFF;
+        buf[1] = val >> 8;
+    }
+
+    static void writeLE32(uint8_t *buf, uint32_t val)
+    {
+        for (int i = 0; i < 4; i++) buf[i] = (uint8_t)(val >> (8 * i));
+    }
+
+    static void writeLE64(uint8_t *buf, uint64_t val)
+    {
+        for (int i = 0; i < 8; i++) buf[i] = (uint8_t)(val >> (8 * i));
+    }
+
+    static uint16_t readLE16(uint8_t *buf)
+    {
+        return buf[0] | (buf[1] << 8);
+    }
+
+    static uint32_t readLE32(uint8_t *buf)
+    {
+        uint32_t val = 0;
+        for (int i = 3; i >= 0; i--) val = (val << 8) | buf[i];
+        return val;
+    }
+
+    static uint64_t readLE64(uint8_t *buf)
+    {
+        uint64_t val = 0;
+        for (int i = 7; i >= 0; i--) val = (val << 8) | buf[i];
+        return val;
+    }
+
+    //CRC-8, polynomial 0x07 and no final XOR (CRC-8/SMBUS). Pass the previous result as crc to continue a run.
+    static uint8_t crc8(const uint8_t *buf, size_t length, uint8_t crc = 0)
+    {
+        static const uint8_t table[256] = {
+            0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15, 0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D,
+            0x70, 0x77, 0x7E, 0x79, 0x6C, 0x6B, 0x62, 0x65, 0x48, 0x4F, 0x46, 0x41, 0x54, 0x53, 0x5A, 0x5D,
+            0xE0, 0xE7, 0xEE, 0xE9, 0xFC, 0xFB, 0xF2, 0xF5, 0xD8, 0xDF, 0xD6, 0xD1, 0xC4, 0xC3, 0xCA, 0xCD,
+            0x90, 0x97, 0x9E, 0x99, 0x8C, 0x8B, 0x82, 0x85, 0xA8, 0xAF, 0xA6, 0xA1, 0xB4, 0xB3, 0xBA, 0xBD,
+            0xC7, 0xC0, 0xC9, 0xCE, 0xDB, 0xDC, 0xD5, 0xD2, 0xFF, 0xF8, 0xF1, 0xF6, 0xE3, 0xE4, 0xED, 0xEA,
+            0xB7, 0xB0, 0xB9, 0xBE, 0xAB, 0xAC, 0xA5, 0xA2, 0x8F, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9D, 0x9A,
+            0x27, 0x20, 0x29, 0x2E, 0x3B, 0x3C, 0x35, 0x32, 0x1F, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0D, 0x0A,
+            0x57, 0x50, 0x59, 0x5E, 0x4B, 0x4C, 0x45, 0x42, 0x6F, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7D, 0x7A,
+            0x89, 0x8E, 0x87, 0x80, 0x95, 0x92, 0x9B, 0x9C, 0xB1, 0xB6, 0xBF, 0xB8, 0xAD, 0xAA, 0xA3, 0xA4,
+            0xF9, 0xFE, 0xF7, 0xF0, 0xE5, 0xE2, 0xEB, 0xEC, 0xC1, 0xC6, 0xCF, 0xC8, 0xDD, 0xDA, 0xD3, 0xD4,
+            0x69, 0x6E, 0x67, 0x60, 0x75, 0x72, 0x7B, 0x7C, 0x51, 0x56, 0x5F, 0x58, 0x4D, 0x4A, 0x43, 0x44,
+            0x19, 0x1E, 0x17, 0x10, 0x05, 0x02, 0x0B, 0x0C, 0x21, 0x26, 0x2F, 0x28, 0x3D, 0x3A, 0x33, 0x34,
+            0x4E, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5C, 0x5B, 0x76, 0x71, 0x78, 0x7F, 0x6A, 0x6D, 0x64, 0x63,
+            0x3E, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2C, 0x2B, 0x06, 0x01, 0x08, 0x0F, 0x1A, 0x1D, 0x14, 0x13,
+            0xAE, 0xA9, 0xA0, 0xA7, 0xB2, 0xB5, 0xBC, 0xBB, 0x96, 0x91, 0x98, 0x9F, 0x8A, 0x8D, 0x84, 0x83,
+            0xDE, 0xD9, 0xD0, 0xD7, 0xC2, 0xC5, 0xCC, 0xCB, 0xE6, 0xE1, 0xE8, 0xEF, 0xFA, 0xFD, 0xF4, 0xF3,
+        };
+        for (size_t i = 0; i < length; i++) crc = table[crc ^ buf[i]];
+        return crc;
+    }
+
+    //SAE J1850 CRC-8, polynomial 0x1D. Start value and final XOR are both 0xFF for the standard one
+    static uint8_t crc8J1850(const uint8_t *buf, size_t length, uint8_t crc = 0xFF)
+    {
+        static const uint8_t table[256] = {
+            0x00, 0x1D, 0x3A, 0x27, 0x74, 0x69, 0x4E, 0x53, 0xE8, 0xF5, 0xD2, 0xCF, 0x9C, 0x81, 0xA6, 0xBB,
+            0xCD, 0xD0, 0xF7, 0xEA, 0xB9, 0xA4, 0x83, 0x9E, 0x25, 0x38, 0x1F, 0x02, 0x51, 0x4C, 0x6B, 0x76,
+            0x87, 0x9A, 0xBD, 0xA0, 0xF3, 0xEE, 0xC9, 0xD4, 0x6F, 0x72, 0x55, 0x48, 0x1B, 0x06, 0x21, 0x3C,
+            0x4A, 0x57, 0x70, 0x6D, 0x3E, 0x23, 0x04, 0x19, 0xA2, 0xBF, 0x98, 0x85, 0xD6, 0xCB, 0xEC, 0xF1,
+            0x13, 0x0E, 0x29, 0x34, 0x67, 0x7A, 0x5D, 0x40, 0xFB, 0xE6, 0xC1, 0xDC, 0x8F, 0x92, 0xB5, 0xA8,
+            0xDE, 0xC3, 0xE4, 0xF9, 0xAA, 0xB7, 0x90, 0x8D, 0x36, 0x2B, 0x0C, 0x11, 0x42, 0x5F, 0x78, 0x65,
+            0x94, 0x89, 0xAE, 0xB3, 0xE0, 0xFD, 0xDA, 0xC7, 0x7C, 0x61, 0x46, 0x5B, 0x08, 0x15, 0x32, 0x2F,
+            0x59, 0x44, 0x63, 0x7E, 0x2D, 0x30, 0x17, 0x0A, 0xB1, 0xAC, 0x8B, 0x96, 0xC5, 0xD8, 0xFF, 0xE2,
+            0x26, 0x3B, 0x1C, 0x01, 0x52, 0x4F, 0x68, 0x75, 0xCE, 0xD3, 0xF4, 0xE9, 0xBA, 0xA7, 0x80, 0x9D,
+            0xEB, 0xF6, 0xD1, 0xCC, 0x9F, 0x82, 0xA5, 0xB8, 0x03, 0x1E, 0x39, 0x24, 0x77, 0x6A, 0x4D, 0x50,
+            0xA1, 0xBC, 0x9B, 0x86, 0xD5, 0xC8, 0xEF, 0xF2, 0x49, 0x54, 0x73, 0x6E, 0x3D, 0x20, 0x07, 0x1A,
+            0x6C, 0x71, 0x56, 0x4B, 0x18, 0x05, 0x22, 0x3F, 0x84, 0x99, 0xBE, 0xA3, 0xF0, 0xED, 0xCA, 0xD7,
+            0x35, 0x28, 0x0F, 0x12, 0x41, 0x5C, 0x7B, 0x66, 0xDD, 0xC0, 0xE7, 0xFA, 0xA9, 0xB4, 0x93, 0x8E,
+            0xF8, 0xE5, 0xC2, 0xDF, 0x8C, 0x91, 0xB6, 0xAB, 0x10, 0x0D, 0x2A, 0x37, 0x64, 0x79, 0x5E, 0x43,
+            0xB2, 0xAF, 0x88, 0x95, 0xC6, 0xDB, 0xFC, 0xE1, 0x5A, 0x47, 0x60, 0x7D, 0x2E, 0x33, 0x14, 0x09,
+            0x7F, 0x62, 0x45, 0x58, 0x0B, 0x16, 0x31, 0x2C, 0x97, 0x8A, 0xAD, 0xB0, 0xE3, 0xFE, 0xD9, 0xC4,
+        };
+        for (size_t i = 0; i < length; i++) crc = table[crc ^ buf[i]];
+        return crc;
+    }
+
+    /*
+    Text encoders for the capture output. They write straight into out, don't terminate it and return the
+    number of characters written. Digits come from lookup tables, no printf and no division by 16.
+    */
+    static size_t putHex(char *out, uint32_t value, int digits, bool upper = false)
+    {
+        static const char lowerDigits[] = "0123456789abcdef";
+        static const char upperDigits[] = "0123456789ABCDEF";
+        const char *table = upper ? upperDigits : lowerDigits;
+        for (int i = digits - 1; i >= 0; i--)
+        {
+            out[i] = table[value & 0xF];
+            value >>= 4;
+        }
+        return digits;
+    }
+
+    //as few digits as it takes, like %x
+    static size_t putHexTrimmed(char *out, uint32_t value, bool upper = false)
+    {
+        int digits = 1;
+        while (digits < 8 && (value >> (4 * digits))) digits++;
+        return putHex(out, value, digits, upper);
+    }
+
+    //like %u. Two digits at a time from a table of every pair
+    static size_t putDecimal(char *out, uint32_t value)
+    {
+        static const char pairs[] =
+            "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+            "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+        char temp[10];
+        int pos = 10;
+        while (value >= 100)
+        {
+            uint32_t pair = (value % 100) * 2;
+            value /= 100;
+            temp[--pos] = pairs[pair + 1];
+            temp[--pos] = pairs[pair];
+        }
+        if (value >= 10)
+        {
+            temp[--pos] = pairs[(value * 2) + 1];
+            temp[--pos] = pairs[value * 2];
+        }
+        else temp[--pos] = '0' + value;
+        memcpy(out, &temp[pos], 10 - pos);
+        return 10 - pos;
+    }
+};
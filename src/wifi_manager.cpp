@@ -7,11 +7,15 @@
 #include <WiFi.h>
 #include <FastLED.h>
 #include "ELM327_Emulator.h"
+#include "freertos/semphr.h"
 
 extern CRGB leds[A5_NUM_LEDS];
 
 static IPAddress broadcastAddr(255,255,255,255);
 
+//the sender task writes to the clients while loop() may be accepting or dropping them
+static SemaphoreHandle_t clientLock = nullptr;
+
 WiFiManager::WiFiManager()
 {
     lastBroadcast = 0;
@@ -20,6 +24,8 @@ WiFiManager::WiFiManager()
 void WiFiManager::setup()
 {
     if (settings.enableBT != 0) return; //No wifi if BT is on
+    clientLock = xSemaphoreCreateMutex();
+    if (!wifiGVRET.startSender("WiFiTX", WiFiManager::writeToClients)) Serial.println("Could not start WiFi sender task");
     if (settings.wifiMode == 1) //connect to an AP
     {        
         Serial.println("Attempting to connect to a WiFi AP.");
@@ -151,6 +157,7 @@ void WiFiManager::loop()
             {
                 if (wifiServer.hasClient())
                 {
+                    xSemaphoreTake(clientLock, portMAX_DELAY);
                     for(i = 0; i < MAX_CLIENTS; i++)
                     {
                         if (!SysSettings.clientNodes[i] || !SysSettings.clientNodes[i].connected())
@@ -175,6 +182,7 @@ void WiFiManager::loop()
                         //no free/disconnected spot so reject
                         wifiServer.available().stop();
                     }
+                    xSemaphoreGive(clientLock);
                 }
 
                 if (wifiOBDII.hasClient())
@@ -208,13 +216,15 @@ void WiFiManager::loop()
                         if(SysSettings.clientNodes[i].available())
                         {
                             //get data from the telnet client and push it to input processing
-                            while(SysSettings.clientNodes[i].available()) 
+                            uint8_t inBytes[GVRET_READ_CHUNK];
+                            int count;
+                            while((count = SysSettings.clientNodes[i].available()) > 0) 
                             {
-                                uint8_t inByt;
-                                inByt = SysSettings.clientNodes[i].read();
+                                if (count > GVRET_READ_CHUNK) count = GVRET_READ_CHUNK;
+                                count = SysSettings.clientNodes[i].read(inBytes, count);
+                                if (count <= 0) break;
                                 SysSettings.isWifiActive = true;
-                                //Serial.write(inByt); //echo to serial - just for debugging. Don't leave this on!
-                                wifiGVRET.processIncomingByte(inByt);
+                                wifiGVRET.processIncomingBytes(inBytes, count);
                             }
                         }
                     }
@@ -222,7 +232,9 @@ void WiFiManager::loop()
                     {
                         if (SysSettings.clientNodes[i]) 
                         {
+                            xSemaphoreTake(clientLock, portMAX_DELAY);
                             SysSettings.clientNodes[i].stop();
+                            xSemaphoreGive(clientLock);
                             if (SysSettings.fancyLED)
                             {
                                 leds[SysSettings.LED_CONNECTION_STATUS] = CRGB::Green;
@@ -288,16 +300,27 @@ void WiFiManager::loop()
 void WiFiManager::sendBufferedData()
 {
     if (settings.enableBT != 0) return; //No wifi if BT is on
+    wifiGVRET.flushBuffer();
+}
+
+//Called from the WiFi sender task with one filled buffer slot. The lock is only held to copy the client list,
+//a write to a client that has stopped reading can block for the whole TCP timeout and loop() mustn't wait on
+//that. The copies share the socket, so a client loop() stops meanwhile is only closed once the write is done.
+void WiFiManager::writeToClients(uint8_t *bytes, size_t length)
+{
+    WiFiClient targets[MAX_CLIENTS];
+    int count = 0;
+    xSemaphoreTake(clientLock, portMAX_DELAY);
     for(int i = 0; i < MAX_CLIENTS; i++)
     {
-        size_t wifiLength = wifiGVRET.numAvailableBytes();
-        uint8_t* buff = wifiGVRET.getBufferedBytes();
         if (SysSettings.clientNodes[i] && SysSettings.clientNodes[i].connected())
         {
-            SysSettings.clientNodes[i].write(buff, wifiLength);
+            targets[count++] = SysSettings.clientNodes[i];
         }
     }
-    wifiGVRET.clearBufferedBytes();
+    xSemaphoreGive(clientLock);
+
+    for (int i = 0; i < count; i++) targets[i].write(bytes, length);
 }
 
 // Utility to extract header value from headers
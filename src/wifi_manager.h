@@ -11,6 +11,7 @@ public:
     void setup();
     void loop();
     void sendBufferedData();
+    static void writeToClients(uint8_t *bytes, size_t length);
     void attemptOTAUpdate();
     
 private: